@@ -2,7 +2,15 @@ QT       += core gui opengl
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 greaterThan(QT_MAJOR_VERSION, 5): QT += openglwidgets
 
-CONFIG += c++11
+CONFIG += c++11 thread
+
+# run cloth and SPH in float (sums over particles stay in double unless
+# SIM_FLOAT_ACCUMULATORS is defined too)
+#DEFINES += SIM_SINGLE_PRECISION
+
+# let Eigen use the vector instructions of the build machine (AVX2, AVX-512)
+# in the particle kernels, the default is SSE2
+#QMAKE_CXXFLAGS += -march=native
 
 INCLUDEPATH += code
 INCLUDEPATH += code/scenes
@@ -22,6 +30,7 @@ SOURCES += \
     code/main.cpp \
     code/mainwindow.cpp \
     code/model.cpp \
+    code/particlepool.cpp \
     code/particlesystem.cpp \
     code/scenes/scenecloth.cpp \
     code/scenes/scenefountain.cpp \
@@ -53,6 +62,7 @@ HEADERS += \
     code/mainwindow.h \
     code/model.h \
     code/particle.h \
+    code/particlepool.h \
     code/particlesystem.h \
     code/scene.h \
     code/scenes/scenecloth.h \
@@ -5,43 +5,50 @@
 /*
  * Generic function for collision response from contact plane
  */
-void Collider::resolveCollision(Particle* p, const Collision& col, double kElastic, double kFriction) const
+template <typename Scalar>
+void ColliderT<Scalar>::resolveCollision(Particle* p, const Collision& col, double kElastic, double kFriction) const
 {
-    Vec3 past_postion = p->prevPos;
+    // pinned particles are moved by the scene only
+    if (p->isPinned()) return;
+
+    Vec3 past_postion = p->prevPos.template cast<double>();
     Vec3 plane_normal = col.normal;
     double d = -(col.normal.dot(col.position));
 
     //get predicted state
-    Vec3 predicted_postion = p->pos;
-    Vec3 predicted_velocity = p->vel;
+    Vec3 predicted_postion = p->pos.template cast<double>();
+    Vec3 predicted_velocity = p->vel.template cast<double>();
 
     //collision response
     Vec3 new_position = predicted_postion - (1+kElastic)*(plane_normal.dot(predicted_postion)+d)*(plane_normal);
     Vec3 new_velocity = -kElastic * (plane_normal.dot(predicted_velocity)*plane_normal) + ((1-kFriction)*(predicted_velocity - plane_normal.dot(predicted_velocity)*plane_normal));
 
-    p->pos = new_position;
-    p->vel = new_velocity;
+    p->pos = new_position.cast<Scalar>();
+    p->vel = new_velocity.cast<Scalar>();
 }
 
 /*
  * Plane
  */
-bool ColliderPlane::isInside(const Particle* p) const
+template <typename Scalar>
+bool ColliderPlaneT<Scalar>::isInside(const Particle* p) const
 {
-    if(planeN.dot(p->pos) + planeD <= 0){
+    if(planeN.dot(p->pos.template cast<double>()) + planeD <= 0){
         return true;
     }
     return false;
 }
 
-bool ColliderPlane::testCollision(const Particle* p, Collision& colInfo) const
+template <typename Scalar>
+bool ColliderPlaneT<Scalar>::testCollision(const Particle* p, Collision& colInfo) const
 {
 
-    Vec3 r = (p->pos - p->prevPos);
-    double lambda = -(planeN.dot(p->prevPos)+planeD)/(planeN.dot(r));
+    Vec3 p0 = p->prevPos.template cast<double>();
+    Vec3 r = (p->pos.template cast<double>() - p0);
+    double lambda = -(planeN.dot(p0)+planeD)/(planeN.dot(r));
     if(0<=lambda && lambda<=1){
         colInfo.normal = planeN;
-        colInfo.position = p->prevPos+lambda*r;
+        colInfo.position = p0+lambda*r;
         return true;
     }
     return false;
@@ -50,18 +57,21 @@ bool ColliderPlane::testCollision(const Particle* p, Collision& colInfo) const
 /*
  * Sphere
  */
-bool ColliderSphere::isInside(const Particle* p) const
+template <typename Scalar>
+bool ColliderSphereT<Scalar>::isInside(const Particle* p) const
 {
-    if(std::sqrt((p->pos-this->getCenter()).dot((p->pos-this->getCenter()).transpose()))>this->getRadius()){
+    Vec3 d = p->pos.template cast<double>() - this->getCenter();
+    if(std::sqrt(d.dot(d))>this->getRadius()){
         return true;
     }
     return false;
 }
 
-bool ColliderSphere::testCollision(const Particle* p, Collision& colInfo) const
+template <typename Scalar>
+bool ColliderSphereT<Scalar>::testCollision(const Particle* p, Collision& colInfo) const
 {
-    Vec3 p0 = p->prevPos;
-    Vec3 p1 = p->pos;
+    Vec3 p0 = p->prevPos.template cast<double>();
+    Vec3 p1 = p->pos.template cast<double>();
     Vec3 C = this->getCenter();
     double r = this->getRadius();
     Vec3 v = (p1 - p0);
@@ -81,11 +91,12 @@ bool ColliderSphere::testCollision(const Particle* p, Collision& colInfo) const
     return false;
 }
 
-void ColliderSphere::resolveCollision(Particle* p, const Collision& col, double kElastic, double kFriction) const
+template <typename Scalar>
+void ColliderSphereT<Scalar>::resolveCollision(Particle* p, const Collision& col, double kElastic, double kFriction) const
 {
     //define tangent plane to collision then call generic resolve
 
-    ColliderPlane plane = ColliderPlane(col.normal, -(col.normal.dot(col.position)));
+    ColliderPlaneT<Scalar> plane = ColliderPlaneT<Scalar>(col.normal, -(col.normal.dot(col.position)));
 
     plane.resolveCollision(p, col, kElastic, kFriction);
 }
@@ -93,9 +104,10 @@ void ColliderSphere::resolveCollision(Particle* p, const Collision& col, double
 /*
  * AABB
  */
-bool ColliderAABB::isInside(const Particle* p) const
+template <typename Scalar>
+bool ColliderAABBT<Scalar>::isInside(const Particle* p) const
 {
-    Vec3 position = p->prevPos;
+    Vec3 position = p->prevPos.template cast<double>();
     Vec3 min = this->getMin();
     Vec3 max = this->getMax();
     //check if point is within the interval min-max for all axes
@@ -110,11 +122,12 @@ static bool inInterval(Vec3 pos, Vec3 min, Vec3 max) {
     return (min.x() <= pos.x() && pos.x() <= max.x()) && (min.y() <= pos.y() && pos.y() <= max.y()) && (min.z() <= pos.z() && pos.z() <= max.z());
 }
 
-bool ColliderAABB::testCollision(const Particle* p, Collision& colInfo) const // <= this is currently broken. i hate this. very, very much.
+template <typename Scalar>
+bool ColliderAABBT<Scalar>::testCollision(const Particle* p, Collision& colInfo) const // <= this is currently broken. i hate this. very, very much.
 //particle agglomerate to the collided surface instead of bouncing off
 {
-    Vec3 p0 = p->prevPos;
-    Vec3 p1 = p->pos;
+    Vec3 p0 = p->prevPos.template cast<double>();
+    Vec3 p1 = p->pos.template cast<double>();
     Vec3 r = (p1 - p0);
     Vec3 r_inv = Vec3(1/r.x(),1/r.y(),1/r.z());
     Vec3 min = this->getMin();
@@ -171,11 +184,22 @@ bool ColliderAABB::testCollision(const Particle* p, Collision& colInfo) const //
 }
 
 
-void ColliderAABB::resolveCollision(Particle* p, const Collision& col, double kElastic, double kFriction) const
+template <typename Scalar>
+void ColliderAABBT<Scalar>::resolveCollision(Particle* p, const Collision& col, double kElastic, double kFriction) const
 {
     //define tangent plane to collision then call generic resolve
 
-    ColliderPlane plane = ColliderPlane(col.normal, -(col.normal.dot(col.position)));
+    ColliderPlaneT<Scalar> plane = ColliderPlaneT<Scalar>(col.normal, -(col.normal.dot(col.position)));
 
     plane.resolveCollision(p, col, kElastic, kFriction);
 }
+
+
+template class ColliderT<double>;
+template class ColliderPlaneT<double>;
+template class ColliderSphereT<double>;
+template class ColliderAABBT<double>;
+template class ColliderT<float>;
+template class ColliderPlaneT<float>;
+template class ColliderSphereT<float>;
+template class ColliderAABBT<float>;
@@ -12,11 +12,16 @@ struct Collision {
 
 
 // Abstract interface
-class Collider
+// Colliders work on 3D particles of either precision, their own geometry
+// and the collision info stay in double.
+template <typename Scalar = double>
+class ColliderT
 {
 public:
-    Collider() {}
-    virtual ~Collider() {}
+    typedef ParticleT<3, Scalar> Particle;
+
+    ColliderT() {}
+    virtual ~ColliderT() {}
 
     virtual bool isInside(const Particle* p) const = 0;
     virtual bool testCollision(const Particle* p, Collision& colInfo) const = 0;
@@ -26,12 +31,15 @@ public:
 
 
 // Plane
-class ColliderPlane : public Collider
+template <typename Scalar = double>
+class ColliderPlaneT : public ColliderT<Scalar>
 {
 public:
-    ColliderPlane() { planeN = Vec3(0,0,0); planeD = 0; }
-    ColliderPlane(const Vec3& n, double d) : planeN(n), planeD(d) {}
-    virtual ~ColliderPlane() {}
+    typedef typename ColliderT<Scalar>::Particle Particle;
+
+    ColliderPlaneT() { planeN = Vec3(0,0,0); planeD = 0; }
+    ColliderPlaneT(const Vec3& n, double d) : planeN(n), planeD(d) {}
+    virtual ~ColliderPlaneT() {}
 
     void setPlane(const Vec3& n, double d) { this->planeN = n; this->planeD = d; }
 
@@ -45,12 +53,15 @@ protected:
 
 
 // Sphere
-class ColliderSphere : public Collider
+template <typename Scalar = double>
+class ColliderSphereT : public ColliderT<Scalar>
 {
 public:
-    ColliderSphere() { center = Vec3(0,0,0); radius = 0; }
-    ColliderSphere(const Vec3& c, double r) : center(c), radius(r) {}
-    virtual ~ColliderSphere() {}
+    typedef typename ColliderT<Scalar>::Particle Particle;
+
+    ColliderSphereT() { center = Vec3(0,0,0); radius = 0; }
+    ColliderSphereT(const Vec3& c, double r) : center(c), radius(r) {}
+    virtual ~ColliderSphereT() {}
 
     void setCenter(const Vec3& c) { center = c; }
     void setRadius(double r) { radius = r; }
@@ -69,13 +80,16 @@ protected:
 
 
 // Axis Aligned Bounding Box
-class ColliderAABB : public Collider
+template <typename Scalar = double>
+class ColliderAABBT : public ColliderT<Scalar>
 {
 public:
-    ColliderAABB() { bmin = bmax = center = size = Vec3(0,0,0); }
-    ColliderAABB(const Vec3& bmin, const Vec3& bmax)
+    typedef typename ColliderT<Scalar>::Particle Particle;
+
+    ColliderAABBT() { bmin = bmax = center = size = Vec3(0,0,0); }
+    ColliderAABBT(const Vec3& bmin, const Vec3& bmax)
         : bmin(bmin), bmax(bmax), center(0.5*(bmin + bmax)), size(bmax - bmin)  {}
-    virtual ~ColliderAABB() {}
+    virtual ~ColliderAABBT() {}
 
     void setFromBounds(const Vec3& bmin, const Vec3& bmax) {
         this->bmin = bmin; this->bmax = bmax; center = 0.5*(bmin + bmax); size = bmax - bmin;
@@ -125,4 +139,10 @@ protected:
 // };
 
 
+typedef ColliderT<double>       Collider;
+typedef ColliderPlaneT<double>  ColliderPlane;
+typedef ColliderSphereT<double> ColliderSphere;
+typedef ColliderAABBT<double>   ColliderAABB;
+
+
 #endif // COLLIDERS_H
@@ -10,6 +10,16 @@ typedef Eigen::Vector3i Vec3i;
 typedef Eigen::VectorXd Vecd;
 typedef Eigen::MatrixXd Matd;
 
+// Storage precision of the scenes that don't need doubles (cloth, SPH).
+// Build with DEFINES += SIM_SINGLE_PRECISION to run them in float.
+#ifdef SIM_SINGLE_PRECISION
+typedef float Real;
+#else
+typedef double Real;
+#endif
+typedef Eigen::Matrix<Real, 3, 1> Vec3r;
+typedef Eigen::Matrix<Real, Eigen::Dynamic, 1> Vecr;
+
 #include "Random/random.hpp"
 using Random = effolkronium::random_static;
 
@@ -29,6 +39,17 @@ namespace Math {
     inline double toDeg(double a) {
         return a*180.0/M_PI;
     }        
+
+    // Type to sum many T values in. Float storage still reduces in double,
+    // unless built with SIM_FLOAT_ACCUMULATORS.
+    template<typename T> struct Accumulator {
+        typedef double type;
+    };
+#ifdef SIM_FLOAT_ACCUMULATORS
+    template<> struct Accumulator<float> {
+        typedef float type;
+    };
+#endif
 }
 
 
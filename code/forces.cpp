@@ -1,26 +1,153 @@
 #include "forces.h"
+#include "particlesystem.h"
+#include <thread>
+#include <limits>
 
-void ForceConstAcceleration::apply() {
-    for (Particle* p : particles) {
-        // TODO
-        p->force += p->mass * this->getAcceleration();
+namespace {
+    // Starting threads costs tens of microseconds, chunks are never smaller than this.
+    const unsigned int minChunk = 8192;
+
+    // grain: the smallest chunk worth a thread, lower for the costly items
+    unsigned int parallelChunks(unsigned int n, unsigned int threads, unsigned int grain = minChunk) {
+        return std::max(1u, std::min(threads, n/grain));
+    }
+
+    // Calls f(begin, end) over [0, n) split in chunks, one thread each.
+    template <typename Function>
+    void parallelFor(unsigned int n, unsigned int threads, Function f, unsigned int grain = minChunk) {
+        const unsigned int chunks = parallelChunks(n, threads, grain);
+        if (chunks == 1) {
+            f(0u, n);
+            return;
+        }
+        std::vector<std::thread> workers;
+        for (unsigned int c = 1; c < chunks; c++) {
+            workers.push_back(std::thread(f, (unsigned int)(size_t(n)*c/chunks),
+                                          (unsigned int)(size_t(n)*(c + 1)/chunks)));
+        }
+        f(0u, (unsigned int)(size_t(n)/chunks));
+        for (std::thread& w : workers) w.join();
+    }
+
+    // Sorts chunks of v in parallel, then merges them pairwise, a round of merges at a time.
+    template <typename T>
+    void parallelSort(std::vector<T>& v, unsigned int threads) {
+        const unsigned int n = v.size();
+        const unsigned int chunks = parallelChunks(n, threads);
+        std::vector<unsigned int> bounds(chunks + 1);
+        for (unsigned int c = 0; c <= chunks; c++) bounds[c] = (unsigned int)(size_t(n)*c/chunks);
+        parallelFor(chunks, chunks, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int c = begin; c < end; c++) std::sort(v.begin() + bounds[c], v.begin() + bounds[c + 1]);
+        }, 1);
+        for (unsigned int width = 1; width < chunks; width *= 2) {
+            const unsigned int merges = (chunks - width + 2*width - 1)/(2*width);
+            parallelFor(merges, merges, [&](unsigned int begin, unsigned int end) {
+                for (unsigned int m = begin; m < end; m++) {
+                    const unsigned int c = 2*width*m;
+                    std::inplace_merge(v.begin() + bounds[c], v.begin() + bounds[c + width],
+                                       v.begin() + bounds[std::min(c + 2*width, chunks)]);
+                }
+            }, 1);
+        }
+    }
+
+    // the bits of x spread to every Dim-th bit, for the Morton codes
+    inline unsigned long long spreadBits(unsigned long long x, int dim) {
+        if (dim == 2) {
+            x &= 0xffffffffull;
+            x = (x | (x << 16)) & 0x0000ffff0000ffffull;
+            x = (x | (x <<  8)) & 0x00ff00ff00ff00ffull;
+            x = (x | (x <<  4)) & 0x0f0f0f0f0f0f0f0full;
+            x = (x | (x <<  2)) & 0x3333333333333333ull;
+            x = (x | (x <<  1)) & 0x5555555555555555ull;
+        }
+        else if (dim == 3) {
+            x &= 0x1fffffull;
+            x = (x | (x << 32)) & 0x001f00000000ffffull;
+            x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+            x = (x | (x <<  8)) & 0x100f00f00f00f00full;
+            x = (x | (x <<  4)) & 0x10c30c30c30c30c3ull;
+            x = (x | (x <<  2)) & 0x1249249249249249ull;
+        }
+        return x;
+    }
+}
+
+template <int Dim, typename Scalar>
+const std::vector<typename ForceT<Dim, Scalar>::Particle*>& ForceT<Dim, Scalar>::getSystemParticles() const {
+    return system->getParticles();
+}
+
+template <int Dim, typename Scalar>
+void ForceT<Dim, Scalar>::changed() {
+    if (system) system->markStateChanged();
+}
+
+template <int Dim, typename Scalar>
+bool ForceT<Dim, Scalar>::getInfluencedIndices(unsigned int& first, unsigned int& count) const {
+    if (!system || (mode != InfluenceAll && mode != InfluenceRange)) return false;
+    unsigned int n = system->getNumParticles();
+    first = mode == InfluenceAll ? 0 : std::min(rangeFirst, n);
+    count = mode == InfluenceAll ? n : std::min(rangeCount, n - first);
+    return true;
+}
+
+template <int Dim, typename Scalar>
+void ForceConstAccelerationT<Dim, Scalar>::apply() {
+    unsigned int first, count;
+    if (this->getInfluencedIndices(first, count)) {
+        // straight on the system arrays: f += a * m for every column
+        this->system->getForcesView().middleCols(first, count).noalias()
+                += acceleration * this->system->getMassesView().segment(first, count);
+        return;
     }
+    this->forEachInfluenced([this](Particle* p) {
+        p->force += p->mass * this->getAcceleration();
+    });
 }
 
-void ForceDrag::apply() {
-    for (Particle* p : particles) {
+template <int Dim, typename Scalar>
+void ForceDragT<Dim, Scalar>::apply() {
+    this->forEachInfluenced([this](Particle* p) {
         p->force += -this->klinear * p->vel; //Stokes drag
         p->force += -this->kquadratic * p->vel.norm() * p->vel;
-    }
+    });
 }
 
-void ForceSpring::apply() {
-    if (particles.size() < 2) return;
+template <int Dim, typename Scalar>
+void ForceDragT<Dim, Scalar>::addJacobianProduct(Scalar, Scalar kv, const Scalar* y, Scalar* out) const {
+    // df/dv = -(k1 + k2|v|) I - k2 v v^T/|v|
+    this->forEachInfluenced([&](Particle* p) {
+        const int i = this->system->getParticleIndex(p);
+        if (i < 0) return;
+        const Scalar speed = p->vel.norm();
+        Eigen::Map<const VecN> yi(y + Dim*i);
+        Eigen::Map<VecN> oi(out + Dim*i);
+        oi -= kv*(this->klinear + this->kquadratic*speed)*yi;
+        if (speed > 0) oi -= kv*this->kquadratic*p->vel.dot(yi)/speed*p->vel;
+    });
+}
+
+template <int Dim, typename Scalar>
+void ForceDragT<Dim, Scalar>::addJacobianDiagonal(Scalar, Scalar kv, Scalar* diag) const {
+    this->forEachInfluenced([&](Particle* p) {
+        const int i = this->system->getParticleIndex(p);
+        if (i < 0) return;
+        const Scalar speed = p->vel.norm();
+        Eigen::Map<VecN> di(diag + Dim*i);
+        di.array() -= kv*(this->klinear + this->kquadratic*speed);
+        if (speed > 0) di -= kv*this->kquadratic/speed*p->vel.cwiseAbs2();
+    });
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringT<Dim, Scalar>::apply() {
+    if (this->particles.size() < 2) return;
     Particle* p1 = getParticle1();
     Particle* p2 = getParticle2();
 
     auto spring_member = this->getSpringConstant() * ((p2->pos - p1->pos).norm()-this->getRestLength());
-    Vecd divide = (p2->pos - p1->pos)/(p2->pos - p1->pos).norm();
+    VecN divide = (p2->pos - p1->pos)/(p2->pos - p1->pos).norm();
     auto damping_member = this->getDampingCoeff()*(p2->vel - p1->vel).dot(divide) ;
     auto f1 = (spring_member + damping_member)*divide;
 
@@ -28,7 +155,419 @@ void ForceSpring::apply() {
     p2->force += -f1;
 }
 
-void ForceGravitation::apply() {
+template <int Dim, typename Scalar>
+bool ForceSpringT<Dim, Scalar>::getJacobianTerms(int& i1, int& i2, VecN& u, Scalar& c) const {
+    if (this->particles.size() < 2 || !this->system) return false;
+    i1 = this->system->getParticleIndex(getParticle1());
+    i2 = this->system->getParticleIndex(getParticle2());
+    if (i1 < 0 && i2 < 0) return false;
+    u = getParticle2()->pos - getParticle1()->pos;
+    const Scalar l = u.norm();
+    if (l <= 0) return false;
+    u /= l;
+    // the transversal term is negative for compressed springs, dropping it keeps
+    // the system matrix positive definite (the usual fix, see Choi & Ko 2002)
+    c = std::max(Scalar(0), 1 - L/l);
+    return true;
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringT<Dim, Scalar>::addJacobianProduct(Scalar kx, Scalar kv, const Scalar* y, Scalar* out) const {
+    // With K = ks*(c*(I - u u^T) + u u^T) and D = kd*u u^T, df1/dx1 = -K, df1/dx2 = K,
+    // df1/dv1 = -D, df1/dv2 = D and f2 = -f1, so the product only depends on y1 - y2.
+    // A particle outside the system (a scene anchor) is a fixed end.
+    int i1, i2;
+    VecN u;
+    Scalar c;
+    if (!getJacobianTerms(i1, i2, u, c)) return;
+
+    VecN w = VecN::Zero();
+    if (i1 >= 0) w += Eigen::Map<const VecN>(y + Dim*i1);
+    if (i2 >= 0) w -= Eigen::Map<const VecN>(y + Dim*i2);
+    const VecN Kw = kx*ks*c*w + (kx*ks*(1 - c) + kv*kd)*u.dot(w)*u;
+    if (i1 >= 0) Eigen::Map<VecN>(out + Dim*i1) -= Kw;
+    if (i2 >= 0) Eigen::Map<VecN>(out + Dim*i2) += Kw;
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringT<Dim, Scalar>::addJacobianDiagonal(Scalar kx, Scalar kv, Scalar* diag) const {
+    int i1, i2;
+    VecN u;
+    Scalar c;
+    if (!getJacobianTerms(i1, i2, u, c)) return;
+
+    const VecN d = (VecN::Constant(kx*ks*c).array() + (kx*ks*(1 - c) + kv*kd)*u.array().square()).matrix();
+    if (i1 >= 0) Eigen::Map<VecN>(diag + Dim*i1) -= d;
+    if (i2 >= 0) Eigen::Map<VecN>(diag + Dim*i2) -= d;
+}
+
+template <int Dim, typename Scalar>
+unsigned int ForceSpringNetworkT<Dim, Scalar>::beginCategory() {
+    categoryStart.push_back(getNumSprings());
+    return getNumCategories() - 1;
+}
+
+template <int Dim, typename Scalar>
+unsigned int ForceSpringNetworkT<Dim, Scalar>::addSpring(unsigned int i1, unsigned int i2, Scalar L, Scalar ks, Scalar kd) {
+    if (categoryStart.empty()) categoryStart.push_back(0);
+    ends1.push_back(i1);
+    ends2.push_back(i2);
+    restLengths.push_back(L);
+    springConstants.push_back(ks);
+    dampingCoeffs.push_back(kd);
+    incidenceDirty = true;
+    directionsVersion = 0;
+    this->changed();
+    return getNumSprings() - 1;
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringNetworkT<Dim, Scalar>::clearSprings() {
+    ends1.clear();
+    ends2.clear();
+    restLengths.clear();
+    springConstants.clear();
+    dampingCoeffs.clear();
+    categoryStart.clear();
+    incidenceDirty = true;
+    directionsVersion = 0;
+    this->changed();
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringNetworkT<Dim, Scalar>::reserveSprings(unsigned int n) {
+    ends1.reserve(n);
+    ends2.reserve(n);
+    restLengths.reserve(n);
+    springConstants.reserve(n);
+    dampingCoeffs.reserve(n);
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringNetworkT<Dim, Scalar>::getCategoryRange(unsigned int c, unsigned int& first, unsigned int& count) const {
+    first = categoryStart[c];
+    count = (c + 1 < getNumCategories() ? categoryStart[c + 1] : getNumSprings()) - first;
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringNetworkT<Dim, Scalar>::setCategoryCoefficients(unsigned int c, Scalar ks, Scalar kd) {
+    unsigned int first, count;
+    getCategoryRange(c, first, count);
+    std::fill_n(springConstants.begin() + first, count, ks);
+    std::fill_n(dampingCoeffs.begin() + first, count, kd);
+    this->changed();
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringNetworkT<Dim, Scalar>::buildIncidence(unsigned int numParticles) const {
+    if (!incidenceDirty && incidenceStart.size() == numParticles + 1) return;
+    const unsigned int ns = getNumSprings();
+    incidenceStart.assign(numParticles + 1, 0);
+    for (unsigned int s = 0; s < ns; s++) {
+        incidenceStart[ends1[s] + 1]++;
+        incidenceStart[ends2[s] + 1]++;
+    }
+    for (unsigned int i = 0; i < numParticles; i++) incidenceStart[i + 1] += incidenceStart[i];
+    incidence.resize(2*ns);
+    std::vector<unsigned int> next(incidenceStart.begin(), incidenceStart.end() - 1);
+    for (unsigned int s = 0; s < ns; s++) {
+        incidence[next[ends1[s]]++] = 2*s;
+        incidence[next[ends2[s]]++] = 2*s + 1;
+    }
+    incidenceDirty = false;
+}
+
+template <int Dim, typename Scalar>
+template <typename SpringFunction>
+void ForceSpringNetworkT<Dim, Scalar>::accumulateSprings(SpringFunction value, Scalar sign2, Scalar* out) const {
+    const unsigned int ns = getNumSprings();
+    const unsigned int np = this->system->getNumParticles();
+    Eigen::Map<MatrixNX> acc(out, Dim, np);
+
+    // one thread: straight scatter to both ends
+    if (parallelChunks(ns, threads) == 1) {
+        for (unsigned int s = 0; s < ns; s++) {
+            const VecN v = value(s);
+            acc.col(ends1[s]) += v;
+            acc.col(ends2[s]) += sign2*v;
+        }
+        return;
+    }
+
+    // threads: the springs write their value, then each particle sums its own springs,
+    // so neither pass has two threads writing the same place
+    buildIncidence(np);
+    springValues.resize(Dim, ns);
+    parallelFor(ns, threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int s = begin; s < end; s++) springValues.col(s) = value(s);
+    });
+    parallelFor(np, threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            VecN sum = VecN::Zero();
+            for (unsigned int k = incidenceStart[i]; k < incidenceStart[i + 1]; k++) {
+                const unsigned int e = incidence[k];
+                if (e & 1) sum += sign2*springValues.col(e >> 1);
+                else       sum += springValues.col(e >> 1);
+            }
+            acc.col(i) += sum;
+        }
+    });
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringNetworkT<Dim, Scalar>::updateDirections() const {
+    // the implicit solvers take many Jacobian products at the same positions
+    const unsigned int ns = getNumSprings();
+    if (directionsVersion == this->system->getStateVersion()) return;
+    directionsVersion = this->system->getStateVersion();
+    directions.resize(Dim, ns);
+    transversal.resize(ns);
+    const typename ParticleSystem::ConstVectorView pos =
+            static_cast<const ParticleSystem*>(this->system)->getPositionsView();
+    parallelFor(ns, threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int s = begin; s < end; s++) {
+            const VecN d = pos.col(ends2[s]) - pos.col(ends1[s]);
+            const Scalar l = d.norm();
+            directions.col(s) = l > 0 ? VecN(d/l) : VecN::Zero();
+            // as in ForceSpringT, the compressed springs get no transversal term
+            transversal[s] = l > 0 ? std::max(Scalar(0), 1 - restLengths[s]/l) : Scalar(0);
+        }
+    });
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringNetworkT<Dim, Scalar>::apply() {
+    if (!this->system || getNumSprings() == 0) return;
+    // const access: the non-const views would count as a state change
+    const ParticleSystem& sys = *this->system;
+    const typename ParticleSystem::ConstVectorView pos = sys.getPositionsView();
+    const typename ParticleSystem::ConstVectorView vel = sys.getVelocitiesView();
+    // the forces are evaluated before the integrators' allocation free part, the Jacobians inside it
+    directions.resize(Dim, getNumSprings());
+    transversal.resize(getNumSprings());
+
+    // f1 = (ks*(l - L) + kd*(v2 - v1).u)*u on the first end, -f1 on the second
+    accumulateSprings([&](unsigned int s) -> VecN {
+        const VecN d = pos.col(ends2[s]) - pos.col(ends1[s]);
+        const Scalar l = d.norm();
+        if (l <= 0) return VecN::Zero();
+        const VecN u = d/l;
+        const Scalar dvu = (vel.col(ends2[s]) - vel.col(ends1[s])).dot(u);
+        return (springConstants[s]*(l - restLengths[s]) + dampingCoeffs[s]*dvu)*u;
+    }, Scalar(-1), this->system->getForcesView().data());
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringNetworkT<Dim, Scalar>::addJacobianProduct(Scalar kx, Scalar kv, const Scalar* y, Scalar* out) const {
+    // same terms as ForceSpringT: Kw = kx*ks*c*w + (kx*ks*(1 - c) + kv*kd)*(u.w)*u, w = y1 - y2,
+    // subtracted on the first end and added on the second
+    if (!this->system || getNumSprings() == 0) return;
+    updateDirections();
+    Eigen::Map<const MatrixNX> Y(y, Dim, this->system->getNumParticles());
+    accumulateSprings([&](unsigned int s) -> VecN {
+        const VecN w = Y.col(ends1[s]) - Y.col(ends2[s]);
+        const Scalar ks = springConstants[s], c = transversal[s];
+        const Scalar along = (kx*ks*(1 - c) + kv*dampingCoeffs[s])*directions.col(s).dot(w);
+        return -kx*ks*c*w - along*directions.col(s);
+    }, Scalar(-1), out);
+}
+
+template <int Dim, typename Scalar>
+void ForceSpringNetworkT<Dim, Scalar>::addJacobianDiagonal(Scalar kx, Scalar kv, Scalar* diag) const {
+    if (!this->system || getNumSprings() == 0) return;
+    updateDirections();
+    // both ends get the same -d
+    accumulateSprings([&](unsigned int s) -> VecN {
+        const Scalar ks = springConstants[s], c = transversal[s];
+        return -(VecN::Constant(kx*ks*c).array()
+                 + (kx*ks*(1 - c) + kv*dampingCoeffs[s])*directions.col(s).array().square()).matrix();
+    }, Scalar(1), diag);
+}
+
+template <int Dim, typename Scalar>
+void ForceClothGridT<Dim, Scalar>::setGrid(unsigned int first, unsigned int rows, unsigned int cols,
+                                           Scalar rowSpacing, Scalar colSpacing) {
+    this->first = first;
+    this->rows = rows;
+    this->cols = cols;
+    const int di[6] = {0, 1, 1, 1, 0, 2};
+    const int dj[6] = {1, 0, 1, -1, 2, 0};
+    const SpringType type[6] = {Stretch, Stretch, Shear, Shear, Bend, Bend};
+    const unsigned int n = rows*cols;
+    families.clear();
+    for (int f = 0; f < 6; f++) {
+        const unsigned int offset = di[f]*cols + dj[f];
+        if (offset >= n) continue;
+        Family fam;
+        fam.offset = offset;
+        fam.type = type[f];
+        fam.restLength = std::sqrt(Scalar(di[f]*di[f])*rowSpacing*rowSpacing + Scalar(dj[f]*dj[f])*colSpacing*colSpacing);
+        // k + offset < n already keeps the row in the grid, the column has to be checked.
+        // The mask is padded to whole lanes with zeros.
+        fam.mask.setZero(numLanes(n - offset)*Lanes);
+        for (unsigned int k = 0; k < n - offset; k++) {
+            const int j = int(k % cols) + dj[f];
+            fam.mask[k] = (j >= 0 && j < int(cols)) ? Scalar(1) : Scalar(0);
+        }
+        // sized with the grid: the Jacobians may come before any apply, and they run
+        // where the integrators don't allocate
+        fam.directions.setZero(fam.mask.size(), Dim);
+        fam.transversal.setZero(fam.mask.size());
+        families.push_back(fam);
+    }
+    acc.setZero(n + Lanes, Dim);
+    directionsVersion = 0;
+    this->changed();
+}
+
+template <int Dim, typename Scalar>
+unsigned int ForceClothGridT<Dim, Scalar>::getNumSprings() const {
+    unsigned int n = 0;
+    for (const Family& fam : families) n += (unsigned int)(fam.mask.sum());
+    return n;
+}
+
+template <int Dim, typename Scalar>
+void ForceClothGridT<Dim, Scalar>::setCoefficients(SpringType t, Scalar ks, Scalar kd) {
+    this->ks[t] = ks;
+    this->kd[t] = kd;
+    this->changed();
+}
+
+template <int Dim, typename Scalar>
+bool ForceClothGridT<Dim, Scalar>::valid() const {
+    return this->system && !families.empty() && first + rows*cols <= this->system->getNumParticles();
+}
+
+template <int Dim, typename Scalar>
+void ForceClothGridT<Dim, Scalar>::loadGrid(ArrayXN& dst, const Scalar* src, unsigned int stride) const {
+    // component-major copy, with a lane of zeros after the grid for the last lanes to read
+    const unsigned int n = rows*cols;
+    dst.resize(n + Lanes, Dim);
+    dst.topRows(n) = typename ParticleSystem::ConstVectorView(src + first*stride, Dim, n,
+                                                              typename ParticleSystem::VectorStride(stride)).transpose();
+    dst.bottomRows(Lanes).setZero();
+}
+
+template <int Dim, typename Scalar>
+void ForceClothGridT<Dim, Scalar>::apply() {
+    if (!valid()) return;
+    const unsigned int n = rows*cols;
+    // const access: the non-const views would count as a state change
+    const ParticleSystem& sys = *this->system;
+    loadGrid(X, sys.getPositionsView().data(), 2*Dim);
+    loadGrid(V, sys.getVelocitiesView().data(), 2*Dim);
+    acc.setZero();
+
+    // f1 = (ks*(l - L) + kd*(v2 - v1).u)*u on the first end, -f1 on the second,
+    // Lanes springs at a time: fixed size arrays the compiler keeps in registers
+    for (const Family& fam : families) {
+        const unsigned int o = fam.offset;
+        const Scalar ks = this->ks[fam.type], kd = this->kd[fam.type], L = fam.restLength;
+        for (unsigned int k = 0; k < n - o; k += Lanes) {
+            Lane d[Dim];
+            Lane l2 = Lane::Zero(), dvd = Lane::Zero();
+            for (int i = 0; i < Dim; i++) {
+                d[i] = X.col(i).template segment<Lanes>(k + o) - X.col(i).template segment<Lanes>(k);
+                l2 += d[i].square();
+                dvd += (V.col(i).template segment<Lanes>(k + o) - V.col(i).template segment<Lanes>(k))*d[i];
+            }
+            // 0 for the masked and degenerate springs
+            const Lane l = l2.sqrt();
+            const Lane invl = (l > 0).select(l.inverse(), Scalar(0))*fam.mask.template segment<Lanes>(k);
+            const Lane c = (ks*(l - L) + kd*dvd*invl)*invl;
+            for (int i = 0; i < Dim; i++) {
+                acc.col(i).template segment<Lanes>(k) += c*d[i];
+                acc.col(i).template segment<Lanes>(k + o) -= c*d[i];
+            }
+        }
+    }
+
+    this->system->getForcesView().middleCols(first, n) += acc.topRows(n).matrix().transpose();
+}
+
+template <int Dim, typename Scalar>
+void ForceClothGridT<Dim, Scalar>::updateDirections() const {
+    // the implicit solvers take many Jacobian products at the same positions
+    if (directionsVersion == this->system->getStateVersion()) return;
+    directionsVersion = this->system->getStateVersion();
+    const unsigned int n = rows*cols;
+    loadGrid(X, static_cast<const ParticleSystem*>(this->system)->getPositionsView().data(), 2*Dim);
+    for (Family& fam : families) {
+        const unsigned int o = fam.offset;
+        for (unsigned int k = 0; k < n - o; k += Lanes) {
+            Lane d[Dim];
+            Lane l2 = Lane::Zero();
+            for (int i = 0; i < Dim; i++) {
+                d[i] = X.col(i).template segment<Lanes>(k + o) - X.col(i).template segment<Lanes>(k);
+                l2 += d[i].square();
+            }
+            const Lane l = l2.sqrt();
+            const Lane invl = (l > 0).select(l.inverse(), Scalar(0))*fam.mask.template segment<Lanes>(k);
+            for (int i = 0; i < Dim; i++) fam.directions.col(i).template segment<Lanes>(k) = d[i]*invl;
+            // as in ForceSpringT, the compressed springs get no transversal term
+            fam.transversal.template segment<Lanes>(k) = (1 - fam.restLength*invl).max(Scalar(0))*fam.mask.template segment<Lanes>(k);
+        }
+    }
+}
+
+template <int Dim, typename Scalar>
+void ForceClothGridT<Dim, Scalar>::addJacobianProduct(Scalar kx, Scalar kv, const Scalar* y, Scalar* out) const {
+    // same terms as ForceSpringT: Kw = kx*ks*c*w + (kx*ks*(1 - c) + kv*kd)*(u.w)*u, w = y1 - y2,
+    // subtracted on the first end and added on the second
+    if (!valid()) return;
+    updateDirections();
+    const unsigned int n = rows*cols;
+    // V (the velocities in apply) holds the grid part of y here
+    loadGrid(V, y, Dim);
+    acc.setZero();
+    for (const Family& fam : families) {
+        const unsigned int o = fam.offset;
+        const Scalar ksx = kx*ks[fam.type], kdv = kv*kd[fam.type];
+        for (unsigned int k = 0; k < n - o; k += Lanes) {
+            const Lane c = fam.transversal.template segment<Lanes>(k);
+            Lane w[Dim];
+            Lane uw = Lane::Zero();
+            for (int i = 0; i < Dim; i++) {
+                w[i] = V.col(i).template segment<Lanes>(k) - V.col(i).template segment<Lanes>(k + o);
+                uw += fam.directions.col(i).template segment<Lanes>(k)*w[i];
+            }
+            const Lane along = (ksx*(1 - c) + kdv)*uw;
+            for (int i = 0; i < Dim; i++) {
+                const Lane Kw = ksx*c*w[i] + along*fam.directions.col(i).template segment<Lanes>(k);
+                acc.col(i).template segment<Lanes>(k) -= Kw;
+                acc.col(i).template segment<Lanes>(k + o) += Kw;
+            }
+        }
+    }
+    Eigen::Map<MatrixNX>(out + first*Dim, Dim, n) += acc.topRows(n).matrix().transpose();
+}
+
+template <int Dim, typename Scalar>
+void ForceClothGridT<Dim, Scalar>::addJacobianDiagonal(Scalar kx, Scalar kv, Scalar* diag) const {
+    if (!valid()) return;
+    updateDirections();
+    const unsigned int n = rows*cols;
+    acc.setZero();
+    // both ends get the same -d
+    for (const Family& fam : families) {
+        const unsigned int o = fam.offset;
+        const Scalar ksx = kx*ks[fam.type], kdv = kv*kd[fam.type];
+        for (unsigned int k = 0; k < n - o; k += Lanes) {
+            const Lane c = fam.transversal.template segment<Lanes>(k);
+            const Lane along = ksx*(1 - c) + kdv;
+            for (int i = 0; i < Dim; i++) {
+                const Lane d = ksx*c + along*fam.directions.col(i).template segment<Lanes>(k).square();
+                acc.col(i).template segment<Lanes>(k) -= d;
+                acc.col(i).template segment<Lanes>(k + o) -= d;
+            }
+        }
+    }
+    Eigen::Map<MatrixNX>(diag + first*Dim, Dim, n) += acc.topRows(n).matrix().transpose();
+}
+
+template <int Dim, typename Scalar>
+void ForceGravitationT<Dim, Scalar>::apply() {
     // for (int i = 0; i<particles.max_size(); i++) {
     //     for (int j = 0; j<particles.max_size(); j++) {
     //         Particle* p_i = particles.at(i);
@@ -42,11 +581,812 @@ void ForceGravitation::apply() {
     //     }
     // }
 
-    for (Particle* p_j : particles) {
-        const Particle* p = getAttractor();
-        auto first = (getConstant() * p->mass * p_j->mass)/((p->pos - p_j->pos).norm()*(p->pos - p_j->pos).norm());
-        auto second = (p->pos - p_j->pos)/(p->pos - p_j->pos).norm();
-        auto third = (2/(1+std::exp(-this->a*(((p->pos - p_j->pos).norm()*(p->pos - p_j->pos).norm()))/(this->b*this->b)))-1);
-        p_j->force += first * second * third;
+    this->forEachInfluenced([this](Particle* p_j) { applyOn(p_j); });
+}
+
+template <int Dim, typename Scalar>
+void ForceGravitationT<Dim, Scalar>::applyTo(const std::vector<unsigned int>& indices) {
+    // lists and groups would need a lookup per particle, they get the full pass
+    unsigned int first, count;
+    if (!this->getInfluencedIndices(first, count)) {
+        apply();
+        return;
+    }
+    const std::vector<Particle*>& all = this->getSystemParticles();
+    for (unsigned int i : indices) {
+        if (i >= first && i < first + count) applyOn(all[i]);
     }
 }
+
+template <int Dim, typename Scalar>
+void ForceGravitationT<Dim, Scalar>::applyOn(Particle* p_j) const {
+    const Particle* p = this->getAttractor();
+    if (p == p_j) return;
+    auto first = (this->getConstant() * p->mass * p_j->mass)/((p->pos - p_j->pos).norm()*(p->pos - p_j->pos).norm());
+    auto second = (p->pos - p_j->pos)/(p->pos - p_j->pos).norm();
+    auto third = (Scalar(2)/(1+std::exp(-this->a*(((p->pos - p_j->pos).norm()*(p->pos - p_j->pos).norm()))/(this->b*this->b)))-1);
+    p_j->force += first * second * third;
+}
+
+
+template <int Dim, typename Scalar>
+void ForceGravityTreeT<Dim, Scalar>::ensureTree() const {
+    const unsigned long version = this->system ? this->system->getStateVersion() : 0;
+    if (version == 0 || version != treeVersion) buildTree();
+}
+
+template <int Dim, typename Scalar>
+void ForceGravityTreeT<Dim, Scalar>::buildTree() const {
+    treeVersion = this->system ? this->system->getStateVersion() : 0;
+
+    bodies.clear();
+    nodes.clear();
+    this->forEachInfluenced([this](Particle* p) { bodies.push_back(p); });
+    const unsigned int n = bodies.size();
+    if (n == 0) return;
+
+    // Morton codes on the bounding cube, then the bodies in that order
+    VecN lo = bodies[0]->pos, hi = lo;
+    for (const Particle* p : bodies) {
+        lo = lo.cwiseMin(p->pos);
+        hi = hi.cwiseMax(p->pos);
+    }
+    Scalar extent = (hi - lo).maxCoeff();
+    if (!(extent > 0)) extent = 1;
+    const double scale = std::ldexp(1.0, MortonBits)/extent;
+    const unsigned long long maxCell = (1ull << MortonBits) - 1;
+    keys.resize(n);
+    parallelFor(n, threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            unsigned long long code = 0;
+            for (int d = 0; d < Dim; d++) {
+                const unsigned long long q = (unsigned long long)(double(bodies[i]->pos[d] - lo[d])*scale);
+                code |= spreadBits(std::min(q, maxCell), Dim) << d;
+            }
+            keys[i] = MortonKey(code, i);
+        }
+    });
+    parallelSort(keys, threads);
+    sortedPos.resize(Dim, n);
+    sortedMass.resize(n);
+    parallelFor(n, threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int k = begin; k < end; k++) {
+            sortedPos.col(k) = bodies[keys[k].second]->pos;
+            sortedMass[k] = Scalar(bodies[keys[k].second]->mass);
+        }
+    });
+
+    Node root;
+    root.cellCentre = lo + VecN::Constant(extent/2);
+    root.size = extent;
+    root.begin = 0;
+    root.end = n;
+    root.firstChild = root.numChildren = 0;
+    root.level = 0;
+    nodes.push_back(root);
+
+    // top of the tree here, breadth first until there are subtrees for every thread
+    std::vector<unsigned int> frontier(1, 0), next;
+    while (!frontier.empty() && frontier.size() < 4*threads) {
+        next.clear();
+        for (unsigned int k : frontier) {
+            if (!splitNode(nodes, k)) continue;
+            for (unsigned int c = 0; c < nodes[k].numChildren; c++) next.push_back(nodes[k].firstChild + c);
+        }
+        frontier.swap(next);
+    }
+    const unsigned int topNodes = nodes.size();
+
+    // the subtrees in parallel, each in its own array starting with a copy of its root,
+    // then appended to the tree
+    std::vector<std::vector<Node> > subtrees(frontier.size());
+    parallelFor(frontier.size(), threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            subtrees[i].assign(1, nodes[frontier[i]]);
+            buildSubtree(subtrees[i], 0);
+        }
+    }, 1);
+    for (unsigned int i = 0; i < frontier.size(); i++) {
+        const unsigned int offset = nodes.size() - 1;
+        nodes[frontier[i]] = subtrees[i][0];
+        nodes[frontier[i]].firstChild += offset;
+        for (unsigned int k = 1; k < subtrees[i].size(); k++) {
+            nodes.push_back(subtrees[i][k]);
+            nodes.back().firstChild += offset;
+        }
+    }
+
+    // children come after their parents
+    for (unsigned int k = topNodes; k-- > 0; ) sumNode(nodes, k);
+}
+
+template <int Dim, typename Scalar>
+bool ForceGravityTreeT<Dim, Scalar>::splitNode(std::vector<Node>& tree, unsigned int k) const {
+    const Node node = tree[k];
+    if (node.end - node.begin <= leafSize || int(node.level) >= MortonBits) return false;
+
+    // the child cell of a body is the next Dim bits of its code, the bodies of a cell
+    // are consecutive since they are sorted
+    const int shift = Dim*(MortonBits - 1 - node.level);
+    const unsigned long long digits = (1ull << Dim) - 1;
+    tree[k].firstChild = tree.size();
+    for (unsigned int i = node.begin; i < node.end; ) {
+        const unsigned long long digit = (keys[i].first >> shift) & digits;
+        const unsigned int end = (unsigned int)(std::partition_point(keys.begin() + i, keys.begin() + node.end,
+            [&](const MortonKey& key) { return ((key.first >> shift) & digits) == digit; }) - keys.begin());
+        Node child;
+        for (int d = 0; d < Dim; d++) {
+            child.cellCentre[d] = node.cellCentre[d] + ((digit >> d) & 1 ? node.size : -node.size)/4;
+        }
+        child.size = node.size/2;
+        child.begin = i;
+        child.end = end;
+        child.firstChild = child.numChildren = 0;
+        child.level = node.level + 1;
+        tree.push_back(child);
+        tree[k].numChildren++;
+        i = end;
+    }
+    return true;
+}
+
+template <int Dim, typename Scalar>
+void ForceGravityTreeT<Dim, Scalar>::buildSubtree(std::vector<Node>& tree, unsigned int k) const {
+    if (splitNode(tree, k)) {
+        const unsigned int first = tree[k].firstChild, count = tree[k].numChildren;
+        for (unsigned int c = 0; c < count; c++) buildSubtree(tree, first + c);
+    }
+    sumNode(tree, k);
+}
+
+template <int Dim, typename Scalar>
+void ForceGravityTreeT<Dim, Scalar>::sumNode(std::vector<Node>& tree, unsigned int k) const {
+    Node& node = tree[k];
+    Scalar mass = 0;
+    VecN moment = VecN::Zero();
+    if (node.numChildren == 0) {
+        for (unsigned int i = node.begin; i < node.end; i++) {
+            mass += sortedMass[i];
+            moment += sortedMass[i]*sortedPos.col(i);
+        }
+    }
+    else {
+        for (unsigned int c = 0; c < node.numChildren; c++) {
+            const Node& child = tree[node.firstChild + c];
+            mass += child.mass;
+            moment += child.mass*VecN(child.centre);
+        }
+    }
+    node.mass = mass;
+    node.centre = mass > 0 ? VecN(moment/mass) : VecN(node.cellCentre);
+
+    node.radius = 0;
+    if (node.numChildren == 0) {
+        for (unsigned int i = node.begin; i < node.end; i++) {
+            node.radius = std::max(node.radius, (sortedPos.col(i) - VecN(node.centre)).norm());
+        }
+    }
+    else {
+        for (unsigned int c = 0; c < node.numChildren; c++) {
+            const Node& child = tree[node.firstChild + c];
+            node.radius = std::max(node.radius, (VecN(child.centre) - VecN(node.centre)).norm() + child.radius);
+        }
+    }
+}
+
+template <int Dim, typename Scalar>
+typename ForceGravityTreeT<Dim, Scalar>::VecN ForceGravityTreeT<Dim, Scalar>::attraction(const VecN& d, Scalar M) const {
+    // same law as ForceGravitationT: G*M*m/r^2 along the direction, times 2/(1 + exp(-a*r^2/b^2)) - 1.
+    // Past the cutoff the exponential doesn't change the factor from 1 any more, it is skipped.
+    static const Scalar cutoff = std::log(2/std::numeric_limits<Scalar>::epsilon());
+    const Scalar r2 = d.squaredNorm();
+    if (r2 <= 0) return VecN::Zero();
+    const Scalar r = std::sqrt(r2);
+    const Scalar u = a/(b*b)*r2;
+    const Scalar s = u < cutoff ? Scalar(2)/(1 + std::exp(-u)) - 1 : Scalar(1);
+    return (M*s/(r2*r))*d;
+}
+
+template <int Dim, typename Scalar>
+typename ForceBarnesHutT<Dim, Scalar>::VecN ForceBarnesHutT<Dim, Scalar>::forceAt(const VecN& x, Scalar m) const {
+    VecN f = VecN::Zero();
+    const std::vector<Node>& nodes = this->nodes;
+    if (nodes.empty()) return f;
+
+    // depth first, at most 2^Dim children pushed per level
+    unsigned int stack[(MortonBits + 1) << Dim];
+    unsigned int top = 0;
+    stack[top++] = 0;
+    const Scalar theta2 = this->theta*this->theta;
+    while (top > 0) {
+        const Node& node = nodes[stack[--top]];
+        const VecN d = VecN(node.centre) - x;
+        // a cell containing the body is always opened, its centre of mass could be far
+        const bool inside = ((x - VecN(node.cellCentre)).cwiseAbs().array() <= node.size/2).all();
+        if (!inside && node.size*node.size < theta2*d.squaredNorm()) {
+            f += this->attraction(d, node.mass);
+        }
+        else if (node.numChildren == 0) {
+            for (unsigned int i = node.begin; i < node.end; i++) {
+                f += this->attraction(this->sortedPos.col(i) - x, this->sortedMass[i]);
+            }
+        }
+        else {
+            for (unsigned int c = 0; c < node.numChildren; c++) stack[top++] = node.firstChild + c;
+        }
+    }
+    return this->G*m*f;
+}
+
+template <int Dim, typename Scalar>
+void ForceBarnesHutT<Dim, Scalar>::apply() {
+    this->buildTree();
+    // in Morton order, neighbouring bodies walk the same part of the tree
+    parallelFor(this->keys.size(), this->threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int k = begin; k < end; k++) {
+            this->bodies[this->keys[k].second]->force += forceAt(this->sortedPos.col(k), this->sortedMass[k]);
+        }
+    }, 64);
+}
+
+template <int Dim, typename Scalar>
+void ForceBarnesHutT<Dim, Scalar>::applyTo(const std::vector<unsigned int>& indices) {
+    // as ForceGravitationT, lists and groups get the full pass
+    unsigned int first, count;
+    if (!this->getInfluencedIndices(first, count)) {
+        apply();
+        return;
+    }
+    this->ensureTree();
+    const std::vector<Particle*>& all = this->getSystemParticles();
+    parallelFor(indices.size(), this->threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int j = begin; j < end; j++) {
+            const unsigned int i = indices[j];
+            if (i >= first && i < first + count) all[i]->force += forceAt(all[i]->pos, Scalar(all[i]->mass));
+        }
+    }, 64);
+}
+
+template <int Dim, typename Scalar>
+void ForceFMMT<Dim, Scalar>::setOrder(unsigned int p) {
+    p = std::max(1u, p);
+    if (p > MaxOrder) p = MaxOrder;
+    order = p;
+
+    // multi-indices by total degree, and a dense table back to their index
+    std::vector<int> index;
+    unsigned int table = 1;
+    for (int d = 0; d < Dim; d++) table *= p + 1;
+    index.assign(table, -1);
+    auto flat = [p](const int* n) {
+        unsigned int f = 0;
+        for (int d = Dim - 1; d >= 0; d--) f = f*(p + 1) + n[d];
+        return f;
+    };
+    exponents.clear();
+    degrees.clear();
+    for (unsigned int degree = 0; degree <= p; degree++) {
+        for (unsigned int f = 0; f < table; f++) {
+            int n[Dim];
+            unsigned int rest = f, sum = 0;
+            for (int d = 0; d < Dim; d++) {
+                n[d] = rest % (p + 1);
+                rest /= p + 1;
+                sum += n[d];
+            }
+            if (sum != degree) continue;
+            index[f] = degrees.size();
+            exponents.insert(exponents.end(), n, n + Dim);
+            degrees.push_back(degree);
+        }
+    }
+    numCoeffs = degrees.size();
+
+    // D^n from the first axis i with n_i > 0
+    derivAxis.assign(numCoeffs, -1);
+    derivPrev1.assign(numCoeffs, -1);
+    derivPrev2.assign(numCoeffs, -1);
+    for (unsigned int m = 1; m < numCoeffs; m++) {
+        int n[Dim] = {};
+        std::copy(&exponents[Dim*m], &exponents[Dim*m] + Dim, n);
+        int i = 0;
+        while (i < Dim - 1 && n[i] == 0) i++;
+        derivAxis[m] = i;
+        n[i]--;
+        derivPrev1[m] = index[flat(n)];
+        if (n[i] > 0) {
+            n[i]--;
+            derivPrev2[m] = index[flat(n)];
+        }
+    }
+
+    // k + d = n and the gradient terms, within the order
+    shiftTerms.clear();
+    m2lTerms.clear();
+    for (int i = 0; i < Dim; i++) gradientTerms[i].clear();
+    for (unsigned int k = 0; k < numCoeffs; k++) {
+        for (unsigned int d = 0; d < numCoeffs; d++) {
+            if (degrees[k] + degrees[d] > p) break;
+            int n[Dim];
+            for (int c = 0; c < Dim; c++) n[c] = exponents[Dim*k + c] + exponents[Dim*d + c];
+            const unsigned int sum = index[flat(n)];
+            shiftTerms.push_back({k, d, sum});
+            // the dipole about the centre of mass is 0, so k of degree 1 is left out
+            if (degrees[d] >= 1 && degrees[k] != 1) m2lTerms.push_back({k, sum, d});
+        }
+    }
+    for (unsigned int n = 0; n < numCoeffs; n++) {
+        if (degrees[n] + 1 > p) break;
+        for (int i = 0; i < Dim; i++) {
+            int e[Dim];
+            std::copy(&exponents[Dim*n], &exponents[Dim*n] + Dim, e);
+            e[i]++;
+            gradientTerms[i].push_back({(unsigned int)(index[flat(e)]), n, 0});
+        }
+    }
+
+    // d^l/dx^l tanh(x) = P_l(tanh(x)): P_0 = t, P_(l+1) = P_l'(t)*(1 - t^2), coefficients by power of t
+    tanhPolys.assign(p, std::vector<Scalar>());
+    tanhPolys[0] = {Scalar(0), Scalar(1)};
+    for (unsigned int l = 1; l < p; l++) {
+        const std::vector<Scalar>& prev = tanhPolys[l - 1];
+        std::vector<Scalar>& poly = tanhPolys[l];
+        poly.assign(prev.size() + 1, Scalar(0));
+        for (unsigned int c = 1; c < prev.size(); c++) {
+            poly[c - 1] += c*prev[c];
+            poly[c + 1] -= c*prev[c];
+        }
+    }
+    this->changed();
+}
+
+template <int Dim, typename Scalar>
+void ForceFMMT<Dim, Scalar>::powers(const VecN& x, Scalar* out) const {
+    out[0] = 1;
+    for (unsigned int m = 1; m < numCoeffs; m++) {
+        const int i = derivAxis[m];
+        out[m] = out[derivPrev1[m]]*x[i]/exponents[Dim*m + i];
+    }
+}
+
+template <int Dim, typename Scalar>
+void ForceFMMT<Dim, Scalar>::derivatives(const VecN& R, Scalar* out, Scalar* work) const {
+    // phi as a function of u = r^2/2, h(u) = phi(r): h'(u) = s/r^3 = tanh(k*u)*(2u)^(-3/2),
+    // with k = a/b^2. Its derivatives g_j = h^(j)(u) by Leibniz, then D^m h^(j)(u) = T[m][j]
+    // from T[m][j] = R_i*T[m - e_i][j + 1] + (m_i - 1)*T[m - 2e_i][j + 1], T[0][j] = g_j.
+    const unsigned int p = order, stride = p + 1;
+    Scalar* T = work;
+    Scalar* tanhTerms = work + numCoeffs*stride;
+    Scalar* powTerms = tanhTerms + stride;
+
+    const Scalar kappa = this->a/(this->b*this->b);
+    const Scalar u = R.squaredNorm()/2;
+    const Scalar t = std::tanh(kappa*u);
+    Scalar kappaL = 1;
+    for (unsigned int l = 0; l < p; l++) {
+        const std::vector<Scalar>& poly = tanhPolys[l];
+        Scalar v = 0;
+        for (unsigned int c = poly.size(); c-- > 0; ) v = v*t + poly[c];
+        tanhTerms[l] = kappaL*v;
+        kappaL *= kappa;
+    }
+    powTerms[0] = 1/(2*u*std::sqrt(2*u));
+    for (unsigned int i = 1; i < p; i++) powTerms[i] = powTerms[i - 1]*(Scalar(-0.5) - i)/u;
+
+    T[0] = 0;    // the potential itself is never needed
+    for (unsigned int j = 0; j < p; j++) {
+        Scalar g = 0, binomial = 1;
+        for (unsigned int l = 0; l <= j; l++) {
+            g += binomial*tanhTerms[l]*powTerms[j - l];
+            binomial = binomial*(j - l)/(l + 1);
+        }
+        T[j + 1] = g;
+    }
+    out[0] = 0;
+    for (unsigned int m = 1; m < numCoeffs; m++) {
+        const int i = derivAxis[m];
+        const Scalar* T1 = T + derivPrev1[m]*stride + 1;
+        Scalar* Tm = T + m*stride;
+        const unsigned int top = p - degrees[m];
+        if (derivPrev2[m] < 0) {
+            for (unsigned int j = 0; j <= top; j++) Tm[j] = R[i]*T1[j];
+        }
+        else {
+            const Scalar* T2 = T + derivPrev2[m]*stride + 1;
+            const Scalar c = exponents[Dim*m + i] - 1;
+            for (unsigned int j = 0; j <= top; j++) Tm[j] = R[i]*T1[j] + c*T2[j];
+        }
+        out[m] = Tm[0];
+    }
+}
+
+template <int Dim, typename Scalar>
+void ForceFMMT<Dim, Scalar>::walk(unsigned int A, unsigned int B) const {
+    const std::vector<Node>& nodes = this->nodes;
+    const Node& a = nodes[A];
+    const Node& b = nodes[B];
+    const Scalar distance = (VecN(a.centre) - VecN(b.centre)).norm();
+    if (a.radius + b.radius < this->theta*distance) {
+        m2lPairs.push_back(std::make_pair(A, B));
+        m2lPairs.push_back(std::make_pair(B, A));
+    }
+    else if (a.numChildren == 0 && b.numChildren == 0) {
+        p2pPairs.push_back(std::make_pair(A, B));
+        p2pPairs.push_back(std::make_pair(B, A));
+    }
+    else if (b.numChildren == 0 || (a.numChildren > 0 && a.radius >= b.radius)) {
+        for (unsigned int c = 0; c < a.numChildren; c++) walk(a.firstChild + c, B);
+    }
+    else {
+        for (unsigned int c = 0; c < b.numChildren; c++) walk(A, b.firstChild + c);
+    }
+}
+
+template <int Dim, typename Scalar>
+void ForceFMMT<Dim, Scalar>::walkSelf(unsigned int A) const {
+    const Node& a = this->nodes[A];
+    if (a.numChildren == 0) {
+        if (a.end - a.begin > 1) p2pPairs.push_back(std::make_pair(A, A));
+        return;
+    }
+    for (unsigned int i = 0; i < a.numChildren; i++) {
+        walkSelf(a.firstChild + i);
+        for (unsigned int j = i + 1; j < a.numChildren; j++) walk(a.firstChild + i, a.firstChild + j);
+    }
+}
+
+template <int Dim, typename Scalar>
+void ForceFMMT<Dim, Scalar>::ensureEvaluated() const {
+    const unsigned long version = this->system ? this->system->getStateVersion() : 0;
+    if (version == 0 || version != fmmVersion) evaluate();
+}
+
+template <int Dim, typename Scalar>
+void ForceFMMT<Dim, Scalar>::evaluate() const {
+    fmmVersion = this->system ? this->system->getStateVersion() : 0;
+
+    this->buildTree();
+    const std::vector<Node>& nodes = this->nodes;
+    const unsigned int numNodes = nodes.size();
+    const unsigned int threads = this->threads;
+    const unsigned int nc = numCoeffs;
+    numM2L = numP2P = 0;
+    if (numNodes == 0) return;
+
+    // parents, levels, leaves, and the leaf of every body
+    parent.assign(numNodes, 0);
+    levels.clear();
+    leaves.clear();
+    leafOf.resize(this->keys.size());
+    sortedOf.resize(this->keys.size());
+    for (unsigned int k = 0; k < numNodes; k++) {
+        const Node& node = nodes[k];
+        if (node.level >= levels.size()) levels.resize(node.level + 1);
+        levels[node.level].push_back(k);
+        for (unsigned int c = 0; c < node.numChildren; c++) parent[node.firstChild + c] = k;
+        if (node.numChildren == 0) {
+            leaves.push_back(k);
+            for (unsigned int i = node.begin; i < node.end; i++) leafOf[i] = k;
+        }
+    }
+    for (unsigned int k = 0; k < this->keys.size(); k++) sortedOf[this->keys[k].second] = k;
+
+    // upward pass, a level at a time from the deepest: multipoles of the leaves from
+    // their bodies, of the other cells from their children's
+    multipoles.assign(numNodes*nc, Scalar(0));
+    for (unsigned int level = levels.size(); level-- > 0; ) {
+        const std::vector<unsigned int>& cells = levels[level];
+        parallelFor(cells.size(), threads, [&](unsigned int begin, unsigned int end) {
+            std::vector<Scalar> pw(nc);
+            for (unsigned int c = begin; c < end; c++) {
+                const Node& node = nodes[cells[c]];
+                Scalar* M = &multipoles[cells[c]*nc];
+                if (node.numChildren == 0) {
+                    for (unsigned int i = node.begin; i < node.end; i++) {
+                        powers(VecN(node.centre) - this->sortedPos.col(i), pw.data());
+                        const Scalar m = this->sortedMass[i];
+                        for (unsigned int n = 0; n < nc; n++) M[n] += m*pw[n];
+                    }
+                }
+                else {
+                    for (unsigned int ch = 0; ch < node.numChildren; ch++) {
+                        const unsigned int child = node.firstChild + ch;
+                        powers(VecN(node.centre) - VecN(nodes[child].centre), pw.data());
+                        const Scalar* Mc = &multipoles[child*nc];
+                        for (const Term& term : shiftTerms) M[term.c] += Mc[term.a]*pw[term.b];
+                    }
+                }
+            }
+        }, 16);
+    }
+
+    // interaction lists, by target
+    m2lPairs.clear();
+    p2pPairs.clear();
+    walkSelf(0);
+    auto byTarget = [numNodes](const std::vector<std::pair<unsigned int, unsigned int> >& pairs,
+                               std::vector<unsigned int>& start, std::vector<unsigned int>& sources) {
+        start.assign(numNodes + 1, 0);
+        for (const auto& pair : pairs) start[pair.first + 1]++;
+        for (unsigned int k = 0; k < numNodes; k++) start[k + 1] += start[k];
+        sources.resize(pairs.size());
+        std::vector<unsigned int> next(start.begin(), start.end() - 1);
+        for (const auto& pair : pairs) sources[next[pair.first]++] = pair.second;
+    };
+    byTarget(m2lPairs, m2lStart, m2lSources);
+    byTarget(p2pPairs, p2pStart, p2pSources);
+    numM2L = m2lPairs.size();
+    for (const auto& pair : p2pPairs) {
+        numP2P += (unsigned long)(nodes[pair.first].end - nodes[pair.first].begin)*(nodes[pair.second].end - nodes[pair.second].begin);
+    }
+
+    // far field of every cell from the multipoles of its list
+    locals.assign(numNodes*nc, Scalar(0));
+    parallelFor(numNodes, threads, [&](unsigned int begin, unsigned int end) {
+        std::vector<Scalar> work(workSize());
+        Scalar* D = work.data() + (nc + 2)*(order + 1);
+        for (unsigned int t = begin; t < end; t++) {
+            Scalar* L = &locals[t*nc];
+            for (unsigned int s = m2lStart[t]; s < m2lStart[t + 1]; s++) {
+                const unsigned int source = m2lSources[s];
+                if (!(nodes[source].mass > 0)) continue;
+                derivatives(VecN(nodes[t].centre) - VecN(nodes[source].centre), D, work.data());
+                const Scalar* M = &multipoles[source*nc];
+                for (const Term& term : m2lTerms) L[term.c] += M[term.a]*D[term.b];
+            }
+        }
+    }, 16);
+
+    // downward pass, a level at a time from the top: the parent's local expansion
+    // shifted to the child's centre
+    for (unsigned int level = 1; level < levels.size(); level++) {
+        const std::vector<unsigned int>& cells = levels[level];
+        parallelFor(cells.size(), threads, [&](unsigned int begin, unsigned int end) {
+            std::vector<Scalar> pw(nc);
+            for (unsigned int c = begin; c < end; c++) {
+                const unsigned int child = cells[c], up = parent[child];
+                powers(VecN(nodes[child].centre) - VecN(nodes[up].centre), pw.data());
+                const Scalar* Lp = &locals[up*nc];
+                Scalar* L = &locals[child*nc];
+                for (const Term& term : shiftTerms) L[term.a] += Lp[term.c]*pw[term.b];
+            }
+        }, 16);
+    }
+}
+
+template <int Dim, typename Scalar>
+typename ForceFMMT<Dim, Scalar>::VecN ForceFMMT<Dim, Scalar>::forceOnBody(unsigned int l, unsigned int k, Scalar* work) const {
+    const std::vector<Node>& nodes = this->nodes;
+    const VecN x = this->sortedPos.col(k);
+
+    // minus the gradient of the local expansion, plus the bodies near enough
+    VecN f = VecN::Zero();
+    powers(x - VecN(nodes[l].centre), work);
+    const Scalar* L = &locals[l*numCoeffs];
+    for (int i = 0; i < Dim; i++) {
+        for (const Term& term : gradientTerms[i]) f[i] -= L[term.a]*work[term.b];
+    }
+    for (unsigned int s = p2pStart[l]; s < p2pStart[l + 1]; s++) {
+        const Node& source = nodes[p2pSources[s]];
+        for (unsigned int j = source.begin; j < source.end; j++) {
+            f += this->attraction(this->sortedPos.col(j) - x, this->sortedMass[j]);
+        }
+    }
+    return this->G*this->sortedMass[k]*f;
+}
+
+template <int Dim, typename Scalar>
+void ForceFMMT<Dim, Scalar>::apply() {
+    evaluate();
+    parallelFor(leaves.size(), this->threads, [&](unsigned int begin, unsigned int end) {
+        std::vector<Scalar> work(numCoeffs);
+        for (unsigned int i = begin; i < end; i++) {
+            const Node& leaf = this->nodes[leaves[i]];
+            for (unsigned int k = leaf.begin; k < leaf.end; k++) {
+                this->bodies[this->keys[k].second]->force += forceOnBody(leaves[i], k, work.data());
+            }
+        }
+    }, 16);
+}
+
+template <int Dim, typename Scalar>
+void ForceFMMT<Dim, Scalar>::applyTo(const std::vector<unsigned int>& indices) {
+    // as ForceGravitationT, lists and groups get the full pass
+    unsigned int first, count;
+    if (!this->getInfluencedIndices(first, count)) {
+        apply();
+        return;
+    }
+    ensureEvaluated();
+    const std::vector<Particle*>& all = this->getSystemParticles();
+    parallelFor(indices.size(), this->threads, [&](unsigned int begin, unsigned int end) {
+        std::vector<Scalar> work(numCoeffs);
+        for (unsigned int j = begin; j < end; j++) {
+            const unsigned int i = indices[j];
+            if (i < first || i >= first + count) continue;
+            const unsigned int k = sortedOf[i - first];
+            all[i]->force += forceOnBody(leafOf[k], k, work.data());
+        }
+    }, 64);
+}
+
+
+template <int Dim, typename Scalar>
+void ForceNBodyDirectT<Dim, Scalar>::gatherBodies() const {
+    bodies.clear();
+    this->forEachInfluenced([this](Particle* p) { bodies.push_back(p); });
+    const unsigned int n = bodies.size();
+    const unsigned int padded = (n + TileSize - 1)/TileSize*TileSize;
+    X.resize(padded, Dim);
+    M.resize(padded);
+    for (unsigned int k = 0; k < n; k++) {
+        X.row(k) = bodies[k]->pos.transpose();
+        M[k] = Scalar(bodies[k]->mass);
+    }
+    X.bottomRows(padded - n).setZero();
+    M.tail(padded - n).setZero();
+}
+
+template <int Dim, typename Scalar>
+typename ForceNBodyDirectT<Dim, Scalar>::VecN ForceNBodyDirectT<Dim, Scalar>::interact(
+        const VecN& x, Scalar m, unsigned int i, unsigned int begin, unsigned int end, ArrayXN* reactions) const {
+    // same law as ForceGravitationT: G*M*m/r^2 along the direction, times 2/(1 + exp(-a*r^2/b^2)) - 1
+    const Scalar Gm = G*m;
+    const Scalar smoothing = a/(b*b);
+    const Scalar cutoff = std::log(2/std::numeric_limits<Scalar>::epsilon());
+    // r^2 is kept above this so 1/r^3 stays finite: the body itself (and coincident ones)
+    // then adds w*0 = 0 without a branch, Eigen 3.4 doesn't vectorise select
+    const Scalar minR2 = std::pow(std::numeric_limits<Scalar>::max(), Scalar(-1)/3);
+    // 0 on the lanes up to i, 1 after, for the chunk that contains i
+    const Lane after = (Eigen::Array<int, Lanes, 1>::LinSpaced(Lanes, 0, Lanes - 1) > int(i%Lanes)).template cast<Scalar>();
+    VecN f = VecN::Zero();
+    for (unsigned int k = begin; k < end; k += Lanes) {
+        Lane d[Dim];
+        Lane r2 = Lane::Zero();
+        for (int c = 0; c < Dim; c++) {
+            d[c] = X.col(c).template segment<Lanes>(k) - x[c];
+            r2 += d[c].square();
+        }
+        const Lane invr = r2.max(minR2).rsqrt();
+        Lane w = M.template segment<Lanes>(k)*invr*invr*invr;
+        // past the cutoff on every lane the exponential doesn't change the factor from 1 any more
+        const Lane u = smoothing*r2;
+        if (u.minCoeff() < cutoff) w *= Scalar(2)/(1 + (-u).exp()) - 1;
+        if (reactions) {
+            if (k <= i && i < k + Lanes) w *= after;
+            for (int c = 0; c < Dim; c++) reactions->col(c).template segment<Lanes>(k) -= Gm*w*d[c];
+        }
+        for (int c = 0; c < Dim; c++) f[c] += (w*d[c]).sum();
+    }
+    return Gm*f;
+}
+
+template <int Dim, typename Scalar>
+void ForceNBodyDirectT<Dim, Scalar>::apply() {
+    gatherBodies();
+    const unsigned int n = bodies.size();
+    if (n < 2) return;
+
+    // tile pairs (I, J >= I), a thread takes a run of them and sums in its own array
+    const unsigned int tiles = X.rows()/TileSize;
+    const unsigned int pairs = tiles*(tiles + 1)/2;
+    const unsigned int chunks = parallelChunks(pairs, threads, 1);
+    partial.resize(chunks);
+    for (ArrayXN& acc : partial) acc.setZero(X.rows(), Dim);
+    parallelFor(chunks, chunks, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int c = begin; c < end; c++) {
+            const unsigned int first = (unsigned int)(size_t(pairs)*c/chunks);
+            const unsigned int last  = (unsigned int)(size_t(pairs)*(c + 1)/chunks);
+            ArrayXN& acc = partial[c];
+            unsigned int pair = 0;
+            for (unsigned int I = 0; I < tiles; I++) {
+                for (unsigned int J = I; J < tiles; J++, pair++) {
+                    if (pair < first || pair >= last) continue;
+                    for (unsigned int i = I*TileSize; i < std::min(n, (I + 1)*TileSize); i++) {
+                        // within a tile, only the pairs after i
+                        const unsigned int jBegin = I == J ? i/Lanes*Lanes : J*TileSize;
+                        const VecN f = interact(X.row(i).transpose().matrix(), M[i], i, jBegin, (J + 1)*TileSize, &acc);
+                        acc.row(i) += f.transpose().array();
+                    }
+                }
+            }
+        }
+    }, 1);
+
+    parallelFor(n, threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int k = begin; k < end; k++) {
+            VecN f = VecN::Zero();
+            for (const ArrayXN& acc : partial) f += acc.row(k).transpose().matrix();
+            bodies[k]->force += f;
+        }
+    });
+}
+
+template <int Dim, typename Scalar>
+void ForceNBodyDirectT<Dim, Scalar>::applyTo(const std::vector<unsigned int>& indices) {
+    // as ForceGravitationT, lists and groups get the full pass. The others get each
+    // of their bodies against all, no reactions.
+    unsigned int first, count;
+    if (!this->getInfluencedIndices(first, count)) {
+        apply();
+        return;
+    }
+    gatherBodies();
+    const std::vector<Particle*>& all = this->getSystemParticles();
+    parallelFor(indices.size(), threads, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int j = begin; j < end; j++) {
+            const unsigned int i = indices[j];
+            if (i >= first && i < first + count) {
+                all[i]->force += interact(all[i]->pos, Scalar(all[i]->mass), 0, 0, X.rows(), nullptr);
+            }
+        }
+    }, 64);
+}
+
+
+template class ForceT<1, double>;
+template class ForceT<2, double>;
+template class ForceT<3, double>;
+template class ForceT<1, float>;
+template class ForceT<2, float>;
+template class ForceT<3, float>;
+template class ForceConstAccelerationT<1, double>;
+template class ForceConstAccelerationT<2, double>;
+template class ForceConstAccelerationT<3, double>;
+template class ForceConstAccelerationT<1, float>;
+template class ForceConstAccelerationT<2, float>;
+template class ForceConstAccelerationT<3, float>;
+template class ForceDragT<1, double>;
+template class ForceDragT<2, double>;
+template class ForceDragT<3, double>;
+template class ForceDragT<1, float>;
+template class ForceDragT<2, float>;
+template class ForceDragT<3, float>;
+template class ForceSpringT<1, double>;
+template class ForceSpringT<2, double>;
+template class ForceSpringT<3, double>;
+template class ForceSpringT<1, float>;
+template class ForceSpringT<2, float>;
+template class ForceSpringT<3, float>;
+template class ForceSpringNetworkT<1, double>;
+template class ForceSpringNetworkT<2, double>;
+template class ForceSpringNetworkT<3, double>;
+template class ForceSpringNetworkT<1, float>;
+template class ForceSpringNetworkT<2, float>;
+template class ForceSpringNetworkT<3, float>;
+template class ForceClothGridT<1, double>;
+template class ForceClothGridT<2, double>;
+template class ForceClothGridT<3, double>;
+template class ForceClothGridT<1, float>;
+template class ForceClothGridT<2, float>;
+template class ForceClothGridT<3, float>;
+template class ForceGravitationT<1, double>;
+template class ForceGravitationT<2, double>;
+template class ForceGravitationT<3, double>;
+template class ForceGravitationT<1, float>;
+template class ForceGravitationT<2, float>;
+template class ForceGravitationT<3, float>;
+template class ForceGravityTreeT<1, double>;
+template class ForceGravityTreeT<2, double>;
+template class ForceGravityTreeT<3, double>;
+template class ForceGravityTreeT<1, float>;
+template class ForceGravityTreeT<2, float>;
+template class ForceGravityTreeT<3, float>;
+template class ForceBarnesHutT<1, double>;
+template class ForceBarnesHutT<2, double>;
+template class ForceBarnesHutT<3, double>;
+template class ForceBarnesHutT<1, float>;
+template class ForceBarnesHutT<2, float>;
+template class ForceBarnesHutT<3, float>;
+template class ForceFMMT<1, double>;
+template class ForceFMMT<2, double>;
+template class ForceFMMT<3, double>;
+template class ForceFMMT<1, float>;
+template class ForceFMMT<2, float>;
+template class ForceFMMT<3, float>;
+template class ForceNBodyDirectT<1, double>;
+template class ForceNBodyDirectT<2, double>;
+template class ForceNBodyDirectT<3, double>;
+template class ForceNBodyDirectT<1, float>;
+template class ForceNBodyDirectT<2, float>;
+template class ForceNBodyDirectT<3, float>;
@@ -2,127 +2,659 @@
 #define FORCES_H
 
 #include <vector>
+#include <algorithm>
 #include "particle.h"
 
-class Force
+// Forces are templated on the dimension and scalar type of the system they act on,
+// the 3D double versions used by most scenes are typedef'd at the end.
+template <int Dim, typename Scalar = double>
+class ForceT
 {
 public:
-    Force(void) {}
-    virtual ~Force(void) {}
+    typedef ParticleT<Dim, Scalar>          Particle;
+    typedef ParticleSystemT<Dim, Scalar>    ParticleSystem;
+    typedef typename Particle::VecN         VecN;
+
+    // Which particles the force acts on: an explicit list (the default), every particle
+    // of the system the force was added to, a range of system indices, or the system
+    // particles whose group shares a bit with a mask. Only lists store pointers.
+    enum InfluenceMode { InfluenceList, InfluenceAll, InfluenceRange, InfluenceGroup };
+
+    ForceT(void) {}
+    virtual ~ForceT(void) {}
 
     virtual void apply() = 0;
 
+    // Adds the force only on the given system particles (sorted indices), for the
+    // integrators that don't need every particle each time. The default applies
+    // it everywhere, which is right for those and wasted work for the rest.
+    virtual void applyTo(const std::vector<unsigned int>& /*indices*/) { apply(); }
+
+    // Derivatives for the implicit integrators. y and out are Dim x N arrays over the
+    // system particles (column i is particle i), out += (kx*df/dx + kv*df/dv)*y, and
+    // diag gets the diagonal of that same matrix. Forces that don't override these
+    // still act on the step through apply(), they are just treated explicitly.
+    virtual void addJacobianProduct(Scalar /*kx*/, Scalar /*kv*/, const Scalar* /*y*/, Scalar* /*out*/) const {}
+    virtual void addJacobianDiagonal(Scalar /*kx*/, Scalar /*kv*/, Scalar* /*diag*/) const {}
+
+    // stiff forces are the ones IMEX integrators solve implicitly, the rest are
+    // only evaluated explicitly. Springs are stiff by default, everything else isn't.
+    bool isStiff() const { return stiff; }
+    void setStiff(bool s) { stiff = s; }
+
+    // Multi-rate: a force with an update interval is only evaluated once that much
+    // simulated time has passed since its last evaluation, in between the system adds
+    // the contribution it cached then, held constant. Good for slowly varying forces,
+    // the integrator stages then only recompute the fast ones, and IntegratorMultiRateT
+    // substeps them within an interval. 0 evaluates every time.
+    void setUpdateInterval(double dt) { updateInterval = dt; cache.clear(); changed(); }
+    double getUpdateInterval() const { return updateInterval; }
+    void invalidateCache() { cache.clear(); }
+
     void addInfluencedParticle(Particle* p) {
+        mode = InfluenceList;
         particles.push_back(p);
+        changed();
     }
 
     void setInfluencedParticles(const std::vector<Particle*>& vparticles) {
+        mode = InfluenceList;
         particles = vparticles;
+        changed();
     }
 
     void clearInfluencedParticles() {
+        mode = InfluenceList;
         particles.clear();
+        changed();
     }
 
-    std::vector<Particle*> getInfluencedParticles() const {
+    // only holds the influenced particles in list mode
+    const std::vector<Particle*>& getInfluencedParticles() const {
         return particles;
     }
 
+    void setInfluenceAll() {
+        mode = InfluenceAll;
+        particles.clear();
+        changed();
+    }
+
+    void setInfluenceRange(unsigned int first, unsigned int count) {
+        mode = InfluenceRange;
+        rangeFirst = first;
+        rangeCount = count;
+        particles.clear();
+        changed();
+    }
+
+    void setInfluenceGroup(unsigned int mask) {
+        mode = InfluenceGroup;
+        groupMask = mask;
+        particles.clear();
+        changed();
+    }
+
+    InfluenceMode getInfluenceMode() const { return mode; }
+
+    // set by ParticleSystemT::addForce
+    void setSystem(ParticleSystem* s) { system = s; }
+    ParticleSystem* getSystem() const { return system; }
+
+protected:
+    // tells the system the force changed, so ensureForces doesn't keep the old values
+    void changed();
+
+    // calls f(Particle*) on every influenced particle
+    template <typename Function>
+    void forEachInfluenced(Function f) const {
+        if (mode == InfluenceList) {
+            for (Particle* p : particles) f(p);
+            return;
+        }
+        if (!system) return;
+        const std::vector<Particle*>& all = getSystemParticles();
+        unsigned int first = 0, last = all.size();
+        if (mode == InfluenceRange) {
+            first = std::min<unsigned int>(rangeFirst, last);
+            last  = std::min<unsigned int>(rangeFirst + rangeCount, last);
+        }
+        for (unsigned int i = first; i < last; i++) {
+            if (mode != InfluenceGroup || (all[i]->group & groupMask)) f(all[i]);
+        }
+    }
+
+    // contiguous set of system indices the force acts on, false for lists and groups
+    bool getInfluencedIndices(unsigned int& first, unsigned int& count) const;
+
+    const std::vector<Particle*>& getSystemParticles() const;
+
 protected:
     std::vector<Particle*>	particles;
+    InfluenceMode mode = InfluenceList;
+    unsigned int rangeFirst = 0, rangeCount = 0;
+    unsigned int groupMask = ~0u;
+    ParticleSystem* system = nullptr;
+    bool stiff = false;
+
+    // multi-rate state, handled by ParticleSystemT::updateForces
+    template <int, typename> friend class ParticleSystemT;
+    double updateInterval = 0;
+    double lastUpdate = 0;
+    std::vector<Scalar> cache;      // Dim values per system particle
 };
 
 
-class ForceConstAcceleration : public Force
+template <int Dim, typename Scalar = double>
+class ForceConstAccelerationT : public ForceT<Dim, Scalar>
 {
 public:
-    ForceConstAcceleration() { acceleration = Vec3(0,0,0); }
-    ForceConstAcceleration(const Vec3& a) { acceleration = a; }
-    virtual ~ForceConstAcceleration() {}
+    typedef typename ForceT<Dim, Scalar>::Particle Particle;
+    typedef typename ForceT<Dim, Scalar>::VecN VecN;
+
+    ForceConstAccelerationT() { acceleration = VecN::Zero(); }
+    ForceConstAccelerationT(const VecN& a) { acceleration = a; }
+    virtual ~ForceConstAccelerationT() {}
 
     virtual void apply();
 
-    void setAcceleration(const Vec3& a) { acceleration = a; }
-    Vec3 getAcceleration() const { return acceleration; }
+    void setAcceleration(const VecN& a) { acceleration = a; this->changed(); }
+    VecN getAcceleration() const { return acceleration; }
 
 protected:
-    Vec3 acceleration;
+    VecN acceleration;
 };
 
 
-class ForceDrag : public Force
+template <int Dim, typename Scalar = double>
+class ForceDragT : public ForceT<Dim, Scalar>
 {
 public:
-    ForceDrag() { klinear = kquadratic = 0; }
-    ForceDrag(double k1, double k2) { klinear = k1; kquadratic = k2; }
-    virtual ~ForceDrag() {}
+    typedef typename ForceT<Dim, Scalar>::Particle Particle;
+    typedef typename ForceT<Dim, Scalar>::VecN VecN;
+
+    ForceDragT() { klinear = kquadratic = 0; }
+    ForceDragT(Scalar k1, Scalar k2) { klinear = k1; kquadratic = k2; }
+    virtual ~ForceDragT() {}
 
     virtual void apply();
+    virtual void addJacobianProduct(Scalar kx, Scalar kv, const Scalar* y, Scalar* out) const;
+    virtual void addJacobianDiagonal(Scalar kx, Scalar kv, Scalar* diag) const;
 
-    void setDragCoefficients(double k1, double k2) { klinear = k1, kquadratic = k2; }
-    double getLinearCoefficient() const { return klinear; }
-    double getQuadraticCoefficient() const { return kquadratic; }
+    void setDragCoefficients(Scalar k1, Scalar k2) { klinear = k1, kquadratic = k2; this->changed(); }
+    Scalar getLinearCoefficient() const { return klinear; }
+    Scalar getQuadraticCoefficient() const { return kquadratic; }
 
 protected:
-    double klinear, kquadratic;
+    Scalar klinear, kquadratic;
 };
 
 
-class ForceSpring : public Force
+template <int Dim, typename Scalar = double>
+class ForceSpringT : public ForceT<Dim, Scalar>
 {
 public:
-    ForceSpring() { ks = kd = 0; }
-    ForceSpring(Particle* p1, Particle* p2, double L, double ks, double kd) {
+    typedef typename ForceT<Dim, Scalar>::Particle Particle;
+    typedef typename ForceT<Dim, Scalar>::VecN VecN;
+
+    ForceSpringT() { ks = kd = 0; this->stiff = true; }
+    ForceSpringT(Particle* p1, Particle* p2, Scalar L, Scalar ks, Scalar kd) {
         this->L = L; this->ks = ks; this->kd = kd;
-        particles.push_back(p1);
-        particles.push_back(p2);
+        this->stiff = true;
+        this->particles.push_back(p1);
+        this->particles.push_back(p2);
     }
-    virtual ~ForceSpring() {}
+    virtual ~ForceSpringT() {}
 
     virtual void apply();
+    virtual void addJacobianProduct(Scalar kx, Scalar kv, const Scalar* y, Scalar* out) const;
+    virtual void addJacobianDiagonal(Scalar kx, Scalar kv, Scalar* diag) const;
 
     void setParticlePair(Particle* p1, Particle* p2) {
-        particles.clear();
-        particles.push_back(p1);
-        particles.push_back(p2);
+        this->particles.clear();
+        this->particles.push_back(p1);
+        this->particles.push_back(p2);
+        this->changed();
     }
-    Particle* getParticle1() const { return particles[0]; }
-    Particle* getParticle2() const { return particles[1]; }
+    Particle* getParticle1() const { return this->particles[0]; }
+    Particle* getParticle2() const { return this->particles[1]; }
 
-    void setRestLength(double l) { L = l; }
-    double getRestLength() const { return L; }
+    void setRestLength(Scalar l) { L = l; this->changed(); }
+    Scalar getRestLength() const { return L; }
 
-    void setSpringConstant(double k) { ks = k; }
-    double getSpringConstant() const { return ks; }
+    void setSpringConstant(Scalar k) { ks = k; this->changed(); }
+    Scalar getSpringConstant() const { return ks; }
 
-    void setDampingCoeff(double k) { kd = k; }
-    double getDampingCoeff() const { return kd; }
+    void setDampingCoeff(Scalar k) { kd = k; this->changed(); }
+    Scalar getDampingCoeff() const { return kd; }
 
 protected:
-    double L = 0;   // resting length
-    double ks = 0;  // spring coeff
-    double kd = 0;  // damping coeff
+    // system indices of the ends (-1 if not in the system), direction and the
+    // transversal stiffness factor max(0, 1 - L/l), false if the spring is degenerate
+    bool getJacobianTerms(int& i1, int& i2, VecN& u, Scalar& c) const;
+
+    Scalar L = 0;   // resting length
+    Scalar ks = 0;  // spring coeff
+    Scalar kd = 0;  // damping coeff
+};
+
+// Many springs in a single force, for meshes like the cloth where a ForceSpringT per spring
+// means a virtual call and two particle scatters each. Ends are system indices (the
+// network must be added to the system, and rebuilt if the particles are compacted), the
+// rest lengths and coefficients are flat arrays evaluated in one pass over all springs.
+// Springs are grouped in categories (stretch, shear...), each a contiguous slice of the
+// arrays, so a whole category can be retuned at once.
+template <int Dim, typename Scalar = double>
+class ForceSpringNetworkT : public ForceT<Dim, Scalar>
+{
+public:
+    typedef typename ForceT<Dim, Scalar>::Particle Particle;
+    typedef typename ForceT<Dim, Scalar>::VecN VecN;
+    typedef typename ForceT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef Eigen::Matrix<Scalar, Dim, Eigen::Dynamic> MatrixNX;
+    typedef Eigen::Matrix<Scalar, 1, Eigen::Dynamic> RowVector;
+
+    ForceSpringNetworkT() { this->stiff = true; }
+    virtual ~ForceSpringNetworkT() {}
+
+    virtual void apply();
+    virtual void addJacobianProduct(Scalar kx, Scalar kv, const Scalar* y, Scalar* out) const;
+    virtual void addJacobianDiagonal(Scalar kx, Scalar kv, Scalar* diag) const;
+
+    // springs added after this go in a new category, returns its id
+    unsigned int beginCategory();
+    // returns the spring index, in the last category begun (a first one is implicit)
+    unsigned int addSpring(unsigned int i1, unsigned int i2, Scalar L, Scalar ks, Scalar kd);
+    void clearSprings();
+    void reserveSprings(unsigned int n);
+
+    unsigned int getNumSprings() const { return (unsigned int)(ends1.size()); }
+    unsigned int getNumCategories() const { return (unsigned int)(categoryStart.size()); }
+    void getCategoryRange(unsigned int c, unsigned int& first, unsigned int& count) const;
+    void setCategoryCoefficients(unsigned int c, Scalar ks, Scalar kd);
+
+    unsigned int getEnd1(unsigned int s) const { return ends1[s]; }
+    unsigned int getEnd2(unsigned int s) const { return ends2[s]; }
+    Scalar getRestLength(unsigned int s) const { return restLengths[s]; }
+    Scalar getSpringConstant(unsigned int s) const { return springConstants[s]; }
+    Scalar getDampingCoeff(unsigned int s) const { return dampingCoeffs[s]; }
+
+    // worker threads for the evaluation, only used when each gets thousands of springs
+    void setThreads(unsigned int n) { threads = std::max(1u, n); }
+    unsigned int getThreads() const { return threads; }
+
+protected:
+    // unit directions and transversal factors max(0, 1 - L/l) for the Jacobians,
+    // recomputed only when the system state changed
+    void updateDirections() const;
+    // per particle list of the springs it ends, for the threaded accumulation
+    void buildIncidence(unsigned int numParticles) const;
+    // out (Dim x N) += value(s) on the first end of every spring s, sign2*value(s) on the second
+    template <typename SpringFunction>
+    void accumulateSprings(SpringFunction value, Scalar sign2, Scalar* out) const;
+
+    std::vector<unsigned int> ends1, ends2;
+    std::vector<Scalar> restLengths, springConstants, dampingCoeffs;
+    std::vector<unsigned int> categoryStart;
+    unsigned int threads = 1;
+
+    // workspaces, sized on first use
+    mutable MatrixNX directions, springValues;
+    mutable RowVector transversal;
+    mutable unsigned long directionsVersion = 0;
+    mutable std::vector<unsigned int> incidenceStart, incidence;    // incidence: 2*spring + end
+    mutable bool incidenceDirty = true;
+};
+
+// Cloth on a regular grid of rows x cols particles, consecutive in the system from index
+// first (particle (i,j) is first + i*cols + j). The springs are implied by the grid: each
+// particle to its neighbours at (0,1) and (1,0) (stretch), (1,1) and (1,-1) (shear), (0,2)
+// and (2,0) (bend). There are no index arrays: a spring family is the whole grid against
+// itself shifted by a fixed index offset, so it is evaluated as one array operation over
+// contiguous component arrays, and a mask drops the springs that would wrap around a row.
+template <int Dim, typename Scalar = double>
+class ForceClothGridT : public ForceT<Dim, Scalar>
+{
+public:
+    typedef typename ForceT<Dim, Scalar>::Particle Particle;
+    typedef typename ForceT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef Eigen::Matrix<Scalar, Dim, Eigen::Dynamic> MatrixNX;
+    typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> ArrayX;
+    typedef Eigen::Array<Scalar, Eigen::Dynamic, Dim> ArrayXN;    // one column per component
+    static const int Lanes = 16;                                  // springs per vector step
+    typedef Eigen::Array<Scalar, Lanes, 1> Lane;
+
+    enum SpringType { Stretch, Shear, Bend, NumSpringTypes };
+
+    ForceClothGridT() { this->stiff = true; }
+    virtual ~ForceClothGridT() {}
+
+    virtual void apply();
+    virtual void addJacobianProduct(Scalar kx, Scalar kv, const Scalar* y, Scalar* out) const;
+    virtual void addJacobianDiagonal(Scalar kx, Scalar kv, Scalar* diag) const;
+
+    // spacings between rows and between columns give the rest lengths
+    void setGrid(unsigned int first, unsigned int rows, unsigned int cols, Scalar rowSpacing, Scalar colSpacing);
+    unsigned int getRows() const { return rows; }
+    unsigned int getCols() const { return cols; }
+    unsigned int getNumSprings() const;
+
+    void setCoefficients(SpringType t, Scalar ks, Scalar kd);
+    Scalar getSpringConstant(SpringType t) const { return ks[t]; }
+    Scalar getDampingCoeff(SpringType t) const { return kd[t]; }
+
+    // calls f(i1, i2, restLength) with the system indices of every spring
+    template <typename Function>
+    void forEachSpring(Function f) const {
+        for (const Family& fam : families) {
+            for (unsigned int k = 0; k + fam.offset < rows*cols; k++) {
+                if (fam.mask[k] != 0) f(first + k, first + k + fam.offset, fam.restLength);
+            }
+        }
+    }
+
+protected:
+    // springs from particle k to particle k + offset, mask[k] is 0 where that wraps a row
+    struct Family {
+        unsigned int offset;
+        SpringType type;
+        Scalar restLength;
+        ArrayX mask;            // padded to whole lanes
+        ArrayXN directions;     // for the Jacobians, see updateDirections
+        ArrayX transversal;
+    };
+
+    static unsigned int numLanes(unsigned int n) { return (n + Lanes - 1)/Lanes; }
+    // true if the grid fits in the system
+    bool valid() const;
+    // component-major copy of the grid columns of a Dim x N array with the given stride
+    void loadGrid(ArrayXN& dst, const Scalar* src, unsigned int stride) const;
+    // unit directions and transversal factors max(0, 1 - L/l) of every family,
+    // recomputed only when the system state changed
+    void updateDirections() const;
+
+    unsigned int first = 0, rows = 0, cols = 0;
+    Scalar ks[NumSpringTypes] = {0, 0, 0};
+    Scalar kd[NumSpringTypes] = {0, 0, 0};
+    mutable std::vector<Family> families;
+
+    // workspaces, component-major copies of the grid
+    mutable ArrayXN X, V, acc;
+    mutable unsigned long directionsVersion = 0;
 };
 
-class ForceGravitation : public Force
+template <int Dim, typename Scalar = double>
+class ForceGravitationT : public ForceT<Dim, Scalar>
 {
 public:
-    ForceGravitation() { attractor=nullptr; }
-    ForceGravitation(const Particle* p, double k) { attractor = p, G = k; }
-    virtual ~ForceGravitation() {}
+    typedef typename ForceT<Dim, Scalar>::Particle Particle;
+
+    ForceGravitationT() { attractor=nullptr; }
+    ForceGravitationT(const Particle* p, Scalar k) { attractor = p, G = k; }
+    virtual ~ForceGravitationT() {}
 
     virtual void apply();
+    virtual void applyTo(const std::vector<unsigned int>& indices);
 
-    void setAttractor(const Particle* p) { attractor = p; }
+    void setAttractor(const Particle* p) { attractor = p; this->changed(); }
     const Particle* getAttractor() const { return attractor; }
-    void setConstant(double k) { G = k; }
-    void setSmoothingFactors(double sa, double sb) { a = sa; b = sb; }
-    double getConstant() const { return G; }
+    void setConstant(Scalar k) { G = k; this->changed(); }
+    void setSmoothingFactors(Scalar sa, Scalar sb) { a = sa; b = sb; this->changed(); }
+    Scalar getConstant() const { return G; }
 
 protected:
+    void applyOn(Particle* p_j) const;
+
     const Particle* attractor;
-    double G = 6.6743e-11; // gravitational constant
-    double a = 1, b = 1;
+    Scalar G = Scalar(6.6743e-11); // gravitational constant
+    Scalar a = 1, b = 1;
+};
+
+// Base of the tree methods for the gravitation between all the influenced particles,
+// same law and smoothing as ForceGravitationT. Each evaluation of a new state sorts the
+// bodies by Morton code and builds an octree (quadtree in 2D) on that order, adaptively:
+// only the cells with more than leafSize bodies are split.
+template <int Dim, typename Scalar = double>
+class ForceGravityTreeT : public ForceT<Dim, Scalar>
+{
+public:
+    typedef typename ForceT<Dim, Scalar>::Particle Particle;
+    typedef typename ForceT<Dim, Scalar>::VecN VecN;
+    typedef typename ForceT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef Eigen::Matrix<Scalar, Dim, Eigen::Dynamic> MatrixNX;
+    typedef Eigen::Matrix<Scalar, 1, Eigen::Dynamic> RowVector;
+
+    // bits per axis of the Morton codes, the tree is never deeper than this
+    static const int MortonBits = Dim == 1 ? 32 : (Dim == 2 ? 31 : 21);
+
+    virtual ~ForceGravityTreeT() {}
+
+    void setConstant(Scalar k) { G = k; this->changed(); }
+    Scalar getConstant() const { return G; }
+    void setSmoothingFactors(Scalar sa, Scalar sb) { a = sa; b = sb; this->changed(); }
+    // accuracy against cost, see the methods for what it means to each
+    void setOpeningAngle(Scalar t) { theta = std::max(Scalar(0), t); this->changed(); }
+    Scalar getOpeningAngle() const { return theta; }
+    // a cell with this many bodies or less is not split any further
+    void setLeafSize(unsigned int n) { leafSize = std::max(1u, n); this->changed(); }
+    unsigned int getLeafSize() const { return leafSize; }
+
+    // worker threads for the sort, the tree and the evaluation
+    void setThreads(unsigned int n) { threads = std::max(1u, n); }
+    unsigned int getThreads() const { return threads; }
+
+    unsigned int getNumNodes() const { return (unsigned int)(nodes.size()); }
+
+protected:
+    typedef Eigen::Matrix<Scalar, Dim, 1, Eigen::DontAlign> PackedVecN;    // for std::vector
+    typedef std::pair<unsigned long long, unsigned int> MortonKey;          // code, body
+
+    // children of a node are consecutive, bodies [begin, end) are in Morton order
+    struct Node {
+        PackedVecN centre = PackedVecN::Zero();     // of mass
+        PackedVecN cellCentre = PackedVecN::Zero();
+        Scalar mass = 0;
+        Scalar size = 0;        // cell edge
+        Scalar radius = 0;      // of the bodies around the centre of mass
+        unsigned int begin = 0, end = 0;
+        unsigned int firstChild = 0, numChildren = 0;
+        unsigned int level = 0;
+    };
+
+    ForceGravityTreeT() {}
+    ForceGravityTreeT(Scalar k) { G = k; }
+
+    // sorts the influenced particles and builds the tree
+    void buildTree() const;
+    // same, unless it was already built for the current state version. Only for the
+    // partial evaluations: a full one always starts a new version (see updateForces).
+    void ensureTree() const;
+    // appends the non-empty child cells of tree[k], returns false if it is a leaf
+    bool splitNode(std::vector<Node>& tree, unsigned int k) const;
+    // splits tree[k] all the way down, then sums its mass from the children
+    void buildSubtree(std::vector<Node>& tree, unsigned int k) const;
+    void sumNode(std::vector<Node>& tree, unsigned int k) const;
+    // pull of a body of mass M at offset d over G: M*s(r)/r^3*d, with s the smoothing factor.
+    // 0 at d = 0, the body itself.
+    VecN attraction(const VecN& d, Scalar M) const;
+
+    Scalar G = Scalar(6.6743e-11);
+    Scalar a = 1, b = 1;
+    Scalar theta = Scalar(0.5);
+    unsigned int leafSize = 8;
+    unsigned int threads = 1;
+
+    // tree and bodies in Morton order, of the state version treeVersion
+    mutable std::vector<Particle*> bodies;
+    mutable std::vector<MortonKey> keys;
+    mutable MatrixNX sortedPos;
+    mutable RowVector sortedMass;
+    mutable std::vector<Node> nodes;
+    mutable unsigned long treeVersion = 0;
 };
 
+// Barnes-Hut, O(N log N): a cell far enough from a body acts on it as a single body at
+// the cell's centre of mass. With theta the opening angle, a cell of edge s at distance d
+// is taken whole when s < theta*d, so 0 is exact.
+template <int Dim, typename Scalar = double>
+class ForceBarnesHutT : public ForceGravityTreeT<Dim, Scalar>
+{
+public:
+    typedef typename ForceGravityTreeT<Dim, Scalar>::Particle Particle;
+    typedef typename ForceGravityTreeT<Dim, Scalar>::VecN VecN;
+    typedef typename ForceGravityTreeT<Dim, Scalar>::Node Node;
+    static const int MortonBits = ForceGravityTreeT<Dim, Scalar>::MortonBits;
+
+    ForceBarnesHutT() {}
+    ForceBarnesHutT(Scalar k) : ForceGravityTreeT<Dim, Scalar>(k) {}
+    virtual ~ForceBarnesHutT() {}
+
+    virtual void apply();
+    virtual void applyTo(const std::vector<unsigned int>& indices);
+
+protected:
+    // force of all the bodies on a body of mass m at x
+    VecN forceAt(const VecN& x, Scalar m) const;
+};
+
+// Fast multipole method, O(N) for a given accuracy. Each cell gets a multipole expansion
+// of its bodies' potential about its centre of mass, and a local expansion of the field
+// of the far cells, passed down to the children and evaluated on the bodies of the leaves.
+// The expansions are Cartesian Taylor series up to the given order, so they work in any
+// dimension and for the smoothed kernel, which isn't harmonic. Two cells interact through
+// their expansions when the sum of their radii is below theta times their distance, the
+// rest is summed directly. Error knobs: a higher order or a lower theta, both cost more.
+template <int Dim, typename Scalar = double>
+class ForceFMMT : public ForceGravityTreeT<Dim, Scalar>
+{
+public:
+    typedef typename ForceGravityTreeT<Dim, Scalar>::Particle Particle;
+    typedef typename ForceGravityTreeT<Dim, Scalar>::VecN VecN;
+    typedef typename ForceGravityTreeT<Dim, Scalar>::Node Node;
+
+    // bigger leaves than Barnes-Hut, the interactions between cells cost more than between bodies
+    ForceFMMT() { setOrder(4); this->leafSize = 32; }
+    ForceFMMT(Scalar k) : ForceGravityTreeT<Dim, Scalar>(k) { setOrder(4); this->leafSize = 32; }
+    virtual ~ForceFMMT() {}
+
+    virtual void apply();
+    virtual void applyTo(const std::vector<unsigned int>& indices);
+
+    // highest total degree of the expansions, the forces are exact to one less
+    static const unsigned int MaxOrder = 12;
+    void setOrder(unsigned int p);
+    unsigned int getOrder() const { return order; }
+    unsigned int getNumCoefficients() const { return numCoeffs; }
+
+    // work of the last evaluation: cell pairs through the expansions, body pairs direct
+    unsigned long getNumM2L() const { return numM2L; }
+    unsigned long getNumP2P() const { return numP2P; }
+
+protected:
+    // terms of the expansions: out[c] += in[a]*w[b] for every triple (a, b, c)
+    struct Term { unsigned int a, b, c; };
+
+    // tree, expansions and interaction lists for the current state
+    void evaluate() const;
+    // same, unless already done for the current state version (partial evaluations)
+    void ensureEvaluated() const;
+    // splits the pair of cells until they are well separated or leaves (dual tree walk)
+    void walk(unsigned int A, unsigned int B) const;
+    void walkSelf(unsigned int A) const;
+    // x^n/n! for every multi-index n
+    void powers(const VecN& x, Scalar* out) const;
+    // derivatives D^n phi(R) of the potential of a unit mass over G, phi'(r) = s(r)/r^2
+    void derivatives(const VecN& R, Scalar* out, Scalar* work) const;
+    // far field and direct sum on body k (Morton order) of leaf l
+    VecN forceOnBody(unsigned int l, unsigned int k, Scalar* work) const;
+    // scratch needed per thread by the functions above
+    unsigned int workSize() const { return (numCoeffs + 2)*(order + 1) + 2*numCoeffs; }
+
+    unsigned int order = 0;
+    unsigned int numCoeffs = 0;
+    // multi-indices n of total degree <= order, by degree, Dim exponents each
+    std::vector<int> exponents;
+    std::vector<unsigned int> degrees;
+    // for the derivatives: D^n from D^(n - e_i) and D^(n - 2e_i), i = derivAxis
+    std::vector<int> derivAxis, derivPrev1, derivPrev2;
+    std::vector<Term> shiftTerms;       // n = k + d: (k, d, n)
+    std::vector<Term> m2lTerms;         // (k, n + k, n), |n| >= 1
+    std::vector<Term> gradientTerms[Dim];   // (n + e_i, n), c unused
+    std::vector<std::vector<Scalar> > tanhPolys;    // derivatives of tanh as polynomials of it
+
+    // per evaluation
+    mutable std::vector<Scalar> multipoles, locals;     // numCoeffs per node
+    mutable std::vector<unsigned int> parent, leafOf, sortedOf, leaves;
+    mutable std::vector<std::vector<unsigned int> > levels;
+    mutable std::vector<std::pair<unsigned int, unsigned int> > m2lPairs, p2pPairs;    // target, source
+    mutable std::vector<unsigned int> m2lStart, m2lSources, p2pStart, p2pSources;
+    mutable unsigned long numM2L = 0, numP2P = 0;
+    mutable unsigned long fmmVersion = 0;
+};
+
+// Exact gravitation between all the influenced particles, same law and smoothing as
+// ForceGravitationT, for moderate N and as the reference for the approximate forces.
+// Each pair is evaluated once and adds opposite forces on its two bodies. The bodies are
+// copied to component arrays and the pairs are taken tile against tile, so both tiles
+// stay in cache, a body against Lanes others per vector step.
+template <int Dim, typename Scalar = double>
+class ForceNBodyDirectT : public ForceT<Dim, Scalar>
+{
+public:
+    typedef typename ForceT<Dim, Scalar>::Particle Particle;
+    typedef typename ForceT<Dim, Scalar>::VecN VecN;
+    typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> ArrayX;
+    typedef Eigen::Array<Scalar, Eigen::Dynamic, Dim> ArrayXN;    // one column per component
+    static const int Lanes = 16;                                  // bodies per vector step
+    static const int TileSize = 32*Lanes;
+    typedef Eigen::Array<Scalar, Lanes, 1> Lane;
+
+    ForceNBodyDirectT() {}
+    ForceNBodyDirectT(Scalar k) { G = k; }
+    virtual ~ForceNBodyDirectT() {}
+
+    virtual void apply();
+    virtual void applyTo(const std::vector<unsigned int>& indices);
+
+    void setConstant(Scalar k) { G = k; this->changed(); }
+    Scalar getConstant() const { return G; }
+    void setSmoothingFactors(Scalar sa, Scalar sb) { a = sa; b = sb; this->changed(); }
+
+    // worker threads, each takes a share of the tile pairs
+    void setThreads(unsigned int n) { threads = std::max(1u, n); }
+    unsigned int getThreads() const { return threads; }
+
+protected:
+    // copies the influenced particles to X and M, padded with massless bodies to whole tiles
+    void gatherBodies() const;
+    // force on a body of mass m at x from the bodies [begin, end) of the arrays (whole lanes).
+    // With reactions, x is body i of the arrays: the bodies up to i are skipped, and the
+    // opposite forces are subtracted from the reactions of the others.
+    VecN interact(const VecN& x, Scalar m, unsigned int i, unsigned int begin, unsigned int end,
+                  ArrayXN* reactions) const;
+
+    Scalar G = Scalar(6.6743e-11);
+    Scalar a = 1, b = 1;
+    unsigned int threads = 1;
+
+    // workspaces, sized on first use
+    mutable std::vector<Particle*> bodies;
+    mutable ArrayXN X;
+    mutable ArrayX M;
+    mutable std::vector<ArrayXN> partial;      // forces summed by each thread
+};
+
+
+typedef ForceT<3, double>                   Force;
+typedef ForceConstAccelerationT<3, double>  ForceConstAcceleration;
+typedef ForceDragT<3, double>               ForceDrag;
+typedef ForceSpringT<3, double>             ForceSpring;
+typedef ForceSpringNetworkT<3, double>      ForceSpringNetwork;
+typedef ForceClothGridT<3, double>          ForceClothGrid;
+typedef ForceGravitationT<3, double>        ForceGravitation;
+typedef ForceBarnesHutT<3, double>          ForceBarnesHut;
+typedef ForceNBodyDirectT<3, double>        ForceNBodyDirect;
+typedef ForceFMMT<3, double>                ForceFMM;
+
+
 #endif // FORCES_H
@@ -66,10 +66,13 @@ void GLWidget::paintTextOverlay()
     QPen penLineGrey(QColor(50, 50, 50));
     QPen penLineWhite(QColor(250, 250, 250));
 
+    unsigned int substepsAccepted, substepsRejected;
+    const bool adaptive = scene->getSubstepStats(substepsAccepted, substepsRejected);
+
     const int bX = 10;
     const int bY = 10;
     const int sizeX = 170;
-    const int sizeY = 110;
+    const int sizeY = adaptive ? 150 : 110;
 
     // Background
     painter.setPen(penLineGrey);
@@ -89,6 +92,10 @@ void GLWidget::paintTextOverlay()
     painter.drawText(10 + 5, bY + 10 +  50, "Sim time:  " + QString::number(simTime, 'f', 3) + " s");
     painter.drawText(10 + 5, bY + 10 +  70, "Curr perf: " + QString::number(simPerf, 'f', 1) + " ms/step");
     painter.drawText(10 + 5, bY + 10 +  90, "Avg perf:  " + QString::number(simMs/double(simSteps), 'f', 1) + " ms/step");
+    if (adaptive) {
+        painter.drawText(10 + 5, bY + 10 + 110, "Substeps:  " + QString::number(substepsAccepted));
+        painter.drawText(10 + 5, bY + 10 + 130, "Rejected:  " + QString::number(substepsRejected));
+    }
     painter.end();
 
     // Reset GL depth test and alpha
@@ -1,6 +1,7 @@
 #include "hash.h"
 
-Hash::Hash(int spacing, int maxNum, ParticleSystem* system):spacing(spacing), system(system){
+template <typename Scalar>
+HashT<Scalar>::HashT(int spacing, int maxNum, ParticleSystem* system):spacing(spacing), system(system){
     size = 2 * maxNum;
     grid = new std::vector<int>(size + 1, 0);
     cells = new std::vector<int>(maxNum, 0);
@@ -8,24 +9,28 @@ Hash::Hash(int spacing, int maxNum, ParticleSystem* system):spacing(spacing), sy
     querySize = 0;
 }
 
-int Hash::hashCoordinates(int x, int y, int z){
+template <typename Scalar>
+int HashT<Scalar>::hashCoordinates(int x, int y, int z){
     int hash = (x * 346782478) ^ (y * 453218576) ^ (z * 821357954);
     return std::abs(hash)%size;
 }
 
-Vec3 Hash::intCoordinates(Vec3 coord){
+template <typename Scalar>
+Vec3 HashT<Scalar>::intCoordinates(Vec3 coord){
     int x = std::floor(coord.x()/spacing);
     int y = std::floor(coord.y()/spacing);
     int z = std::floor(coord.z()/spacing);
     return Vec3(x,y,z);
 }
 
-int Hash::hashPos(int nr){
-    Vec3 pos = system->getParticle(nr)->pos;
+template <typename Scalar>
+int HashT<Scalar>::hashPos(int nr){
+    Vec3 pos = system->getParticle(nr)->pos.template cast<double>();
     return hashCoordinates(pos.x(),pos.y(),pos.z());
 }
 
-void Hash::create(int nr){
+template <typename Scalar>
+void HashT<Scalar>::create(int nr){
     delete grid;
     delete cells;
     grid = new std::vector<int>(size + 1, 0);
@@ -52,12 +57,13 @@ void Hash::create(int nr){
     }
 }
 
-void Hash::query(int nr, int maxDist){
-    Vec3 temp_pos0 = system->getParticle(nr)->pos;
+template <typename Scalar>
+void HashT<Scalar>::query(int nr, int maxDist){
+    Vec3 temp_pos0 = system->getParticle(nr)->pos.template cast<double>();
     Vec3 pos0 = Vec3(temp_pos0.x() - maxDist, temp_pos0.y() - maxDist, temp_pos0.z() - maxDist);
     Vec3 p0 = intCoordinates(pos0);
 
-    Vec3 temp_pos1 = system->getParticle(nr)->pos;
+    Vec3 temp_pos1 = system->getParticle(nr)->pos.template cast<double>();
     Vec3 pos1 = Vec3(temp_pos1.x() + maxDist, temp_pos1.y() + maxDist, temp_pos1.z() + maxDist);
     Vec3 p1 = intCoordinates(pos1);
 
@@ -80,10 +86,5 @@ void Hash::query(int nr, int maxDist){
 }
 
 
-
-
-
-
-
-
-
+template class HashT<double>;
+template class HashT<float>;
@@ -5,11 +5,14 @@
 #include "particlesystem.h"
 #include <vector>
 
-class Hash
+template <typename Scalar = double>
+class HashT
 {
 public:
-    Hash();
-    Hash(int spacing, int maxNum, ParticleSystem* system);
+    typedef ParticleSystemT<3, Scalar> ParticleSystem;
+
+    HashT();
+    HashT(int spacing, int maxNum, ParticleSystem* system);
 
     int hashCoordinates(int x, int y, int z);
     Vec3 intCoordinates(Vec3 coord);
@@ -35,4 +38,6 @@ protected:
     ParticleSystem* system;
 };
 
+typedef HashT<double> Hash;
+
 #endif // HASH_H
@@ -1,119 +1,802 @@
 #include "integrators.h"
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <atomic>
 
+namespace {
+    // Marks the part of a step that should not allocate once the workspace is sized.
+    // Only checked when Eigen is built with EIGEN_RUNTIME_NO_MALLOC (and asserts enabled).
+    // Eigen's flag is process-wide, so the check is off while steps run on several threads.
+    std::atomic<int> parallelSteps(0);
+
+    struct NoMallocScope {
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+        NoMallocScope()  { if (parallelSteps == 0) Eigen::internal::set_is_malloc_allowed(false); }
+        ~NoMallocScope() { Eigen::internal::set_is_malloc_allowed(true);  }
+#else
+        NoMallocScope()  {}
+#endif
+    };
+}
+
+// Steps start with ensureForces, which only evaluates the forces if the state changed
+// since they were last computed. The ones that don't end with the forces of the final
+// state just mark it as changed, so whoever needs them next pays for them once
+// (the scenes often move particles after the step anyway).
+
+// Time is kept in double, the step is converted once to the system scalar type.
 // timestep 0.5, default system params, 10 steps (10 times 1 step)
 
 
-void IntegratorEuler::step(ParticleSystem &system, double dt) {
+template <int Dim, typename Scalar>
+void IntegratorEulerT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
     //10 steps :
     //analytical : x = 5.26670, v = -1.89764
     //numerical : x = 5.38485, v = -1.96082
+    dx.resize(system.getStateSize());
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
     double t0 = system.getTime();
-    Vecd x0 = system.getState();
-    Vecd dx = system.getDerivative();
-    Vecd x1 = x0 + dt*dx;
-    system.setState(x1);
+    const Scalar h = dt;
+    typename ParticleSystem::StateView x = system.getStateView();
+    system.getDerivative(dx);
+    x += h*dx;
     system.setTime(t0+dt);
-    system.updateForces();
+    system.markStateChanged();
 }
 
-void IntegratorSymplecticEuler::step(ParticleSystem &system, double dt) {
+template <int Dim, typename Scalar>
+void IntegratorSymplecticEulerT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
     //10 steps :
     //analytical : x = 5.26670, v = -1.89764
     //numerical : x = 5.15630, v = -1.85609
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
     double t0 = system.getTime();
-    Vecd dx = system.getState();
-    Vecd v1 = system.getVelocities() + dt*system.getAccelerations();
-    system.setVelocities(v1);
-    Vecd p1 = system.getPositions() + dt*v1;
-    system.setPositions(p1);
+    const Scalar h = dt;
+    typename ParticleSystem::VectorView pos = system.getPositionsView();
+    typename ParticleSystem::VectorView vel = system.getVelocitiesView();
+    typename ParticleSystem::VectorView force = system.getForcesView();
+    typename ParticleSystem::ConstScalarView invMass = system.getInverseMassesView();
+    vel += h*(force.array().rowwise()*invMass.array()).matrix();
+    pos += h*vel;
     system.setTime(t0+dt);
-    system.updateForces();
+    system.markStateChanged();
 }
 
-void IntegratorMidpoint::step(ParticleSystem &system, double dt) {
+template <int Dim, typename Scalar>
+void IntegratorMidpointT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
     //10 steps :
     //analytical : x = 5.26670, v = -1.89764
     //numerical : x = 5.26578, v = -1.90063
+    x0.resize(system.getStateSize());
+    dx.resize(system.getStateSize());
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
     double t0 = system.getTime();
-    Vecd x0 = system.getState();
-    Vecd dx = system.getDerivative();
-    Vecd midx = x0+dt*dx/2;
-    system.setState(midx);
+    const Scalar h = dt;
+    typename ParticleSystem::StateView x = system.getStateView();
+    x0 = x;
+    system.getDerivative(dx);
+    x = x0 + h*dx/2;
     system.setTime(t0 + dt/2);
     system.updateForces();
-    Vecd dv1 = system.getDerivative();
-    Vecd x1 = x0+dt*dv1;
-    system.setState(x1);
+    system.getDerivative(dx);
+    x = x0 + h*dx;
     system.setTime(t0+dt);
-    system.updateForces();
+    system.markStateChanged();
 }
 
-void IntegratorRK2::step(ParticleSystem &system, double dt) {
+template <int Dim, typename Scalar>
+void IntegratorRK2T<Dim, Scalar>::step(ParticleSystem &system, double dt) {
     //10 steps :
     //analytical : x = 5.26670, v = -1.89764
     //numerical : x = 5.26567, v = -1.90136
+    x0.resize(system.getStateSize());
+    k1.resize(system.getStateSize());
+    k2.resize(system.getStateSize());
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
     double t0 = system.getTime();
-    Vecd x0 = system.getState();
-    Vecd k1 = system.getDerivative();
-    Vecd xk1 = x0 + dt*k1;
+    const Scalar h = dt;
+    typename ParticleSystem::StateView x = system.getStateView();
+    x0 = x;
+    system.getDerivative(k1);
+    x = x0 + h*k1;
     system.setTime(t0+dt);
-    system.setState(xk1);
     system.updateForces();
 
-    Vecd k2 = system.getDerivative();
-    Vecd x1 = x0+dt/2*(k1+k2);
-
-    system.setState(x1);
-    system.updateForces();
+    system.getDerivative(k2);
+    x = x0 + h/2*(k1+k2);
+    system.markStateChanged();
 }
 
-void IntegratorRK4::step(ParticleSystem &system, double dt) {
+template <int Dim, typename Scalar>
+void IntegratorRK4T<Dim, Scalar>::step(ParticleSystem &system, double dt) {
     //10 steps :
     //analytical : x = 5.26670, v = -1.89764
     //numerical : x = 5.26670, v = -1.89763
+    x0.resize(system.getStateSize());
+    k1.resize(system.getStateSize());
+    k2.resize(system.getStateSize());
+    k3.resize(system.getStateSize());
+    k4.resize(system.getStateSize());
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
     double t0 = system.getTime();
-    Vecd x0 = system.getState();
-    Vecd k1 = system.getDerivative();
-    Vecd xk1 = x0+dt/2*k1;
-    system.setState(xk1);
+    const Scalar h = dt;
+    typename ParticleSystem::StateView x = system.getStateView();
+    x0 = x;
+    system.getDerivative(k1);
+    x = x0 + h/2*k1;
     system.setTime(t0+dt/2);
     system.updateForces();
 
-    Vecd k2 = system.getDerivative();
-    Vecd xk2 = x0+dt/2*k2;
+    system.getDerivative(k2);
+    x = x0 + h/2*k2;
     system.setTime(t0+dt/2);
-    system.setState(xk2);
     system.updateForces();
 
-    Vecd k3 = system.getDerivative();
-    Vecd xk3 = x0+dt*k3;
+    system.getDerivative(k3);
+    x = x0 + h*k3;
     system.setTime(t0+dt);
-    system.setState(xk3);
     system.updateForces();
 
-    Vecd k4 = system.getDerivative();
-    Vecd x = x0 + dt/6*(k1 + 2*k2 + 2*k3 + k4);
+    system.getDerivative(k4);
+    x = x0 + h/6*(k1 + 2*k2 + 2*k3 + k4);
     system.setTime(t0+dt);
-    system.setState(x);
-    system.updateForces();
+    system.markStateChanged();
 }
 
-void IntegratorVerlet::step(ParticleSystem &system, double dt) { //broken
+template <int Dim, typename Scalar>
+void IntegratorVerletT<Dim, Scalar>::step(ParticleSystem &system, double dt) { //broken
     //10 steps :
     //analytical : x = 5.26670, v = -1.89764
     //numerical : x = 5.15630, v = -1.85609
+    const int n = system.getNumParticles();
+    pt.resize(Dim*n);
+    acc.resize(Dim*n);
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
     double t0 = system.getTime();
-    Vecd pt = system.getPositions();
-    Vecd pmt = system.getPreviousPositions();
+    const Scalar h = dt;
+    typename ParticleSystem::VectorView pos  = system.getPositionsView();
+    typename ParticleSystem::VectorView vel  = system.getVelocitiesView();
+    typename ParticleSystem::VectorView pmt  = system.getPreviousPositionsView();
+    Eigen::Map<typename ParticleSystem::MatrixNX> p0(pt.data(), Dim, n);
+    Eigen::Map<typename ParticleSystem::MatrixNX> a(acc.data(), Dim, n);
+    p0 = pos;
+    system.getAccelerations(acc);
     if(t0 == 0.0){
-        pmt = pt - system.getVelocities()*dt;
+        pmt = p0 - vel*h;
+    }
+    pos = p0 + (p0 - pmt) + h*h*a;
+    pmt = p0;
+    vel = (pos - p0)/h;
+    system.setTime(t0+dt);
+    system.markStateChanged();
+}
+
+template <int Dim, typename Scalar>
+void IntegratorVelocityVerletT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
+    double t0 = system.getTime();
+    const Scalar h = dt;
+    typename ParticleSystem::VectorView pos = system.getPositionsView();
+    typename ParticleSystem::VectorView vel = system.getVelocitiesView();
+    typename ParticleSystem::VectorView force = system.getForcesView();
+    typename ParticleSystem::ConstScalarView invMass = system.getInverseMassesView();
+    vel += h/2*(force.array().rowwise()*invMass.array()).matrix();
+    pos += h*vel;
+    system.setTime(t0+dt);
+    system.updateForces();
+    vel += h/2*(force.array().rowwise()*invMass.array()).matrix();
+}
+
+template <int Dim, typename Scalar>
+void IntegratorSplittingT<Dim, Scalar>::kick(ParticleSystem& system, Scalar h) {
+    typename ParticleSystem::VectorView vel = system.getVelocitiesView();
+    typename ParticleSystem::VectorView force = system.getForcesView();
+    typename ParticleSystem::ConstScalarView invMass = system.getInverseMassesView();
+    vel += h*(force.array().rowwise()*invMass.array()).matrix();
+}
+
+template <int Dim, typename Scalar>
+void IntegratorSplittingT<Dim, Scalar>::drift(ParticleSystem& system, Scalar h) {
+    typename ParticleSystem::VectorView pos = system.getPositionsView();
+    typename ParticleSystem::VectorView vel = system.getVelocitiesView();
+    pos += h*vel;
+}
+
+template <int Dim, typename Scalar>
+void IntegratorSplittingT<Dim, Scalar>::setComposition(const std::vector<double>& weights) {
+    // consecutive half kicks of neighbouring verlet steps merge into one
+    kicks.assign(weights.size() + 1, 0.0);
+    drifts = weights;
+    for (unsigned int i = 0; i < weights.size(); i++) {
+        kicks[i]   += weights[i]/2;
+        kicks[i+1] += weights[i]/2;
+    }
+}
+
+template <int Dim, typename Scalar>
+void IntegratorSplittingT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
+    // the position form doesn't use the forces of the initial state
+    const bool kickFirst = kicks.size() > drifts.size();
+    if (kickFirst) system.ensureForces();
+    NoMallocScope noMalloc;
+
+    // drifts advance the clock, the forces after each one see their own time
+    double t0 = system.getTime();
+    double c = 0;
+    for (unsigned int i = 0; i < drifts.size(); i++) {
+        if (kickFirst) kick(system, Scalar(kicks[i]*dt));
+        drift(system, Scalar(drifts[i]*dt));
+        c += drifts[i];
+        system.setTime(t0 + c*dt);
+        // the position form ends with a drift, the forces of the final state are left to the next step
+        if (kickFirst || i < kicks.size()) {
+            system.updateForces();
+            if (!kickFirst) kick(system, Scalar(kicks[i]*dt));
+        }
     }
-    Vecd pdt = pt + (pt - pmt) + dt*dt*system.getAccelerations();
-    system.setPreviousPositions(pt);
-    system.setPositions(pdt);
-    Vecd vdt = (pdt - pt)/dt;
-    system.setVelocities(vdt);
+    if (kickFirst) kick(system, Scalar(kicks.back()*dt));
     system.setTime(t0+dt);
+}
+
+template <int Dim, typename Scalar>
+IntegratorYoshida4T<Dim, Scalar>::IntegratorYoshida4T() {
+    const double w1 = 1/(2 - std::cbrt(2.0));
+    const double w0 = 1 - 2*w1;
+    this->setComposition({w1, w0, w1});
+}
+
+template <int Dim, typename Scalar>
+IntegratorYoshida6T<Dim, Scalar>::IntegratorYoshida6T() {
+    const double w1 = -1.17767998417887;
+    const double w2 =  0.235573213359357;
+    const double w3 =  0.784513610477560;
+    const double w0 = 1 - 2*(w1 + w2 + w3);
+    this->setComposition({w3, w2, w1, w0, w1, w2, w3});
+}
+
+template <int Dim, typename Scalar>
+IntegratorPEFRLT<Dim, Scalar>::IntegratorPEFRLT() {
+    const double xi     =  0.1786178958448091;
+    const double lambda = -0.2123418310626054;
+    const double chi    = -0.06626458266981849;
+    this->drifts = {xi, chi, 1 - 2*(chi + xi), chi, xi};
+    this->kicks  = {(1 - 2*lambda)/2, lambda, lambda, (1 - 2*lambda)/2};
+}
+
+template <int Dim, typename Scalar>
+unsigned int IntegratorBlockStepT<Dim, Scalar>::chooseLevel(unsigned int i, double dt) const {
+    if (!hasJerk[i]) return maxLevel;
+    const double a = Eigen::Map<const typename ParticleSystem::Particle::VecN>(acc.data() + Dim*i).norm();
+    const double j = Eigen::Map<const typename ParticleSystem::Particle::VecN>(jerk.data() + Dim*i).norm();
+    if (!(j > 0)) return 0;
+    const double h = eta*a/j;
+    if (h >= dt) return 0;
+    return std::min<unsigned int>(maxLevel, unsigned(std::ceil(std::log2(dt/h))));
+}
+
+template <int Dim, typename Scalar>
+void IntegratorBlockStepT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
+    evaluations = deepestLevel = 0;
+    if (dt <= 0) return;
+    const unsigned int n = system.getNumParticles();
+    if (levels.size() != n) {
+        levels.assign(n, maxLevel);
+        hasJerk.assign(n, 0);
+        jerk = Vecd::Zero(Dim*n);
+    }
+    acc.resize(Dim*n);
+    active.reserve(n);
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
+    typedef typename ParticleSystem::MatrixNX MatrixNX;
+    typename ParticleSystem::VectorView pos = system.getPositionsView();
+    typename ParticleSystem::VectorView vel = system.getVelocitiesView();
+    typename ParticleSystem::VectorView force = system.getForcesView();
+    typename ParticleSystem::ConstScalarView invMass = system.getInverseMassesView();
+    Eigen::Map<MatrixNX> a(acc.data(), Dim, n);
+    Eigen::Map<MatrixNX> j(jerk.data(), Dim, n);
+
+    // forces of the current state, as ensured above
+    a = force.array().rowwise()*invMass.array();
+
+    const double t0 = system.getTime();
+    const unsigned int substeps = 1u << maxLevel;
+    const double hmin = dt/substeps;
+    for (unsigned int s = 0; s < substeps; s++) {
+        // particles starting a step pick their level and get the opening half kick
+        for (unsigned int i = 0; i < n; i++) {
+            if (s % (1u << (maxLevel - levels[i]))) continue;
+            // the step can at most double, a jerk measured over a long step is unreliable
+            unsigned int k = std::max(chooseLevel(i, dt), levels[i] > 0 ? levels[i] - 1 : 0u);
+            while (k < maxLevel && s % (1u << (maxLevel - k))) k++;
+            levels[i] = k;
+            deepestLevel = std::max(deepestLevel, k);
+            vel.col(i) += Scalar(dt/(1u << k)/2)*a.col(i);
+        }
+
+        pos += Scalar(hmin)*vel;
+        system.setTime(t0 + (s + 1)*hmin);
+
+        // particles ending their step get new forces and the closing half kick
+        active.clear();
+        for (unsigned int i = 0; i < n; i++) {
+            if ((s + 1) % (1u << (maxLevel - levels[i])) == 0) active.push_back(i);
+        }
+        if (active.size() == n) system.updateForces();
+        else                    system.updateForces(active);
+        evaluations += active.size();
+
+        for (unsigned int i : active) {
+            const Scalar h = dt/(1u << levels[i]);
+            const typename ParticleSystem::Particle::VecN anew = force.col(i)*invMass[i];
+            j.col(i) = (anew - a.col(i))/h;
+            hasJerk[i] = 1;
+            a.col(i) = anew;
+            vel.col(i) += h/2*anew;
+        }
+    }
+
+    // the last substep ends every step, so all forces are up to date
+    system.setTime(t0+dt);
+}
+
+template <int Dim, typename Scalar>
+void IntegratorRK45T<Dim, Scalar>::evaluate(ParticleSystem& system, double t, Vecd& k) {
+    system.setTime(t);
     system.updateForces();
+    system.getDerivative(k);
+    evaluations++;
 }
+
+template <int Dim, typename Scalar>
+void IntegratorRK45T<Dim, Scalar>::step(ParticleSystem &system, double dt) {
+    accepted = rejected = evaluations = 0;
+    if (dt <= 0) return;
+    const int n = system.getStateSize();
+    x0.resize(n);
+    k1.resize(n); k2.resize(n); k3.resize(n); k4.resize(n);
+    k5.resize(n); k6.resize(n); k7.resize(n);
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
+    typedef typename ParticleSystem::Accumulator Accumulator;
+    typedef Scalar S;
+    const double tEnd = system.getTime() + dt;
+    double t = system.getTime();
+    if (hTry <= 0) hTry = dt;
+
+    // forces are those of the current state, so the first k1 is free
+    typename ParticleSystem::StateView x = system.getStateView();
+    x0 = x;
+    system.getDerivative(k1);
+
+    while (tEnd - t > 1e-9*dt) {
+        const double h = std::min(hTry, tEnd - t);
+        const Scalar hs = h;
+
+        x = x0 + hs*(S(1.0/5)*k1);
+        evaluate(system, t + h/5, k2);
+        x = x0 + hs*(S(3.0/40)*k1 + S(9.0/40)*k2);
+        evaluate(system, t + 3*h/10, k3);
+        x = x0 + hs*(S(44.0/45)*k1 - S(56.0/15)*k2 + S(32.0/9)*k3);
+        evaluate(system, t + 4*h/5, k4);
+        x = x0 + hs*(S(19372.0/6561)*k1 - S(25360.0/2187)*k2 + S(64448.0/6561)*k3 - S(212.0/729)*k4);
+        evaluate(system, t + 8*h/9, k5);
+        x = x0 + hs*(S(9017.0/3168)*k1 - S(355.0/33)*k2 + S(46732.0/5247)*k3 + S(49.0/176)*k4
+                     - S(5103.0/18656)*k5);
+        evaluate(system, t + h, k6);
+
+        // 5th order solution, its derivative is the first stage of the next substep
+        x = x0 + hs*(S(35.0/384)*k1 + S(500.0/1113)*k3 + S(125.0/192)*k4 - S(2187.0/6784)*k5
+                     + S(11.0/84)*k6);
+        evaluate(system, t + h, k7);
+
+        // difference with the embedded 4th order solution, k2 is free by now
+        k2 = hs*(S(71.0/57600)*k1 - S(71.0/16695)*k3 + S(71.0/1920)*k4 - S(17253.0/339200)*k5
+                 + S(22.0/525)*k6 - S(1.0/40)*k7);
+        const double err = std::sqrt(double((k2.array()/(S(absTol) + S(relTol)*x0.array().abs().max(x.array().abs())))
+                                            .template cast<Accumulator>().square().mean()));
+
+        const bool accept = err <= 1 || h <= minSubstep;
+        if (accept) {
+            t += h;
+            x0 = x;
+            k1.swap(k7);
+            accepted++;
+        }
+        else {
+            x = x0;
+            rejected++;
+        }
+
+        // usual controller, with the change limited to [0.2, 5] per substep.
+        // A substep cut short by the end of dt doesn't shrink the next one.
+        const double factor = err > 0 ? std::min(5.0, std::max(0.2, 0.9*std::pow(err, -0.2))) : 5.0;
+        if (accept && h < hTry) hTry = std::max(hTry, h*factor);
+        else                    hTry = std::max(minSubstep, h*factor);
+    }
+
+    // the forces already are those of the final state
+    system.setTime(tEnd);
+}
+
+
+template <int Dim, typename Scalar>
+void IntegratorBackwardEulerT<Dim, Scalar>::multiply(ParticleSystem& system, Scalar h, const Vecd& y, Vecd& out) const {
+    const int n = system.getNumParticles();
+    Eigen::Map<typename ParticleSystem::MatrixNX>(out.data(), Dim, n) =
+            Eigen::Map<const typename ParticleSystem::MatrixNX>(y.data(), Dim, n).array().rowwise()
+            * system.getMassesView().array();
+    for (const Force* f : implicitForces) {
+        f->addJacobianProduct(-h*h, -h, y.data(), out.data());
+    }
+}
+
+template <int Dim, typename Scalar>
+void IntegratorBackwardEulerT<Dim, Scalar>::filter(Vecd& y) const {
+    Eigen::Map<typename ParticleSystem::MatrixNX>(y.data(), Dim, unpinned.size()).array().rowwise()
+            *= unpinned.array();
+}
+
+template <int Dim, typename Scalar>
+void IntegratorBackwardEulerT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
+    const int n = system.getNumParticles();
+    if (dv.size() != Dim*n) dv = Vecd::Zero(Dim*n);
+    b.resize(Dim*n); r.resize(Dim*n); d.resize(Dim*n); q.resize(Dim*n);
+    z.resize(Dim*n); invDiag.resize(Dim*n); v0.resize(Dim*n);
+    unpinned.resize(n);
+    implicitForces.clear();
+    for (unsigned int i = 0; i < system.getNumForces(); i++) {
+        if (isImplicit(system.getForce(i))) implicitForces.push_back(system.getForce(i));
+    }
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
+    typedef typename ParticleSystem::Accumulator Accumulator;
+    typedef typename ParticleSystem::MatrixNX MatrixNX;
+    double t0 = system.getTime();
+    const Scalar h = dt;
+    typename ParticleSystem::VectorView pos = system.getPositionsView();
+    typename ParticleSystem::VectorView vel = system.getVelocitiesView();
+    unpinned = (system.getInverseMassesView().array() != 0).template cast<Scalar>();
+
+    // right hand side h*(f + h*df/dx*v), forces are those of the current state
+    Eigen::Map<MatrixNX>(v0.data(), Dim, n) = vel;
+    Eigen::Map<MatrixNX>(b.data(), Dim, n) = system.getForcesView();
+    for (const Force* f : implicitForces) {
+        f->addJacobianProduct(h, 0, v0.data(), b.data());
+    }
+    b *= h;
+    filter(b);
+
+    iterations = 0;
+    if (implicitForces.empty()) {
+        // nothing to solve, M dv = h f
+        Eigen::Map<MatrixNX>(dv.data(), Dim, n) = Eigen::Map<const MatrixNX>(b.data(), Dim, n).array().rowwise()
+                * system.getInverseMassesView().array();
+    }
+    else {
+        // Jacobi preconditioner
+        Eigen::Map<MatrixNX>(invDiag.data(), Dim, n) = MatrixNX::Ones(Dim, n).array().rowwise()
+                * system.getMassesView().array();
+        for (const Force* f : implicitForces) {
+            f->addJacobianDiagonal(-h*h, -h, invDiag.data());
+        }
+        invDiag = (invDiag.array() > 0).select(invDiag.array().inverse(), Scalar(1));
+
+        // preconditioned CG, starting from the last step's dv
+        filter(dv);
+        multiply(system, h, dv, q);
+        r = b - q;
+        filter(r);
+        z = invDiag.cwiseProduct(r);
+        d = z;
+        Accumulator delta = r.template cast<Accumulator>().dot(z.template cast<Accumulator>());
+        const Accumulator delta0 = b.template cast<Accumulator>().dot(invDiag.cwiseProduct(b).template cast<Accumulator>());
+        const Accumulator threshold = Accumulator(tolerance*tolerance)*delta0;
+        while (iterations < maxIterations && delta > threshold) {
+            multiply(system, h, d, q);
+            filter(q);
+            const Accumulator dq = d.template cast<Accumulator>().dot(q.template cast<Accumulator>());
+            if (dq <= 0) break;
+            const Scalar alpha = delta/dq;
+            dv += alpha*d;
+            r -= alpha*q;
+            z = invDiag.cwiseProduct(r);
+            const Accumulator deltaOld = delta;
+            delta = r.template cast<Accumulator>().dot(z.template cast<Accumulator>());
+            d = z + Scalar(delta/deltaOld)*d;
+            filter(d);
+            iterations++;
+        }
+    }
+
+    vel += Eigen::Map<const MatrixNX>(dv.data(), Dim, n);
+    pos += h*vel;
+    system.setTime(t0+dt);
+    system.markStateChanged();
+}
+
+
+template <int Dim, typename Scalar>
+void IntegratorBulirschStoerT<Dim, Scalar>::evaluate(ParticleSystem& system, double t, Vecd& k) {
+    system.setTime(t);
+    system.updateForces();
+    system.getDerivative(k);
+    evaluations++;
+}
+
+template <int Dim, typename Scalar>
+void IntegratorBulirschStoerT<Dim, Scalar>::midpoint(ParticleSystem& system, double t, double H,
+                                                     unsigned int n, Vecd& result) {
+    // z1 = x0 + h f(x0), z(m+1) = z(m-1) + 2h f(z(m)), result = (z(n) + z(n-1) + h f(z(n)))/2
+    typename ParticleSystem::StateView x = system.getStateView();
+    const Scalar h = H/n;
+    zm = x0;
+    zc = x0 + h*d0;
+    for (unsigned int m = 1; m < n; m++) {
+        x = zc;
+        evaluate(system, t + m*H/n, f);
+        zm += 2*h*f;
+        zm.swap(zc);
+    }
+    x = zc;
+    evaluate(system, t + H, f);
+    result = Scalar(0.5)*(zc + zm + h*f);
+}
+
+template <int Dim, typename Scalar>
+void IntegratorBulirschStoerT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
+    accepted = rejected = evaluations = 0;
+    if (dt <= 0) return;
+    const int n = system.getStateSize();
+    x0.resize(n); d0.resize(n); zm.resize(n); zc.resize(n);
+    f.resize(n); cur.resize(n); next.resize(n);
+    for (unsigned int j = 0; j < MaxColumns; j++) table[j].resize(n);
+    system.ensureForces();
+    NoMallocScope noMalloc;
+
+    typedef typename ParticleSystem::Accumulator Accumulator;
+    const double tEnd = system.getTime() + dt;
+    double t = system.getTime();
+    if (hTry <= 0) hTry = dt;
+
+    typename ParticleSystem::StateView x = system.getStateView();
+    x0 = x;
+    system.getDerivative(d0);
+
+    while (tEnd - t > 1e-9*dt) {
+        const double H = std::min(hTry, tEnd - t);
+
+        // extrapolation table, one row per inner step count, kept in place (Neville)
+        double err = 0, factor = 1;
+        unsigned int k = 0;
+        bool converged = false;
+        for (k = 0; k <= columns && k < MaxColumns; k++) {
+            const unsigned int nk = 2*(k + 1);
+            midpoint(system, t, H, nk, cur);
+            for (unsigned int j = 1; j <= k; j++) {
+                const double r = double(nk)/(2*(k - j + 1));
+                next = cur + (cur - table[j-1])/Scalar(r*r - 1);
+                table[j-1].swap(cur);
+                cur.swap(next);
+            }
+            table[k] = cur;
+            if (k == 0) continue;
+
+            // the last two columns of the row
+            err = std::sqrt(double(((table[k] - table[k-1]).array()/(Scalar(absTol)
+                            + Scalar(relTol)*x0.array().abs().max(table[k].array().abs())))
+                            .template cast<Accumulator>().square().mean()));
+            factor = err > 0 ? std::min(4.0, std::max(0.2, 0.94*std::pow(0.65/err, 1.0/(2*k + 1)))) : 4.0;
+            if (err <= 1) {
+                converged = true;
+                break;
+            }
+        }
+
+        if (converged || H <= minSubstep) {
+            if (!converged) k = std::min(columns, MaxColumns - 1);
+            t += H;
+            x = table[k];
+            evaluate(system, t, d0);
+            x0 = x;
+            accepted++;
+
+            // next time try one column past the one that was enough here
+            columns = std::max(2u, std::min(MaxColumns - 1, k + 1));
+            if (H < hTry) hTry = std::max(hTry, H*factor);
+            else          hTry = std::max(minSubstep, H*factor);
+        }
+        else {
+            x = x0;
+            rejected++;
+            hTry = std::max(minSubstep, H*std::min(factor, 0.7));
+        }
+    }
+
+    // the forces already are those of the final state
+    system.setTime(tEnd);
+}
+
+template <int Dim, typename Scalar>
+IntegratorPararealT<Dim, Scalar>::~IntegratorPararealT() {
+    deleteSlices();
+}
+
+template <int Dim, typename Scalar>
+void IntegratorPararealT<Dim, Scalar>::createSlices(unsigned int n) {
+    deleteSlices();
+    for (unsigned int i = 0; i < n; i++) {
+        Slice s;
+        s.system = makeSystem();
+        s.coarse = makeCoarse();
+        s.fine = makeFine();
+        workers.push_back(s);
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        threads.push_back(std::thread(&IntegratorPararealT::work, this, i));
+    }
+}
+
+template <int Dim, typename Scalar>
+void IntegratorPararealT<Dim, Scalar>::deleteSlices() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for (std::thread& th : threads) th.join();
+    threads.clear();
+    quit = false;
+    round = 0;
+
+    for (Slice& s : workers) {
+        s.system->deleteForces();
+        s.system->deleteParticles();
+        delete s.system;
+        delete s.coarse;
+        delete s.fine;
+    }
+    workers.clear();
+}
+
+template <int Dim, typename Scalar>
+void IntegratorPararealT<Dim, Scalar>::propagate(Slice& s, Integrator* integrator, unsigned int steps,
+                                                 const Vecd& x0, double t0, double h, Vecd& x1) {
+    s.system->setState(x0);
+    s.system->setTime(t0);
+    s.system->updateForces();
+    for (unsigned int i = 0; i < steps; i++) {
+        integrator->step(*s.system, h);
+    }
+    x1 = s.system->getStateView();
+}
+
+template <int Dim, typename Scalar>
+void IntegratorPararealT<Dim, Scalar>::work(unsigned int n) {
+    unsigned long seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [&]() { return quit || round != seen; });
+        if (quit) return;
+        seen = round;
+        if (n < firstActive) continue;
+        const double t0 = roundT0, T = roundT;
+        lock.unlock();
+        propagate(workers[n], workers[n].fine, fineSteps, U[n], t0 + n*T, T/fineSteps, F[n]);
+        lock.lock();
+        if (--pending == 0) done.notify_one();
+    }
+}
+
+template <int Dim, typename Scalar>
+void IntegratorPararealT<Dim, Scalar>::runFine(unsigned int first, double t0, double T) {
+    std::unique_lock<std::mutex> lock(mutex);
+    firstActive = first;
+    pending = workers.size() - first;
+    roundT0 = t0;
+    roundT = T;
+    round++;
+    wake.notify_all();
+    done.wait(lock, [&]() { return pending == 0; });
+}
+
+template <int Dim, typename Scalar>
+void IntegratorPararealT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
+    iterations = 0;
+    if (dt <= 0 || slices == 0) return;
+    if (workers.size() != slices) createSlices(slices);
+    U.resize(slices + 1);
+    G.resize(slices);
+    F.resize(slices);
+
+    const unsigned int K = slices;
+    const double t0 = system.getTime();
+    const double T = dt/K;
+
+    // initial guess from a serial coarse sweep
+    U[0] = system.getStateView();
+    for (unsigned int n = 0; n < K; n++) {
+        propagate(workers[n], workers[n].coarse, coarseSteps, U[n], t0 + n*T, T/coarseSteps, G[n]);
+        U[n+1] = G[n];
+    }
+
+    for (unsigned int k = 0; k < K; k++) {
+        // fine solves of the slices not yet exact, in parallel
+        parallelSteps++;
+        runFine(k, t0, T);
+        parallelSteps--;
+        iterations++;
+
+        // serial correction with the coarse solver
+        double change = 0;
+        for (unsigned int n = k; n < K; n++) {
+            Vecd g;
+            propagate(workers[n], workers[n].coarse, coarseSteps, U[n], t0 + n*T, T/coarseSteps, g);
+            Vecd u = g + F[n] - G[n];
+            change = std::max(change, double((u - U[n+1]).cwiseAbs().maxCoeff()/(1 + U[n+1].cwiseAbs().maxCoeff())));
+            U[n+1].swap(u);
+            G[n].swap(g);
+        }
+        if (change <= tolerance) break;
+    }
+
+    system.getStateView() = U[K];
+    system.setTime(t0 + dt);
+    system.markStateChanged();
+}
+
+template <int Dim, typename Scalar>
+void IntegratorMultiRateT<Dim, Scalar>::step(ParticleSystem &system, double dt) {
+    // the substeps end with the time they add up to, setting t0 + dt instead could
+    // differ in the last bit and make the forces look stale
+    const double h = dt/substeps;
+    for (unsigned int i = 0; i < substeps; i++) {
+        inner->step(system, h);
+    }
+}
+
+#define INSTANTIATE_INTEGRATORS(Dim, Scalar) \
+    template class IntegratorEulerT<Dim, Scalar>; \
+    template class IntegratorSymplecticEulerT<Dim, Scalar>; \
+    template class IntegratorMidpointT<Dim, Scalar>; \
+    template class IntegratorRK2T<Dim, Scalar>; \
+    template class IntegratorRK4T<Dim, Scalar>; \
+    template class IntegratorRK45T<Dim, Scalar>; \
+    template class IntegratorBulirschStoerT<Dim, Scalar>; \
+    template class IntegratorVerletT<Dim, Scalar>; \
+    template class IntegratorVelocityVerletT<Dim, Scalar>; \
+    template class IntegratorSplittingT<Dim, Scalar>; \
+    template class IntegratorYoshida4T<Dim, Scalar>; \
+    template class IntegratorYoshida6T<Dim, Scalar>; \
+    template class IntegratorPEFRLT<Dim, Scalar>; \
+    template class IntegratorBlockStepT<Dim, Scalar>; \
+    template class IntegratorPararealT<Dim, Scalar>; \
+    template class IntegratorMultiRateT<Dim, Scalar>; \
+    template class IntegratorBackwardEulerT<Dim, Scalar>; \
+    template class IntegratorIMEXT<Dim, Scalar>;
+
+INSTANTIATE_INTEGRATORS(1, double)
+INSTANTIATE_INTEGRATORS(2, double)
+INSTANTIATE_INTEGRATORS(3, double)
+INSTANTIATE_INTEGRATORS(1, float)
+INSTANTIATE_INTEGRATORS(2, float)
+INSTANTIATE_INTEGRATORS(3, float)
@@ -1,48 +1,433 @@
 #ifndef INTEGRATORS_H
 #define INTEGRATORS_H
 
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "particlesystem.h"
 
-class Integrator {
+// Integrators keep their intermediate vectors as members, sized on the first
+// step (or when the system size changes) and reused afterwards, so a step does
+// not allocate. Build with EIGEN_RUNTIME_NO_MALLOC to have Eigen assert it.
+// Like the systems they step, integrators are templated on dimension and scalar type.
+template <int Dim, typename Scalar = double>
+class IntegratorT {
 public:
-    Integrator() {};
-    virtual ~Integrator() {};
+    typedef ParticleSystemT<Dim, Scalar> ParticleSystem;
+    typedef typename ParticleSystem::Vecd Vecd;
+
+    IntegratorT() {};
+    virtual ~IntegratorT() {};
     virtual void step(ParticleSystem& system, double dt) = 0;
 };
 
 
-class IntegratorEuler : public Integrator {
+template <int Dim, typename Scalar = double>
+class IntegratorEulerT : public IntegratorT<Dim, Scalar> {
 public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
     virtual void step(ParticleSystem& system, double dt);
+protected:
+    Vecd dx;
 };
 
 
-class IntegratorSymplecticEuler : public Integrator {
+template <int Dim, typename Scalar = double>
+class IntegratorSymplecticEulerT : public IntegratorT<Dim, Scalar> {
 public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
     virtual void step(ParticleSystem& system, double dt);
 };
 
 
-class IntegratorMidpoint : public Integrator {
+template <int Dim, typename Scalar = double>
+class IntegratorMidpointT : public IntegratorT<Dim, Scalar> {
 public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
     virtual void step(ParticleSystem& system, double dt);
+protected:
+    Vecd x0, dx;
 };
 
-class IntegratorRK2 : public Integrator {
+template <int Dim, typename Scalar = double>
+class IntegratorRK2T : public IntegratorT<Dim, Scalar> {
 public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
     virtual void step(ParticleSystem& system, double dt);
+protected:
+    Vecd x0, k1, k2;
 };
 
-class IntegratorRK4 : public Integrator {
+template <int Dim, typename Scalar = double>
+class IntegratorRK4T : public IntegratorT<Dim, Scalar> {
 public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
     virtual void step(ParticleSystem& system, double dt);
+protected:
+    Vecd x0, k1, k2, k3, k4;
 };
 
-class IntegratorVerlet : public Integrator {
+template <int Dim, typename Scalar = double>
+class IntegratorVerletT : public IntegratorT<Dim, Scalar> {
 public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
     virtual void step(ParticleSystem& system, double dt);
     double kd = 1;
+protected:
+    Vecd pt, acc;
+};
+
+// Bulirsch-Stoer: modified midpoint solves of each substep with n = 2, 4, 6... inner
+// steps, Richardson-extrapolated to h -> 0. The extrapolation goes on until two columns
+// agree within the tolerances (absTol + relTol*|x| per component). The order used next
+// follows the column that converged, and the substep grows or shrinks with the error.
+// Worth it for high accuracy with smooth forces (reference runs), not for stiff springs.
+template <int Dim, typename Scalar = double>
+class IntegratorBulirschStoerT : public IntegratorT<Dim, Scalar> {
+public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
+    virtual void step(ParticleSystem& system, double dt);
+
+    void setTolerances(double absolute, double relative) { absTol = absolute; relTol = relative; }
+    void setMinSubstep(double h) { minSubstep = h; }
+
+    // statistics of the last call to step
+    unsigned int getAcceptedSubsteps() const { return accepted; }
+    unsigned int getRejectedSubsteps() const { return rejected; }
+    unsigned int getForceEvaluations() const { return evaluations; }
+
+protected:
+    static const unsigned int MaxColumns = 8;   // inner steps up to 2*MaxColumns
+
+    void evaluate(ParticleSystem& system, double t, Vecd& k);
+    void midpoint(ParticleSystem& system, double t, double H, unsigned int n, Vecd& result);
+
+    double absTol = 1e-8, relTol = 1e-8;
+    double minSubstep = 1e-6;
+    double hTry = 0;                // kept between calls, like the column below
+    unsigned int columns = 4;       // extrapolation columns tried before rejecting
+    unsigned int accepted = 0, rejected = 0, evaluations = 0;
+    Vecd x0, d0, zm, zc, f, cur, next;
+    Vecd table[MaxColumns];         // current row of the extrapolation table
+};
+
+// Velocity Verlet (kick-drift-kick leapfrog): second order and symplectic, with a
+// single force evaluation per step. The first half kick uses the forces the system
+// already holds from the end of the previous step, the second one the new forces.
+// Velocity dependent forces see the half kicked velocities, which keeps them first order.
+template <int Dim, typename Scalar = double>
+class IntegratorVelocityVerletT : public IntegratorT<Dim, Scalar> {
+public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
+    virtual void step(ParticleSystem& system, double dt);
+};
+
+// Symplectic splitting methods built from kicks (v += b*h*a) and drifts (x += a*h*v):
+//   kick(b0) drift(a0) kick(b1) drift(a1) ... drift(an-1) kick(bn)
+// Forces are evaluated after each drift, the first kick uses the ones already in the
+// system, so a step costs one force evaluation per drift coefficient.
+// Velocity Verlet is kicks {1/2, 1/2} and drifts {1}, the subclasses give higher orders.
+template <int Dim, typename Scalar = double>
+class IntegratorSplittingT : public IntegratorT<Dim, Scalar> {
+public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
+    // each set adds up to 1. With one more kick than drifts the step starts with a kick
+    // (velocity form), with one more drift than kicks it starts with a drift (position form)
+    IntegratorSplittingT(const std::vector<double>& kicks, const std::vector<double>& drifts)
+        : kicks(kicks), drifts(drifts) {}
+
+    virtual void step(ParticleSystem& system, double dt);
+
+protected:
+    IntegratorSplittingT() {}
+
+    // verlet steps with the given weights, one after the other (Yoshida's compositions)
+    void setComposition(const std::vector<double>& weights);
+
+    static void kick(ParticleSystem& system, Scalar h);
+    static void drift(ParticleSystem& system, Scalar h);
+
+    std::vector<double> kicks, drifts;
+};
+
+// 4th order, three verlet steps (Forest & Ruth 1990, Yoshida 1990). 3 evaluations.
+template <int Dim, typename Scalar = double>
+class IntegratorYoshida4T : public IntegratorSplittingT<Dim, Scalar> {
+public:
+    IntegratorYoshida4T();
+};
+
+// 6th order, seven verlet steps (Yoshida 1990, solution A). 7 evaluations.
+template <int Dim, typename Scalar = double>
+class IntegratorYoshida6T : public IntegratorSplittingT<Dim, Scalar> {
+public:
+    IntegratorYoshida6T();
+};
+
+// 4th order Forest-Ruth like method with its free parameters tuned for a small
+// error constant (Omelyan, Mryglod & Folk 2002), position form. 4 evaluations,
+// but typically much more accurate than Yoshida4 at the same cost.
+template <int Dim, typename Scalar = double>
+class IntegratorPEFRLT : public IntegratorSplittingT<Dim, Scalar> {
+public:
+    IntegratorPEFRLT();
 };
 
+// Block (hierarchical) time steps, Aarseth style: each particle steps with dt/2^k,
+// the level k chosen from eta*|a|/|j| when the particle starts a step. It is a kick-drift-kick
+// leapfrog per particle: every particle drifts each substep, which is cheap, but only
+// those ending their step get new forces (ParticleSystem::updateForces(indices)), so the
+// force cost follows the number of particles in the fast bins. The jerk comes from the
+// change of acceleration over the particle's last step, particles without one yet start
+// in the finest bin. Steps at most double at a time, and only to a step the current time
+// is aligned with. At the end of dt every particle is in sync and has its forces up to date.
+template <int Dim, typename Scalar = double>
+class IntegratorBlockStepT : public IntegratorT<Dim, Scalar> {
+public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
+    virtual void step(ParticleSystem& system, double dt);
+
+    void setAccuracy(double e) { eta = e; }
+    void setMaxLevel(unsigned int l) { maxLevel = l; }     // finest step is dt/2^maxLevel
+
+    // statistics of the last call to step, evaluations are per particle
+    // (a full updateForces counts as one per particle)
+    unsigned int getParticleEvaluations() const { return evaluations; }
+    unsigned int getDeepestLevel() const { return deepestLevel; }
+
+protected:
+    unsigned int chooseLevel(unsigned int i, double dt) const;
+
+    double eta = 0.02;
+    unsigned int maxLevel = 6;
+    unsigned int evaluations = 0, deepestLevel = 0;
+    Vecd acc, jerk;                         // Dim values per particle
+    std::vector<unsigned int> levels;
+    std::vector<unsigned char> hasJerk;
+    std::vector<unsigned int> active;
+};
+
+// Dormand-Prince 5(4): splits the given dt into as many substeps as the error
+// tolerances require, growing them again when the motion calms down.
+// The last stage is the derivative at the new state (FSAL), so an accepted substep
+// hands it over as the first stage of the next one: 6 force evaluations per substep.
+// Tolerances apply per state component, absTol + relTol*|x|.
+template <int Dim, typename Scalar = double>
+class IntegratorRK45T : public IntegratorT<Dim, Scalar> {
+public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
+    virtual void step(ParticleSystem& system, double dt);
+
+    void setTolerances(double absolute, double relative) { absTol = absolute; relTol = relative; }
+    void setMinSubstep(double h) { minSubstep = h; }
+
+    // statistics of the last call to step
+    unsigned int getAcceptedSubsteps() const { return accepted; }
+    unsigned int getRejectedSubsteps() const { return rejected; }
+    unsigned int getForceEvaluations() const { return evaluations; }
+
+protected:
+    void evaluate(ParticleSystem& system, double t, Vecd& k);
+
+    double absTol = 1e-4, relTol = 1e-4;
+    double minSubstep = 1e-6;
+    double hTry = 0;    // substep to start with, kept between calls
+    unsigned int accepted = 0, rejected = 0, evaluations = 0;
+    Vecd x0, k1, k2, k3, k4, k5, k6, k7;
+};
+
+// Backward Euler, linearized once per step (Baraff & Witkin 1998):
+//   (M - h df/dv - h^2 df/dx) dv = h (f + h df/dx v),  v += dv,  x += h v
+// solved with a Jacobi preconditioned conjugate gradient. The matrix is never built,
+// the forces apply their Jacobians to the CG vectors (see Force::addJacobianProduct).
+// Stable with stiff springs at steps the explicit integrators blow up with, at the price
+// of some numerical damping. Pinned particles are kept out of the solve.
+template <int Dim, typename Scalar = double>
+class IntegratorBackwardEulerT : public IntegratorT<Dim, Scalar> {
+public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+
+    virtual void step(ParticleSystem& system, double dt);
+
+    // CG stops when the residual is below tolerance relative to the right hand side
+    void setSolverTolerance(double tol) { tolerance = tol; }
+    void setMaxSolverIterations(unsigned int n) { maxIterations = n; }
+
+    // statistics of the last call to step
+    unsigned int getSolverIterations() const { return iterations; }
+
+protected:
+    typedef typename ParticleSystem::Force Force;
+
+    // forces whose Jacobians enter the linear system, all of them here
+    virtual bool isImplicit(const Force*) const { return true; }
+
+    // out = (M - h df/dv - h^2 df/dx) y
+    void multiply(ParticleSystem& system, Scalar h, const Vecd& y, Vecd& out) const;
+    // zeroes the pinned particles
+    void filter(Vecd& y) const;
+
+    double tolerance = 1e-4;
+    unsigned int maxIterations = 100;
+    unsigned int iterations = 0;
+    typename ParticleSystem::RowVector unpinned;    // 1 for free particles, 0 for pinned
+    Vecd dv, b, r, d, q, z, invDiag, v0;             // dv is kept as the next initial guess
+    std::vector<const Force*> implicitForces;
+};
+
+// Implicit-explicit Euler: only the stiff forces (see Force::setStiff) go through the
+// linear solve, the cheap ones (gravity, drag, SPH...) act with their value at the
+// start of the step. Without stiff forces the step is a plain symplectic Euler step.
+template <int Dim, typename Scalar = double>
+class IntegratorIMEXT : public IntegratorBackwardEulerT<Dim, Scalar> {
+protected:
+    typedef typename IntegratorBackwardEulerT<Dim, Scalar>::Force Force;
+
+    virtual bool isImplicit(const Force* f) const { return f->isStiff(); }
+};
+
+// Parareal (Lions, Maday & Turinici 2001): splits dt into slices and iterates
+//   U[n+1] = G(U[n]) + F(U_old[n]) - G(U_old[n])
+// where G is a cheap coarse solve of a slice and F the expensive fine one. The fine
+// solves of all slices are independent and run in parallel, one thread per slice
+// kept for the integrator's lifetime and woken for each iteration; the coarse sweep is serial. After k iterations the first k slices are exact, so it
+// never needs more than one iteration per slice, and stops earlier once the slice
+// states change less than the tolerance. Meant for long horizons of small systems,
+// step(system, dt) integrates the whole horizon dt.
+// Forces point to their particles, so systems can't be copied: each slice gets its own
+// system from makeSystem (same particles and forces, the state is overwritten) and its
+// own integrators from the factories. The integrator deletes them, forces and particles too.
+template <int Dim, typename Scalar = double>
+class IntegratorPararealT : public IntegratorT<Dim, Scalar> {
+public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef typename IntegratorT<Dim, Scalar>::Vecd Vecd;
+    typedef IntegratorT<Dim, Scalar> Integrator;
+    typedef std::function<ParticleSystem*()> SystemFactory;
+    typedef std::function<Integrator*()> IntegratorFactory;
+
+    IntegratorPararealT(const IntegratorFactory& coarse, const IntegratorFactory& fine,
+                        const SystemFactory& makeSystem)
+        : makeCoarse(coarse), makeFine(fine), makeSystem(makeSystem) {}
+    virtual ~IntegratorPararealT();
+    // owns the slices and their threads
+    IntegratorPararealT(const IntegratorPararealT&) = delete;
+    IntegratorPararealT& operator=(const IntegratorPararealT&) = delete;
+
+    virtual void step(ParticleSystem& system, double dt);
+
+    void setSlices(unsigned int n) { slices = n; }
+    void setSubsteps(unsigned int coarse, unsigned int fine) { coarseSteps = coarse; fineSteps = fine; }
+    void setTolerance(double tol) { tolerance = tol; }
+
+    // statistics of the last call to step
+    unsigned int getIterations() const { return iterations; }
+
+protected:
+    struct Slice {
+        ParticleSystem* system;
+        Integrator* coarse;
+        Integrator* fine;
+    };
+
+    void createSlices(unsigned int n);
+    void deleteSlices();
+    static void propagate(Slice& s, Integrator* integrator, unsigned int steps,
+                          const Vecd& x0, double t0, double h, Vecd& x1);
+    // thread of slice n: waits for a round, runs its fine solve if it takes part
+    void work(unsigned int n);
+    // fine solves of the slices from first on, returns once all are done
+    void runFine(unsigned int first, double t0, double T);
+
+    IntegratorFactory makeCoarse, makeFine;
+    SystemFactory makeSystem;
+    unsigned int slices = 4;
+    unsigned int coarseSteps = 1, fineSteps = 100;     // per slice
+    double tolerance = 1e-8;
+    unsigned int iterations = 0;
+    std::vector<Slice> workers;
+    std::vector<Vecd> U, G, F;      // slice start states, coarse and fine slice results
+
+    // worker threads and the round they are asked to run, under mutex
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    unsigned long round = 0;
+    unsigned int firstActive = 0, pending = 0;
+    double roundT0 = 0, roundT = 0;
+    bool quit = false;
+};
+
+// Multi-rate stepping: each step is split in substeps of the inner integrator, so the
+// fast forces are evaluated every substep. The slow ones are given the whole step as
+// update interval (Force::setUpdateInterval), so the system evaluates them once per step
+// and holds their contribution over the substeps. Owns the inner integrator.
+template <int Dim, typename Scalar = double>
+class IntegratorMultiRateT : public IntegratorT<Dim, Scalar> {
+public:
+    typedef typename IntegratorT<Dim, Scalar>::ParticleSystem ParticleSystem;
+    typedef IntegratorT<Dim, Scalar> Integrator;
+
+    IntegratorMultiRateT(Integrator* inner, unsigned int substeps) : inner(inner), substeps(std::max(1u, substeps)) {}
+    virtual ~IntegratorMultiRateT() { delete inner; }
+    IntegratorMultiRateT(const IntegratorMultiRateT&) = delete;
+    IntegratorMultiRateT& operator=(const IntegratorMultiRateT&) = delete;
+
+    virtual void step(ParticleSystem& system, double dt);
+
+    void setSubsteps(unsigned int n) { substeps = std::max(1u, n); }
+    unsigned int getSubsteps() const { return substeps; }
+
+protected:
+    Integrator* inner;
+    unsigned int substeps;
+};
+
+
+typedef IntegratorT<3, double>                  Integrator;
+typedef IntegratorEulerT<3, double>             IntegratorEuler;
+typedef IntegratorSymplecticEulerT<3, double>   IntegratorSymplecticEuler;
+typedef IntegratorMidpointT<3, double>          IntegratorMidpoint;
+typedef IntegratorRK2T<3, double>               IntegratorRK2;
+typedef IntegratorRK4T<3, double>               IntegratorRK4;
+typedef IntegratorRK45T<3, double>              IntegratorRK45;
+typedef IntegratorBulirschStoerT<3, double>     IntegratorBulirschStoer;
+typedef IntegratorVerletT<3, double>            IntegratorVerlet;
+typedef IntegratorVelocityVerletT<3, double>    IntegratorVelocityVerlet;
+typedef IntegratorSplittingT<3, double>         IntegratorSplitting;
+typedef IntegratorYoshida4T<3, double>          IntegratorYoshida4;
+typedef IntegratorYoshida6T<3, double>          IntegratorYoshida6;
+typedef IntegratorPEFRLT<3, double>             IntegratorPEFRL;
+typedef IntegratorBlockStepT<3, double>         IntegratorBlockStep;
+typedef IntegratorPararealT<3, double>          IntegratorParareal;
+typedef IntegratorMultiRateT<3, double>         IntegratorMultiRate;
+typedef IntegratorBackwardEulerT<3, double>     IntegratorBackwardEuler;
+typedef IntegratorIMEXT<3, double>              IntegratorIMEX;
+
 
 #endif // INTEGRATORS_H
@@ -1,58 +1,185 @@
 #ifndef PARTICLE_H
 #define PARTICLE_H
 
+#include <new>
 #include "defines.h"
 
 class Collision;
+template <int Dim, typename Scalar> class ParticleSystemT;
+template <class ParticleType> class ParticlePoolT;
 
-class Particle
+
+// Reference to one scalar of a particle, behaves like a Scalar&.
+// It can be re-pointed, which a real reference can't, so the particle
+// can follow its data when the system storage moves.
+template <typename Scalar>
+class ParticleScalarT
+{
+public:
+    explicit ParticleScalarT(Scalar* p) : ptr(p) {}
+
+    operator Scalar&() const { return *ptr; }
+
+    ParticleScalarT& operator= (const ParticleScalarT& s) { *ptr  = *s.ptr; return *this; }
+    ParticleScalarT& operator= (Scalar v) { *ptr  = v; return *this; }
+    ParticleScalarT& operator+=(Scalar v) { *ptr += v; return *this; }
+    ParticleScalarT& operator-=(Scalar v) { *ptr -= v; return *this; }
+    ParticleScalarT& operator*=(Scalar v) { *ptr *= v; return *this; }
+    ParticleScalarT& operator/=(Scalar v) { *ptr /= v; return *this; }
+
+protected:
+    template <int, typename> friend class ParticleT;
+    Scalar* ptr;
+};
+
+
+// Mass of a particle, behaves like a Scalar.
+// Assigning it also refreshes the inverse mass the integrators use,
+// except for pinned particles (inverse mass 0), which stay pinned.
+template <typename Scalar>
+class ParticleMassT
+{
+public:
+    ParticleMassT(Scalar* m, Scalar* im) : ptr(m), invPtr(im) {}
+
+    operator Scalar() const { return *ptr; }
+
+    ParticleMassT& operator= (const ParticleMassT& m) { return *this = Scalar(m); }
+    ParticleMassT& operator= (Scalar v) {
+        *ptr = v;
+        if (*invPtr != 0) *invPtr = Scalar(1)/v;
+        return *this;
+    }
+    ParticleMassT& operator+=(Scalar v) { return *this = *ptr + v; }
+    ParticleMassT& operator-=(Scalar v) { return *this = *ptr - v; }
+    ParticleMassT& operator*=(Scalar v) { return *this = *ptr * v; }
+    ParticleMassT& operator/=(Scalar v) { return *this = *ptr / v; }
+
+protected:
+    template <int, typename> friend class ParticleT;
+    Scalar* ptr;
+    Scalar* invPtr;
+};
+
+
+// Handle to the state of one particle.
+// Once added to a ParticleSystem the dynamic magnitudes (pos, vel, force,
+// prevPos, mass, invMass) live in the system arrays and these members are just views
+// over them. Before that (or after clearParticles) they use the particle's own storage.
+// Scene specific values (SPH density, fountain life...) are system attributes instead.
+// A particle with invMass 0 is pinned: forces don't move it, only the scene does.
+// Dim is the number of spatial dimensions, radius and color are for rendering and stay 3D.
+template <int Dim, typename Scalar = double>
+class ParticleT
 {
+protected:
+    Scalar data[4*Dim + 2];    // own storage when not in a system
+
 public:
+    typedef Eigen::Matrix<Scalar, Dim, 1> VecN;
 
-    static const int PhaseDimension = 6;
+    static const int Dimension = Dim;
+    static const int PhaseDimension = 2*Dim;
 
-    Vec3 pos, prevPos;
-    Vec3 vel;
-    Vec3 force;
-    double mass;
+    Eigen::Map<VecN> pos, prevPos;
+    Eigen::Map<VecN> vel;
+    Eigen::Map<VecN> force;
+    ParticleMassT<Scalar> mass;
+    ParticleScalarT<Scalar> invMass;
     double radius = 1.0;
-    double life   = 0.0;
     Vec3 color    = Vec3(1, 1, 1);
     unsigned int id = 0;
-    double pressure = 0.0;
-    double density = 0.0;
+    unsigned int group = 1;     // bitmask, see Force::setInfluenceGroup
 
-    Particle() {
-        pos	    = Vec3(0.0, 0.0, 0.0);
-        vel	    = Vec3(0.0, 0.0, 0.0);
-        force   = Vec3(0.0, 0.0, 0.0);
+    ParticleT()
+        : data(), pos(data), prevPos(data + Dim), vel(data + 2*Dim), force(data + 3*Dim),
+          mass(data + 4*Dim, data + 4*Dim + 1), invMass(data + 4*Dim + 1) {
+        pos	    = VecN::Zero();
+        vel	    = VecN::Zero();
+        force   = VecN::Zero();
         prevPos = pos;
-        mass    = 1.0;
+        invMass = 1;
+        mass    = 1;
     }
 
-    Particle(const Vec3& p, const Vec3& v, float m) {
+    ParticleT(const VecN& p, const VecN& v, float m)
+        : data(), pos(data), prevPos(data + Dim), vel(data + 2*Dim), force(data + 3*Dim),
+          mass(data + 4*Dim, data + 4*Dim + 1), invMass(data + 4*Dim + 1) {
         pos		= p;
         vel		= v;
-        force	= Vec3(0.0, 0.0, 0.0);
+        force	= VecN::Zero();
         prevPos = pos;
+        invMass = 1;
         mass	= m;
     }
 
-    Particle(const Particle& p) {
+    ParticleT(const ParticleT& p)
+        : data(), pos(data), prevPos(data + Dim), vel(data + 2*Dim), force(data + 3*Dim),
+          mass(data + 4*Dim, data + 4*Dim + 1), invMass(data + 4*Dim + 1) {
         id      = p.id;
+        group   = p.group;
         pos     = p.pos;
         vel     = p.vel;
         force   = p.force;
         prevPos = p.pos;
+        invMass = p.invMass;
+        mass    = p.mass;
+        color   = p.color;
+        radius  = p.radius;
+    }
+
+    // copies values, the particle keeps pointing to its own storage
+    ParticleT& operator=(const ParticleT& p) {
+        id      = p.id;
+        group   = p.group;
+        pos     = p.pos;
+        vel     = p.vel;
+        force   = p.force;
+        prevPos = p.prevPos;
+        invMass = p.invMass;
         mass    = p.mass;
         color   = p.color;
         radius  = p.radius;
-        life    = p.life;
+        return *this;
     }
 
-    ~Particle() {
+    bool isPinned() const { return invMass == 0; }
+
+    // pinning also stops the particle, unpinning gives it back its mass
+    void pin()   { invMass = 0; vel = VecN::Zero(); }
+    void unpin() { invMass = Scalar(1)/mass; }
+
+protected:
+    template <int, typename> friend class ParticleSystemT;
+    template <class> friend class ParticlePoolT;
+
+    unsigned int poolSlot = ~0u;    // slot in the owning pool, if any
+
+    // points the views to external storage
+    void bind(Scalar* ppos, Scalar* pvel, Scalar* pforce, Scalar* pprev, Scalar* pmass, Scalar* pinvmass) {
+        new (&pos)     Eigen::Map<VecN>(ppos);
+        new (&vel)     Eigen::Map<VecN>(pvel);
+        new (&force)   Eigen::Map<VecN>(pforce);
+        new (&prevPos) Eigen::Map<VecN>(pprev);
+        mass.ptr = pmass;
+        mass.invPtr = pinvmass;
+        invMass.ptr = pinvmass;
+    }
+
+    // copies current values back to own storage and points the views to it
+    void detach() {
+        VecN p = pos, v = vel, f = force, pp = prevPos;
+        Scalar m = mass, im = invMass;
+        bind(data, data + 2*Dim, data + 3*Dim, data + Dim, data + 4*Dim, data + 4*Dim + 1);
+        pos = p; vel = v; force = f; prevPos = pp; mass = m; invMass = im;
     }
 };
 
 
+// the scenes work in 3D with doubles unless they ask otherwise
+typedef ParticleScalarT<double> ParticleScalar;
+typedef ParticleMassT<double>   ParticleMass;
+typedef ParticleT<3, double>    Particle;
+
+
 #endif // PARTICLE_H
@@ -0,0 +1,98 @@
+#include "particlepool.h"
+#include <new>
+#include <type_traits>
+
+template <class ParticleType>
+ParticlePoolT<ParticleType>::~ParticlePoolT() {
+    static_assert(std::is_trivially_destructible<ParticleType>::value,
+                  "ParticlePool::clear relies on particles not needing destruction");
+    clear();
+    shrink();
+}
+
+template <class ParticleType>
+typename ParticlePoolT<ParticleType>::Particle* ParticlePoolT<ParticleType>::create() {
+    unsigned int i;
+    if (!freeSlots.empty()) {
+        i = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    else {
+        if (used == getCapacity()) {
+            blocks.push_back(static_cast<Particle*>(::operator new(BlockSize*sizeof(Particle))));
+            generations.resize(getCapacity(), 0);
+        }
+        i = used++;
+    }
+
+    Particle* p = new (slot(i)) Particle();
+    p->poolSlot = i;
+    return p;
+}
+
+template <class ParticleType>
+void ParticlePoolT<ParticleType>::release(Particle* p) {
+    if (!owns(p)) return;
+    unsigned int i = p->poolSlot;
+    p->~Particle();
+    p->poolSlot = ~0u;
+    generations[i]++;
+    freeSlots.push_back(i);
+}
+
+template <class ParticleType>
+void ParticlePoolT<ParticleType>::reserve(unsigned int n) {
+    // free slots are reused first, only the rest needs new blocks
+    unsigned int needed = used + (n > freeSlots.size() ? n - freeSlots.size() : 0);
+    while (getCapacity() < needed) {
+        blocks.push_back(static_cast<Particle*>(::operator new(BlockSize*sizeof(Particle))));
+    }
+    generations.resize(getCapacity(), 0);
+}
+
+template <class ParticleType>
+void ParticlePoolT<ParticleType>::clear() {
+    used = 0;
+    freeSlots.clear();
+    epoch++;
+}
+
+template <class ParticleType>
+void ParticlePoolT<ParticleType>::shrink() {
+    if (getNumParticles() > 0) return;
+    for (Particle* b : blocks) ::operator delete(b);
+    blocks.clear();
+    generations.clear();
+    freeSlots.clear();
+    used = 0;
+}
+
+template <class ParticleType>
+bool ParticlePoolT<ParticleType>::owns(const Particle* p) const {
+    return p && p->poolSlot < used && slot(p->poolSlot) == p;
+}
+
+template <class ParticleType>
+ParticleHandle ParticlePoolT<ParticleType>::getHandle(const Particle* p) const {
+    ParticleHandle h;
+    if (owns(p)) {
+        h.index = p->poolSlot;
+        h.generation = generations[h.index] + epoch;
+    }
+    return h;
+}
+
+template <class ParticleType>
+typename ParticlePoolT<ParticleType>::Particle* ParticlePoolT<ParticleType>::get(const ParticleHandle& h) const {
+    if (h.index >= used || generations[h.index] + epoch != h.generation) return nullptr;
+    return slot(h.index);
+}
+
+
+// the particle types the systems are instantiated for
+template class ParticlePoolT<ParticleT<1, double> >;
+template class ParticlePoolT<ParticleT<2, double> >;
+template class ParticlePoolT<ParticleT<3, double> >;
+template class ParticlePoolT<ParticleT<1, float> >;
+template class ParticlePoolT<ParticleT<2, float> >;
+template class ParticlePoolT<ParticleT<3, float> >;
@@ -0,0 +1,67 @@
+#ifndef PARTICLEPOOL_H
+#define PARTICLEPOOL_H
+
+#include <vector>
+#include "particle.h"
+
+
+// Reference to a pooled particle that can be kept around safely.
+// Once the particle is released (or the pool cleared) it resolves to nullptr,
+// even if its slot has been given to a new particle in the meantime.
+struct ParticleHandle
+{
+    unsigned int index = ~0u;
+    unsigned int generation = 0;
+
+    bool isNull() const { return index == ~0u; }
+};
+
+
+// Slab allocator for particles.
+// Particles are built in place inside fixed size blocks that are never moved,
+// so pointers to them stay valid, and released slots are recycled.
+// Clearing the pool does not visit the particles (they are trivially destructible)
+// nor the blocks, it only resets the counters and bumps the pool epoch.
+template <class ParticleType>
+class ParticlePoolT
+{
+public:
+    typedef ParticleType Particle;
+
+    static const unsigned int BlockSize = 1024;
+
+    ParticlePoolT() {}
+    // particles have a single owner, the system the pool belongs to
+    ParticlePoolT(const ParticlePoolT&) = delete;
+    ParticlePoolT& operator=(const ParticlePoolT&) = delete;
+    ~ParticlePoolT();
+
+    Particle* create();
+    void release(Particle* p);
+    void reserve(unsigned int n);   // allocates the blocks for n live particles
+    void clear();                   // releases all particles, keeps the blocks
+    void shrink();                  // frees the blocks, pool must be empty
+
+    bool owns(const Particle* p) const;
+    ParticleHandle getHandle(const Particle* p) const;
+    Particle* get(const ParticleHandle& h) const;
+
+    unsigned int getNumParticles() const { return used - freeSlots.size(); }
+    unsigned int getCapacity() const { return BlockSize*blocks.size(); }
+
+protected:
+    Particle* slot(unsigned int i) const { return blocks[i/BlockSize] + i%BlockSize; }
+
+    // A handle is valid while its generation matches generations[index] + epoch.
+    // Both terms only grow, so releasing the slot or clearing the pool invalidates it.
+    std::vector<Particle*>      blocks;
+    std::vector<unsigned int>   generations;
+    std::vector<unsigned int>   freeSlots;
+    unsigned int used  = 0;         // slots handed out since the last clear
+    unsigned int epoch = 0;
+};
+
+typedef ParticlePoolT<Particle> ParticlePool;
+
+
+#endif // PARTICLEPOOL_H
@@ -1,126 +1,375 @@
 #include "particlesystem.h"
+#include <algorithm>
+#include <cmath>
 
-Vecd ParticleSystem::getState() const {
-    Vecd state(this->getStateSize());
-    for (unsigned int i = 0; i < particles.size(); i++) {
-        state[Particle::PhaseDimension*i    ] = particles[i]->pos[0];
-        state[Particle::PhaseDimension*i + 1] = particles[i]->pos[1];
-        state[Particle::PhaseDimension*i + 2] = particles[i]->pos[2];
-        state[Particle::PhaseDimension*i + 3] = particles[i]->vel[0];
-        state[Particle::PhaseDimension*i + 4] = particles[i]->vel[1];
-        state[Particle::PhaseDimension*i + 5] = particles[i]->vel[2];
-    }
-    return state;
+template <int Dim, typename Scalar>
+typename ParticleSystemT<Dim, Scalar>::Vecd ParticleSystemT<Dim, Scalar>::getState() const {
+    return getStateView();
 }
 
-Vecd ParticleSystem::getDerivative() const {
-    Vecd deriv(this->getStateSize());
+template <int Dim, typename Scalar>
+typename ParticleSystemT<Dim, Scalar>::Vecd ParticleSystemT<Dim, Scalar>::getDerivative() const {
+    Vecd deriv;
+    getDerivative(deriv);
+    return deriv;
+}
+
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::getDerivative(Vecd& deriv) const {
+    deriv.resize(this->getStateSize());
     for (unsigned int i = 0; i < particles.size(); i++) {
-        deriv[Particle::PhaseDimension*i    ] = particles[i]->vel[0];
-        deriv[Particle::PhaseDimension*i + 1] = particles[i]->vel[1];
-        deriv[Particle::PhaseDimension*i + 2] = particles[i]->vel[2];
-        deriv[Particle::PhaseDimension*i + 3] = particles[i]->force[0]/particles[i]->mass;
-        deriv[Particle::PhaseDimension*i + 4] = particles[i]->force[1]/particles[i]->mass;
-        deriv[Particle::PhaseDimension*i + 5] = particles[i]->force[2]/particles[i]->mass;
+        for (int d = 0; d < Dim; d++) {
+            deriv[Particle::PhaseDimension*i + d      ] = phase[Particle::PhaseDimension*i + Dim + d];
+            deriv[Particle::PhaseDimension*i + Dim + d] = forceAccum[Dim*i + d]*invMasses[i];
+        }
     }
-    return deriv;
 }
 
-Vecd ParticleSystem::getSecondDerivative() const {
+template <int Dim, typename Scalar>
+typename ParticleSystemT<Dim, Scalar>::Vecd ParticleSystemT<Dim, Scalar>::getSecondDerivative() const {
     Vecd deriv(this->getStateSize());
     for (unsigned int i = 0; i < particles.size(); i++) {
-        deriv[Particle::PhaseDimension*i + 0] = particles[i]->force[0]/particles[i]->mass;
-        deriv[Particle::PhaseDimension*i + 1] = particles[i]->force[1]/particles[i]->mass;
-        deriv[Particle::PhaseDimension*i + 2] = particles[i]->force[2]/particles[i]->mass;
-        deriv[Particle::PhaseDimension*i + 3] = 0;
-        deriv[Particle::PhaseDimension*i + 4] = 0;
-        deriv[Particle::PhaseDimension*i + 5] = 0;
+        for (int d = 0; d < Dim; d++) {
+            deriv[Particle::PhaseDimension*i + d      ] = forceAccum[Dim*i + d]*invMasses[i];
+            deriv[Particle::PhaseDimension*i + Dim + d] = 0;
+        }
     }
     return deriv;
 }
 
-void ParticleSystem::setState(const Vecd& state) {
-    for (unsigned int i = 0; i < particles.size(); i++) {
-        particles[i]->pos[0]  = state[Particle::PhaseDimension*i    ];
-        particles[i]->pos[1]  = state[Particle::PhaseDimension*i + 1];
-        particles[i]->pos[2]  = state[Particle::PhaseDimension*i + 2];
-        particles[i]->vel[0]  = state[Particle::PhaseDimension*i + 3];
-        particles[i]->vel[1]  = state[Particle::PhaseDimension*i + 4];
-        particles[i]->vel[2]  = state[Particle::PhaseDimension*i + 5];
-    }
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::setState(const Vecd& state) {
+    getStateView() = state;
 }
 
-void ParticleSystem::updateForces() {
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::updateForces() {
+    // integrators write their stages through views taken once, which the version can't
+    // see, so an evaluation always starts a new one and the force caches are rebuilt
+    stateVersion++;
+    forcesVersion = stateVersion;
+
     // clear force accumulators
-    for (unsigned int i = 0; i < particles.size(); i++) {
-        particles[i]->force = Vec3(0.0, 0.0, 0.0);
+    std::fill(forceAccum.begin(), forceAccum.end(), Scalar(0));
+
+    // multi-rate forces that are due get evaluated alone to refresh their cache
+    bool multiRate = false;
+    for (Force* f : forces) {
+        if (f->updateInterval <= 0) continue;
+        multiRate = true;
+        // due after the interval, give or take the rounding of substep times
+        const double elapsed = std::abs(time - f->lastUpdate);
+        if (f->cache.size() == forceAccum.size() && elapsed < f->updateInterval*(1 - 1e-9)) continue;
+        f->apply();
+        f->cache.assign(forceAccum.begin(), forceAccum.end());
+        std::fill(forceAccum.begin(), forceAccum.end(), Scalar(0));
+        f->lastUpdate = time;
     }
+
     // apply forces
-    for (unsigned int i = 0; i < forces.size(); i++) {
-        forces[i]->apply();
+    for (Force* f : forces) {
+        if (f->updateInterval <= 0) f->apply();
+    }
+    if (!multiRate) return;
+    for (Force* f : forces) {
+        if (f->updateInterval <= 0) continue;
+        for (unsigned int i = 0; i < forceAccum.size(); i++) forceAccum[i] += f->cache[i];
     }
 }
 
-Vecd ParticleSystem::getPositions() const {
-    Vecd res(3*this->getNumParticles());
-    for (unsigned int i = 0; i < particles.size(); i++) {
-        res[3*i  ] = particles[i]->pos[0];
-        res[3*i+1] = particles[i]->pos[1];
-        res[3*i+2] = particles[i]->pos[2];
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::updateForces(const std::vector<unsigned int>& indices) {
+    stateVersion++;
+    for (unsigned int i : indices) {
+        std::fill_n(&forceAccum[Dim*i], Dim, Scalar(0));
+    }
+    for (Force* f : forces) {
+        if (f->updateInterval > 0 && f->cache.size() == forceAccum.size()) {
+            for (unsigned int i : indices) {
+                for (int d = 0; d < Dim; d++) forceAccum[Dim*i + d] += f->cache[Dim*i + d];
+            }
+        }
+        else {
+            f->applyTo(indices);
+        }
     }
+}
+
+template <int Dim, typename Scalar>
+typename ParticleSystemT<Dim, Scalar>::Vecd ParticleSystemT<Dim, Scalar>::getPositions() const {
+    Vecd res(Dim*this->getNumParticles());
+    Eigen::Map<MatrixNX>(res.data(), Dim, particles.size()) = getPositionsView();
     return res;
 }
 
-Vecd ParticleSystem::getVelocities() const {
-    Vecd res(3*this->getNumParticles());
-    for (unsigned int i = 0; i < particles.size(); i++) {
-        res[3*i  ] = particles[i]->vel[0];
-        res[3*i+1] = particles[i]->vel[1];
-        res[3*i+2] = particles[i]->vel[2];
-    }
+template <int Dim, typename Scalar>
+typename ParticleSystemT<Dim, Scalar>::Vecd ParticleSystemT<Dim, Scalar>::getVelocities() const {
+    Vecd res(Dim*this->getNumParticles());
+    Eigen::Map<MatrixNX>(res.data(), Dim, particles.size()) = getVelocitiesView();
     return res;
 }
 
-Vecd ParticleSystem::getAccelerations() const {
-    Vecd res(3*this->getNumParticles());
-    for (unsigned int i = 0; i < particles.size(); i++) {
-        res[3*i  ] = particles[i]->force[0]/particles[i]->mass;
-        res[3*i+1] = particles[i]->force[1]/particles[i]->mass;
-        res[3*i+2] = particles[i]->force[2]/particles[i]->mass;
-    }
+template <int Dim, typename Scalar>
+typename ParticleSystemT<Dim, Scalar>::Vecd ParticleSystemT<Dim, Scalar>::getAccelerations() const {
+    Vecd res;
+    getAccelerations(res);
     return res;
 }
 
-Vecd ParticleSystem::getPreviousPositions() const {
-    Vecd res(3*this->getNumParticles());
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::getAccelerations(Vecd& res) const {
+    res.resize(Dim*this->getNumParticles());
     for (unsigned int i = 0; i < particles.size(); i++) {
-        res[3*i  ] = particles[i]->prevPos[0];
-        res[3*i+1] = particles[i]->prevPos[1];
-        res[3*i+2] = particles[i]->prevPos[2];
+        for (int d = 0; d < Dim; d++) {
+            res[Dim*i + d] = forceAccum[Dim*i + d]*invMasses[i];
+        }
     }
-    return res;
 }
 
-void ParticleSystem::setPositions(const Vecd& pos) {
-    for (unsigned int i = 0; i < particles.size(); i++) {
-        particles[i]->pos[0] = pos[3*i    ];
-        particles[i]->pos[1] = pos[3*i + 1];
-        particles[i]->pos[2] = pos[3*i + 2];
+template <int Dim, typename Scalar>
+typename ParticleSystemT<Dim, Scalar>::Vecd ParticleSystemT<Dim, Scalar>::getPreviousPositions() const {
+    return Eigen::Map<const Vecd>(prevPositions.data(), prevPositions.size());
+}
+
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::setPositions(const Vecd& pos) {
+    getPositionsView() = Eigen::Map<const MatrixNX>(pos.data(), Dim, particles.size());
+}
+
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::setVelocities(const Vecd& vel) {
+    getVelocitiesView() = Eigen::Map<const MatrixNX>(vel.data(), Dim, particles.size());
+}
+
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::setPreviousPositions(const Vecd& ppos) {
+    Eigen::Map<Vecd>(prevPositions.data(), prevPositions.size()) = ppos;
+}
+
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::addParticle(Particle* p) {
+    // grow all the arrays at once so we only need to re-point the particles on reallocation
+    if (particles.size() == getParticleCapacity()) {
+        reserveParticles(std::max<unsigned int>(16, 2*particles.size()));
+    }
+
+    unsigned int i = particles.size();
+    const typename Particle::VecN pos = p->pos, vel = p->vel, force = p->force, prevPos = p->prevPos;
+    const Scalar mass = p->mass, invMass = p->invMass;
+
+    phase.insert(phase.end(), pos.data(), pos.data() + Dim);
+    phase.insert(phase.end(), vel.data(), vel.data() + Dim);
+    forceAccum.insert(forceAccum.end(), force.data(), force.data() + Dim);
+    prevPositions.insert(prevPositions.end(), prevPos.data(), prevPos.data() + Dim);
+    masses.push_back(mass);
+    invMasses.push_back(invMass);
+    for (Attribute& a : attributes) a.values.push_back(a.defaultValue);
+    particles.push_back(p);
+    if (!pool.owns(p)) numExternalParticles++;
+    stateVersion++;
+
+    p->bind(&phase[Particle::PhaseDimension*i], &phase[Particle::PhaseDimension*i + Dim],
+            &forceAccum[Dim*i], &prevPositions[Dim*i], &masses[i], &invMasses[i]);
+}
+
+template <int Dim, typename Scalar>
+typename ParticleSystemT<Dim, Scalar>::Particle* ParticleSystemT<Dim, Scalar>::createParticle() {
+    Particle* p = pool.create();
+    addParticle(p);
+    return p;
+}
+
+template <int Dim, typename Scalar>
+unsigned int ParticleSystemT<Dim, Scalar>::createParticles(unsigned int n) {
+    unsigned int first = particles.size();
+    stateVersion++;
+    // geometric growth, so adding a batch every frame doesn't move the arrays every time
+    if (first + n > getParticleCapacity()) {
+        reserveParticles(std::max(first + n, 2*getParticleCapacity()));
     }
+    pool.reserve(n);
+
+    // grow the arrays in one go with the values of a default Particle
+    phase.resize(Particle::PhaseDimension*(first + n), Scalar(0));
+    forceAccum.resize(Dim*(first + n), Scalar(0));
+    prevPositions.resize(Dim*(first + n), Scalar(0));
+    masses.resize(first + n, Scalar(1));
+    invMasses.resize(first + n, Scalar(1));
+    for (Attribute& a : attributes) a.values.resize(first + n, a.defaultValue);
+    for (unsigned int i = first; i < first + n; i++) {
+        Particle* p = pool.create();
+        particles.push_back(p);
+        p->bind(&phase[Particle::PhaseDimension*i], &phase[Particle::PhaseDimension*i + Dim],
+                &forceAccum[Dim*i], &prevPositions[Dim*i], &masses[i], &invMasses[i]);
+    }
+    return first;
 }
 
-void ParticleSystem::setVelocities(const Vecd& vel) {
-    for (unsigned int i = 0; i < particles.size(); i++) {
-        particles[i]->vel[0] = vel[3*i    ];
-        particles[i]->vel[1] = vel[3*i + 1];
-        particles[i]->vel[2] = vel[3*i + 2];
+template <int Dim, typename Scalar>
+unsigned int ParticleSystemT<Dim, Scalar>::compactParticles() {
+    if (killedParticles.empty()) return 0;
+    std::sort(killedParticles.begin(), killedParticles.end());
+    killedParticles.erase(std::unique(killedParticles.begin(), killedParticles.end()), killedParticles.end());
+    while (!killedParticles.empty() && killedParticles.back() >= particles.size()) {
+        killedParticles.pop_back();
+    }
+    if (killedParticles.empty()) return 0;
+
+    // single pass: everything before the first killed particle stays where it is,
+    // after it the live particles are copied down over the gaps
+    const unsigned int n = particles.size();
+    const unsigned int first = killedParticles[0];
+    unsigned int dst = first, k = 0;
+    std::vector<Particle*> dead;
+    dead.reserve(killedParticles.size());
+    for (unsigned int src = first; src < n; src++) {
+        if (k < killedParticles.size() && killedParticles[k] == src) {
+            Particle* p = particles[src];
+            dead.push_back(p);
+            if (pool.owns(p)) {
+                pool.release(p);
+            }
+            else {
+                delete p;
+                numExternalParticles--;
+            }
+            k++;
+            continue;
+        }
+        std::copy_n(&phase[Particle::PhaseDimension*src], Particle::PhaseDimension, &phase[Particle::PhaseDimension*dst]);
+        std::copy_n(&forceAccum[Dim*src], Dim, &forceAccum[Dim*dst]);
+        std::copy_n(&prevPositions[Dim*src], Dim, &prevPositions[Dim*dst]);
+        masses[dst] = masses[src];
+        invMasses[dst] = invMasses[src];
+        for (Attribute& a : attributes) a.values[dst] = a.values[src];
+        particles[dst] = particles[src];
+        dst++;
     }
+
+    phase.resize(Particle::PhaseDimension*dst);
+    forceAccum.resize(Dim*dst);
+    prevPositions.resize(Dim*dst);
+    masses.resize(dst);
+    invMasses.resize(dst);
+    for (Attribute& a : attributes) a.values.resize(dst);
+    particles.resize(dst);
+    rebindParticles(first);
+
+    // forces in list mode hold pointers, the freed ones must not stay there
+    std::sort(dead.begin(), dead.end());
+    for (Force* f : forces) {
+        if (f->mode != Force::InfluenceList || f->particles.empty()) continue;
+        f->particles.erase(std::remove_if(f->particles.begin(), f->particles.end(), [&](Particle* p) {
+            return std::binary_search(dead.begin(), dead.end(), p);
+        }), f->particles.end());
+    }
+    invalidateForceCaches();
+
+    killedParticles.clear();
+    return n - dst;
 }
 
-void ParticleSystem::setPreviousPositions(const Vecd& ppos) {
-    for (unsigned int i = 0; i < particles.size(); i++) {
-        particles[i]->prevPos[0] = ppos[3*i    ];
-        particles[i]->prevPos[1] = ppos[3*i + 1];
-        particles[i]->prevPos[2] = ppos[3*i + 2];
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::reserveParticles(unsigned int n) {
+    if (n <= getParticleCapacity()) return;
+    phase.reserve(Particle::PhaseDimension*n);
+    forceAccum.reserve(Dim*n);
+    prevPositions.reserve(Dim*n);
+    masses.reserve(n);
+    invMasses.reserve(n);
+    particles.reserve(n);
+    rebindParticles();
+}
+
+template <int Dim, typename Scalar>
+unsigned int ParticleSystemT<Dim, Scalar>::getParticleCapacity() const {
+    // all arrays are reserved together, but the vector might round capacities up
+    size_t cap = std::min(std::min(masses.capacity(), invMasses.capacity()), particles.capacity());
+    cap = std::min(cap, phase.capacity()/Particle::PhaseDimension);
+    cap = std::min(cap, std::min(forceAccum.capacity(), prevPositions.capacity())/Dim);
+    return cap;
+}
+
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::rebindParticles(unsigned int first) {
+    for (unsigned int i = first; i < particles.size(); i++) {
+        particles[i]->bind(&phase[Particle::PhaseDimension*i], &phase[Particle::PhaseDimension*i + Dim],
+                           &forceAccum[Dim*i], &prevPositions[Dim*i], &masses[i], &invMasses[i]);
+    }
+}
+
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::invalidateForceCaches() {
+    for (Force* f : forces) f->invalidateCache();
+    stateVersion++;
+}
+
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::clearParticles() {
+    // external particles stay alive, so hand them back their values
+    if (numExternalParticles > 0) {
+        for (Particle* p : particles) {
+            if (!pool.owns(p)) p->detach();
+        }
+    }
+    pool.clear();
+    particles.clear();
+    numExternalParticles = 0;
+    killedParticles.clear();
+    phase.clear();
+    forceAccum.clear();
+    prevPositions.clear();
+    masses.clear();
+    invMasses.clear();
+    for (Attribute& a : attributes) a.values.clear();
+    invalidateForceCaches();
+}
+
+template <int Dim, typename Scalar>
+void ParticleSystemT<Dim, Scalar>::deleteParticles() {
+    // pooled particles go away all at once, only the external ones need visiting
+    if (numExternalParticles > 0) {
+        for (typename std::vector<Particle*>::iterator it = particles.begin(); it != particles.end(); it++)
+            if (!pool.owns(*it)) delete (*it);
     }
+    pool.clear();
+    particles.clear();
+    numExternalParticles = 0;
+    killedParticles.clear();
+    phase.clear();
+    forceAccum.clear();
+    prevPositions.clear();
+    masses.clear();
+    invMasses.clear();
+    for (Attribute& a : attributes) a.values.clear();
+    invalidateForceCaches();
 }
+
+template <int Dim, typename Scalar>
+int ParticleSystemT<Dim, Scalar>::addAttribute(const std::string& name, Scalar defaultValue) {
+    int id = getAttributeId(name);
+    if (id >= 0) return id;
+
+    Attribute a;
+    a.name = name;
+    a.defaultValue = defaultValue;
+    a.values.assign(particles.size(), defaultValue);
+    attributes.push_back(a);
+    return attributes.size() - 1;
+}
+
+template <int Dim, typename Scalar>
+int ParticleSystemT<Dim, Scalar>::getAttributeId(const std::string& name) const {
+    for (unsigned int i = 0; i < attributes.size(); i++) {
+        if (attributes[i].name == name) return i;
+    }
+    return -1;
+}
+
+
+template class ParticleSystemT<1, double>;
+template class ParticleSystemT<2, double>;
+template class ParticleSystemT<3, double>;
+template class ParticleSystemT<1, float>;
+template class ParticleSystemT<2, float>;
+template class ParticleSystemT<3, float>;
@@ -2,15 +2,47 @@
 #define PARTICLESYSTEM_H
 
 #include <vector>
+#include <string>
+#include <type_traits>
+#include <functional>
 #include "defines.h"
 #include "particle.h"
+#include "particlepool.h"
 #include "forces.h"
 
-class ParticleSystem
+// Particle system in Dim spatial dimensions with Scalar values.
+// The scenes use the 3D double ParticleSystem, the 1D and 2D ones are
+// there for the scenes that don't need the extra coordinates, and the
+// float ones for those that don't need the precision (see Real in defines.h).
+template <int Dim, typename Scalar = double>
+class ParticleSystemT
 {
 public:
-    ParticleSystem() {}
-    virtual ~ParticleSystem() {}
+    typedef ParticleT<Dim, Scalar>      Particle;
+    typedef ForceT<Dim, Scalar>         Force;
+    typedef ParticlePoolT<Particle>     ParticlePool;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vecd;
+    typedef Eigen::Matrix<Scalar, Dim, Eigen::Dynamic> MatrixNX;
+    typedef Eigen::Matrix<Scalar, 1, Eigen::Dynamic> RowVector;
+    typedef typename Math::Accumulator<Scalar>::type Accumulator;   // for sums over particles
+
+    static const int Dimension = Dim;
+
+    // views over the system storage, no copies involved.
+    // A 1xN matrix is row major in Eigen, so in 1D the step between particles is the inner stride.
+    typedef typename std::conditional<Dim == 1, Eigen::InnerStride<>, Eigen::OuterStride<> >::type VectorStride;
+    typedef Eigen::Map<Vecd> StateView;
+    typedef Eigen::Map<const Vecd> ConstStateView;
+    typedef Eigen::Map<MatrixNX, 0, VectorStride> VectorView;
+    typedef Eigen::Map<const MatrixNX, 0, VectorStride> ConstVectorView;
+    typedef Eigen::Map<RowVector> ScalarView;
+    typedef Eigen::Map<const RowVector> ConstScalarView;
+
+    ParticleSystemT() {}
+    virtual ~ParticleSystemT() {}
+    // the particles are views into this system's arrays and pool, they can't be shared
+    ParticleSystemT(const ParticleSystemT&) = delete;
+    ParticleSystemT& operator=(const ParticleSystemT&) = delete;
 
     // phase space
     virtual int  getStateSize()	        const;
@@ -21,8 +53,37 @@ public:
     // sets phase space values (pos-vel)
     virtual void setState(const Vecd& state);
 
-    // clear and recompute force accumulators per particle
+    // in place access to phase space, same layout as getState
+    StateView getStateView();
+    ConstStateView getStateView() const;
+    void getDerivative(Vecd& deriv) const;      // fills deriv, reusing its memory
+    void getAccelerations(Vecd& acc) const;
+
+    // DimxN views of the per particle magnitudes
+    VectorView getPositionsView();
+    VectorView getVelocitiesView();
+    VectorView getForcesView();
+    VectorView getPreviousPositionsView();
+    ConstVectorView getPositionsView() const;
+    ConstVectorView getVelocitiesView() const;
+    ConstVectorView getForcesView() const;
+    ConstScalarView getMassesView() const;
+    ConstScalarView getInverseMassesView() const;   // 0 for pinned particles
+
+    // clear and recompute force accumulators per particle. Always starts a new state
+    // version, so the forces never reuse what they cached for an older state.
     virtual void updateForces();
+    // Lazy version: recomputes them only if the state changed since the last updateForces.
+    // The system API that can change the state (non-const views, setters, adding or removing
+    // particles or forces, force parameters, time) bumps a version number. Writes through
+    // Particle handles or through a view taken before the last updateForces are not seen,
+    // call markStateChanged after them (or updateForces directly).
+    void ensureForces();
+    void markStateChanged();
+    unsigned long getStateVersion() const;
+    // same for the given particles only (sorted indices), for integrators that step
+    // particles at different rates. The accumulators of the rest are left undefined.
+    void updateForces(const std::vector<unsigned int>& indices);
 
     // individual physical magnitudes getters and setters
     virtual Vecd getPositions()         const;
@@ -39,10 +100,36 @@ public:
     const Particle* getParticle(unsigned int i) const;
     Particle* getParticle(unsigned int i);
     const std::vector<Particle*>& getParticles() const;
-    std::vector<Particle*>& getParticles();
-    void clearParticles();  // clears vector but does not delete items
+    int getParticleIndex(const Particle* p) const;  // -1 if p is not in this system
+    void reserveParticles(unsigned int n);
+    unsigned int getParticleCapacity() const;   // particles that fit without moving the arrays
+    // clears vector: particles added with addParticle are handed back to the caller, who
+    // owns them, with their values. Those made with createParticle go back to the pool.
+    void clearParticles();
     void deleteParticles(); // deletes items and clears vector
 
+    // particles allocated from the system pool, already added to the system
+    Particle* createParticle();
+    unsigned int createParticles(unsigned int n);   // returns the index of the first one
+
+    // Killed particles stay in place (and keep being simulated) until compactParticles
+    // moves the live ones to the front, preserving their order, and frees the rest.
+    // Indices change on compaction, pointers to the live particles don't. The freed
+    // particles are also removed from the forces that list their particles.
+    void killParticle(unsigned int i);
+    void killParticles(const std::vector<unsigned int>& indices);
+    unsigned int compactParticles();    // returns the number of particles removed
+    unsigned int getNumKilledParticles() const;
+    ParticleHandle getHandle(const Particle* p) const;
+    Particle* getParticle(const ParticleHandle& h) const;
+
+    // optional per particle attributes (density, life...), one value per particle in
+    // the same order as the particles. Registering an existing name returns its id.
+    int addAttribute(const std::string& name, Scalar defaultValue = 0);
+    int getAttributeId(const std::string& name) const;     // -1 if not registered
+    ScalarView getAttributeView(int id);
+    ConstScalarView getAttributeView(int id) const;
+
     // forces
     void addForce(Force* f);
     unsigned int getNumForces() const;
@@ -57,87 +144,241 @@ public:
     const double* getTimePointer() const;
 
 protected:
+    void rebindParticles(unsigned int first = 0);
+    void invalidateForceCaches();   // particle indices changed
+
+protected:
+    // particle data is stored as structure of arrays, Dim values per particle
+    // for vectors and 1 for scalars. The Particle objects are views over these.
+    // Positions and velocities share the phase array, interleaved per particle
+    // exactly as in the state vector, so integrators can work on it directly.
+    std::vector<Scalar>     phase;
+    std::vector<Scalar>     forceAccum;
+    std::vector<Scalar>     prevPositions;
+    std::vector<Scalar>     masses;
+    std::vector<Scalar>     invMasses;  // what the integrators use, 0 means pinned
+
     std::vector<Particle*>	particles;
     std::vector<Force*>		forces;
+
+    // attributes only some scenes need live apart from the arrays above,
+    // so the integration and force loops don't drag them through the cache
+    struct Attribute {
+        std::string name;
+        Scalar defaultValue;
+        std::vector<Scalar> values;
+    };
+    std::vector<Attribute>  attributes;
+
+    // storage for the particles made with createParticle, the rest are
+    // allocated by the caller and deleted one by one in deleteParticles
+    ParticlePool            pool;
+    unsigned int            numExternalParticles = 0;
+    std::vector<unsigned int> killedParticles;  // waiting for compactParticles
     double time = 0;
+
+    unsigned long stateVersion = 1;
+    unsigned long forcesVersion = 0;    // state version the forces were computed for
 };
 
 
-inline int ParticleSystem::getStateSize() const {
+template <int Dim, typename Scalar>
+inline int ParticleSystemT<Dim, Scalar>::getStateSize() const {
     return Particle::PhaseDimension * particles.size();
 }
 
-inline unsigned int ParticleSystem::getNumParticles() const {
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::StateView ParticleSystemT<Dim, Scalar>::getStateView() {
+    stateVersion++;
+    return StateView(phase.data(), phase.size());
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::ConstStateView ParticleSystemT<Dim, Scalar>::getStateView() const {
+    return ConstStateView(phase.data(), phase.size());
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::VectorView ParticleSystemT<Dim, Scalar>::getPositionsView() {
+    stateVersion++;
+    return VectorView(phase.data(), Dim, particles.size(), VectorStride(Particle::PhaseDimension));
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::VectorView ParticleSystemT<Dim, Scalar>::getVelocitiesView() {
+    stateVersion++;
+    return VectorView(phase.data() + Dim, Dim, particles.size(), VectorStride(Particle::PhaseDimension));
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::VectorView ParticleSystemT<Dim, Scalar>::getForcesView() {
+    return VectorView(forceAccum.data(), Dim, particles.size(), VectorStride(Dim));
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::VectorView ParticleSystemT<Dim, Scalar>::getPreviousPositionsView() {
+    return VectorView(prevPositions.data(), Dim, particles.size(), VectorStride(Dim));
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::ConstVectorView ParticleSystemT<Dim, Scalar>::getPositionsView() const {
+    return ConstVectorView(phase.data(), Dim, particles.size(), VectorStride(Particle::PhaseDimension));
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::ConstVectorView ParticleSystemT<Dim, Scalar>::getVelocitiesView() const {
+    return ConstVectorView(phase.data() + Dim, Dim, particles.size(), VectorStride(Particle::PhaseDimension));
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::ConstVectorView ParticleSystemT<Dim, Scalar>::getForcesView() const {
+    return ConstVectorView(forceAccum.data(), Dim, particles.size(), VectorStride(Dim));
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::ConstScalarView ParticleSystemT<Dim, Scalar>::getMassesView() const {
+    return ConstScalarView(masses.data(), masses.size());
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::ConstScalarView ParticleSystemT<Dim, Scalar>::getInverseMassesView() const {
+    return ConstScalarView(invMasses.data(), invMasses.size());
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::ScalarView ParticleSystemT<Dim, Scalar>::getAttributeView(int id) {
+    return ScalarView(attributes[id].values.data(), attributes[id].values.size());
+}
+
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::ConstScalarView ParticleSystemT<Dim, Scalar>::getAttributeView(int id) const {
+    return ConstScalarView(attributes[id].values.data(), attributes[id].values.size());
+}
+
+template <int Dim, typename Scalar>
+inline unsigned int ParticleSystemT<Dim, Scalar>::getNumParticles() const {
     return particles.size();
 }
 
-inline unsigned int ParticleSystem::getNumForces() const {
+template <int Dim, typename Scalar>
+inline unsigned int ParticleSystemT<Dim, Scalar>::getNumForces() const {
     return forces.size();
 }
 
-inline const Particle* ParticleSystem::getParticle(unsigned int i) const {
+template <int Dim, typename Scalar>
+inline const typename ParticleSystemT<Dim, Scalar>::Particle* ParticleSystemT<Dim, Scalar>::getParticle(unsigned int i) const {
     return particles[i];
 }
 
-inline Particle* ParticleSystem::getParticle(unsigned int i) {
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::Particle* ParticleSystemT<Dim, Scalar>::getParticle(unsigned int i) {
     return particles[i];
 }
 
-inline const std::vector<Particle*>& ParticleSystem::getParticles() const {
-    return particles;
+template <int Dim, typename Scalar>
+inline void ParticleSystemT<Dim, Scalar>::killParticle(unsigned int i) {
+    killedParticles.push_back(i);
 }
 
-inline std::vector<Particle*>& ParticleSystem::getParticles() {
-    return particles;
+template <int Dim, typename Scalar>
+inline void ParticleSystemT<Dim, Scalar>::killParticles(const std::vector<unsigned int>& indices) {
+    killedParticles.insert(killedParticles.end(), indices.begin(), indices.end());
 }
 
-inline const Force* ParticleSystem::getForce(unsigned int i) const {
-    return forces[i];
+template <int Dim, typename Scalar>
+inline unsigned int ParticleSystemT<Dim, Scalar>::getNumKilledParticles() const {
+    return killedParticles.size();
 }
 
-inline Force* ParticleSystem::getForce(unsigned int i) {
-    return forces[i];
+template <int Dim, typename Scalar>
+inline ParticleHandle ParticleSystemT<Dim, Scalar>::getHandle(const Particle* p) const {
+    return pool.getHandle(p);
 }
 
-inline void ParticleSystem::addParticle(Particle *p) {
-    particles.push_back(p);
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::Particle* ParticleSystemT<Dim, Scalar>::getParticle(const ParticleHandle& h) const {
+    return pool.get(h);
 }
 
-inline void ParticleSystem::addForce(Force *f) {
-    forces.push_back(f);
+template <int Dim, typename Scalar>
+inline const std::vector<typename ParticleSystemT<Dim, Scalar>::Particle*>& ParticleSystemT<Dim, Scalar>::getParticles() const {
+    return particles;
 }
 
-inline void ParticleSystem::clearParticles() {
-    particles.clear();
+template <int Dim, typename Scalar>
+inline int ParticleSystemT<Dim, Scalar>::getParticleIndex(const Particle* p) const {
+    // the particle views point into the phase array, so its offset gives the index
+    const Scalar* q = p->pos.data();
+    std::less<const Scalar*> before;
+    if (before(q, phase.data()) || !before(q, phase.data() + phase.size())) return -1;
+    const unsigned int i = (q - phase.data())/Particle::PhaseDimension;
+    return particles[i] == p ? int(i) : -1;
 }
 
-inline void ParticleSystem::clearForces() {
-    forces.clear();
+template <int Dim, typename Scalar>
+inline const typename ParticleSystemT<Dim, Scalar>::Force* ParticleSystemT<Dim, Scalar>::getForce(unsigned int i) const {
+    return forces[i];
 }
 
-inline void ParticleSystem::deleteParticles() {
-    for (std::vector<Particle*>::iterator it = particles.begin(); it != particles.end(); it++)
-        delete (*it);
-    particles.clear();
+template <int Dim, typename Scalar>
+inline typename ParticleSystemT<Dim, Scalar>::Force* ParticleSystemT<Dim, Scalar>::getForce(unsigned int i) {
+    return forces[i];
+}
+
+template <int Dim, typename Scalar>
+inline void ParticleSystemT<Dim, Scalar>::addForce(Force *f) {
+    f->setSystem(this);
+    forces.push_back(f);
+    stateVersion++;
+}
+
+template <int Dim, typename Scalar>
+inline void ParticleSystemT<Dim, Scalar>::clearForces() {
+    forces.clear();
+    stateVersion++;
 }
 
-inline void ParticleSystem::deleteForces() {
-    for (std::vector<Force*>::iterator it = forces.begin(); it != forces.end(); it++)
+template <int Dim, typename Scalar>
+inline void ParticleSystemT<Dim, Scalar>::deleteForces() {
+    for (typename std::vector<Force*>::iterator it = forces.begin(); it != forces.end(); it++)
         delete (*it);
     forces.clear();
+    stateVersion++;
 }
 
-inline double ParticleSystem::getTime() const {
+template <int Dim, typename Scalar>
+inline double ParticleSystemT<Dim, Scalar>::getTime() const {
     return time;
 }
 
-inline void ParticleSystem::setTime(double t) {
+template <int Dim, typename Scalar>
+inline void ParticleSystemT<Dim, Scalar>::setTime(double t) {
+    if (t != time) stateVersion++;
     time = t;
 }
 
-inline const double* ParticleSystem::getTimePointer() const {
+template <int Dim, typename Scalar>
+inline void ParticleSystemT<Dim, Scalar>::ensureForces() {
+    if (forcesVersion != stateVersion) updateForces();
+}
+
+template <int Dim, typename Scalar>
+inline void ParticleSystemT<Dim, Scalar>::markStateChanged() {
+    stateVersion++;
+}
+
+template <int Dim, typename Scalar>
+inline unsigned long ParticleSystemT<Dim, Scalar>::getStateVersion() const {
+    return stateVersion;
+}
+
+template <int Dim, typename Scalar>
+inline const double* ParticleSystemT<Dim, Scalar>::getTimePointer() const {
     return &time;
 }
 
 
+typedef ParticleSystemT<3, double> ParticleSystem;
+
+
 #endif // PARTICLESYSTEM_H
@@ -26,6 +26,10 @@ public:
     virtual void getSceneBounds(Vec3& bmin, Vec3& bmax) = 0;
     virtual unsigned int getNumParticles() { return 0; }
 
+    // substeps taken by an adaptive integrator during the last update, for the overlay.
+    // Scenes with fixed steps return false.
+    virtual bool getSubstepStats(unsigned int& /*accepted*/, unsigned int& /*rejected*/) { return false; }
+
     virtual QWidget* sceneUI() = 0;
 
     void clearBuffers() {
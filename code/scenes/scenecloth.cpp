@@ -3,12 +3,14 @@
 #include "model.h"
 #include <QOpenGLFunctions_3_3_Core>
 #include <QOpenGLBuffer>
+#include <thread>
 
 
 SceneCloth::SceneCloth() {
     widget = new WidgetCloth();
     connect(widget, SIGNAL(updatedParameters()), this, SLOT(updateSimParams()));
     connect(widget, SIGNAL(freeAnchors()), this, SLOT(freeAnchors()));
+    springs.setThreads(std::thread::hardware_concurrency());
 }
 
 SceneCloth::~SceneCloth() {
@@ -23,9 +25,6 @@ SceneCloth::~SceneCloth() {
 
     system.deleteParticles();
     if (fGravity)  delete fGravity;
-    for (ForceSpring* f : springsStretch) delete f;
-    for (ForceSpring* f : springsShear) delete f;
-    for (ForceSpring* f : springsBend) delete f;
 }
 
 void SceneCloth::initialize() {
@@ -70,7 +69,7 @@ void SceneCloth::initialize() {
     vaoMesh->release();
 
     // create gravity force
-    fGravity = new ForceConstAcceleration();
+    fGravity = new ForceConstAccelerationT<3, Real>();
     system.addForce(fGravity);
 
     // TODO: in my solution setup, these were the colliders
@@ -90,14 +89,7 @@ void SceneCloth::reset()
 
     // reset forces
     system.clearForces();
-    fGravity->clearInfluencedParticles();
-    for (ForceSpring* f : springsStretch) delete f;
-    springsStretch.clear();
-    for (ForceSpring* f : springsShear) delete f;
-    springsShear.clear();
-    for (ForceSpring* f : springsBend) delete f;
-    springsBend.clear();
-    springs.clear();
+    fGravity->setInfluenceAll();
 
     // cloth props
     Vec2 dims = widget->getDimensions();
@@ -112,7 +104,7 @@ void SceneCloth::reset()
 
     // create particles
     numParticles = numParticlesX * numParticlesY;
-    fixedParticle = std::vector<bool>(numParticles, false);
+    system.createParticles(numParticles);
 
     for (int i = 0; i < numParticlesX; i++) {
         for (int j = 0; j < numParticlesY; j++) {
@@ -120,88 +112,81 @@ void SceneCloth::reset()
             int idx = i*numParticlesY + j;
             double tx;
             double ty;
-            Vec3 pos;
+            Vec3r pos;
             Particle* p;
+            bool fixed;
 
             switch (widget->getFixed()) { //this is the worst switch i've ever written it's very funny
                 case 0:
-                    if(i==0){fixedParticle[idx] = true;}
-                    else {fixedParticle[idx] = false;}
+                    if(i==0){fixed = true;}
+                    else {fixed = false;}
 
                     tx = i*edgeX - 0.5*clothWidth;
                     ty = j*edgeY - 0.5*clothHeight;
-                    pos = Vec3(ty+edgeY, 70 - tx - edgeX, 0);
+                    pos = Vec3r(ty+edgeY, 70 - tx - edgeX, 0);
 
-                    p = new Particle();
+                    p = system.getParticle(idx);
                     p->id = idx;
                     p->pos = pos;
                     p->prevPos = pos;
-                    p->vel = Vec3(0,0,0);
+                    p->vel = Vec3r(0,0,0);
                     p->mass = 1;
+                    if (fixed) p->pin();
                     p->radius = particleRadius;
                     p->color = Vec3(235/255.0, 51/255.0, 36/255.0);
-
-                    system.addParticle(p);
-                    fGravity->addInfluencedParticle(p);
                     break;
                 case 1:
-                    if(i==0 && (j<3 || j>numParticlesY-4)){fixedParticle[idx] = true;}
-                    else {fixedParticle[idx] = false;}
+                    if(i==0 && (j<3 || j>numParticlesY-4)){fixed = true;}
+                    else {fixed = false;}
 
                     tx = i*edgeX - 0.5*clothWidth;
                     ty = j*edgeY - 0.5*clothHeight;
-                    pos = Vec3(ty+edgeY, 70 - tx - edgeX, 0);
+                    pos = Vec3r(ty+edgeY, 70 - tx - edgeX, 0);
 
-                    p = new Particle();
+                    p = system.getParticle(idx);
                     p->id = idx;
                     p->pos = pos;
                     p->prevPos = pos;
-                    p->vel = Vec3(0,0,0);
+                    p->vel = Vec3r(0,0,0);
                     p->mass = 1;
+                    if (fixed) p->pin();
                     p->radius = particleRadius;
                     p->color = Vec3(235/255.0, 51/255.0, 36/255.0);
-
-                    system.addParticle(p);
-                    fGravity->addInfluencedParticle(p);
                     break;
                 case 2:
-                    if((i==0 || i==numParticlesX-1) && (j<3 || j>numParticlesY-4)){fixedParticle[idx] = true;}
-                    else {fixedParticle[idx] = false;}
+                    if((i==0 || i==numParticlesX-1) && (j<3 || j>numParticlesY-4)){fixed = true;}
+                    else {fixed = false;}
 
                     tx = i*edgeX - 0.5*clothWidth;
                     ty = j*edgeY - 0.5*clothHeight;
-                    pos = Vec3(ty+edgeY, 70 - tx - edgeX, 0);
+                    pos = Vec3r(ty+edgeY, 70 - tx - edgeX, 0);
 
-                    p = new Particle();
+                    p = system.getParticle(idx);
                     p->id = idx;
                     p->pos = pos;
                     p->prevPos = pos;
-                    p->vel = Vec3(0,0,0);
+                    p->vel = Vec3r(0,0,0);
                     p->mass = 1;
+                    if (fixed) p->pin();
                     p->radius = particleRadius;
                     p->color = Vec3(235/255.0, 51/255.0, 36/255.0);
-
-                    system.addParticle(p);
-                    fGravity->addInfluencedParticle(p);
                     break;
                 default:
-                    fixedParticle[idx] = false;
+                    fixed = false;
 
                     tx = i*edgeX - 0.5*clothWidth;
                     ty = j*edgeY - 0.5*clothHeight;
-                    pos = Vec3(ty+edgeY, 70 - tx - edgeX, 0);
+                    pos = Vec3r(ty+edgeY, 70 - tx - edgeX, 0);
 
-                    p = new Particle();
+                    p = system.getParticle(idx);
                     p->id = idx;
                     p->pos = pos;
                     p->prevPos = pos;
-                    p->vel = Vec3(0,0,0);
+                    p->vel = Vec3r(0,0,0);
                     p->mass = 1;
+                    if (fixed) p->pin();
                     p->radius = particleRadius;
                     p->color = Vec3(235/255.0, 51/255.0, 36/255.0);
-
-                    system.addParticle(p);
-                    fGravity->addInfluencedParticle(p);
                     break;
             }
         }
@@ -213,77 +198,15 @@ void SceneCloth::reset()
     double ks = widget->getStiffness();
     double kd = widget->getDamping();
 
-    for(int i = 0; i<numParticlesX-1; i++){
-        for(int j = 0; j<numParticlesY-1; j++){
-            int idx = i*numParticlesY + j;
-            //int idy = j*numParticlesX + i;
-
-            //streching springs
-            ForceSpring* stretchRight = new ForceSpring();
-            stretchRight->setParticlePair(system.getParticle(idx),system.getParticle(idx+1));
-            stretchRight->setRestLength(edgeY);
-            stretchRight->setSpringConstant(ks);
-            stretchRight->setDampingCoeff(kd);
-            system.addForce(stretchRight);
-            springsStretch.push_back(stretchRight);
-            springs.push_back(stretchRight);
-
-
-            ForceSpring* stretchBottom = new ForceSpring();
-            stretchBottom->setParticlePair(system.getParticle(idx),system.getParticle(idx+numParticlesY));
-            stretchBottom->setRestLength(edgeX);
-            stretchBottom->setSpringConstant(ks);
-            stretchBottom->setDampingCoeff(kd);
-            system.addForce(stretchBottom);
-            springsStretch.push_back(stretchBottom);
-            springs.push_back(stretchBottom);
-
-            //shear springs
-            if(idx-numParticlesY > 0){ //check if not on first row
-                ForceSpring* shearTopRight = new ForceSpring();
-                shearTopRight->setParticlePair(system.getParticle(idx-numParticlesY+1),system.getParticle(idx));
-                shearTopRight->setRestLength(std::sqrt(edgeX*edgeX + edgeY*edgeY));
-                shearTopRight->setSpringConstant(ks);
-                shearTopRight->setDampingCoeff(kd);
-                system.addForce(shearTopRight);
-                springsShear.push_back(shearTopRight);
-                springs.push_back(shearTopRight);
-            }
-
-            if(idx+numParticlesY < numParticlesX*numParticlesY){ //check if not on bottom row
-                ForceSpring* shearBottomRight = new ForceSpring();
-                shearBottomRight->setParticlePair(system.getParticle(idx+numParticlesY+1),system.getParticle(idx));
-                shearBottomRight->setRestLength(std::sqrt(edgeX*edgeX + edgeY*edgeY));
-                shearBottomRight->setSpringConstant(ks);
-                shearBottomRight->setDampingCoeff(kd);
-                system.addForce(shearBottomRight);
-                springsShear.push_back(shearBottomRight);
-                springs.push_back(shearBottomRight);
-            }
-
-            //bend springs
-            if(j < numParticlesY-2){ //check if not on second to last column
-                ForceSpring* bendRight = new ForceSpring();
-                bendRight->setParticlePair(system.getParticle(idx),system.getParticle(idx+2));
-                bendRight->setRestLength(2*edgeY);
-                bendRight->setSpringConstant(ks);
-                bendRight->setDampingCoeff(kd);
-                system.addForce(bendRight);
-                springsBend.push_back(bendRight);
-                springs.push_back(bendRight);
-            }
-
-            if(i < numParticlesX-2){
-                ForceSpring* bendBottom = new ForceSpring();
-                bendBottom->setParticlePair(system.getParticle(idx),system.getParticle(idx+2*numParticlesY));
-                bendBottom->setRestLength(2*edgeX);
-                bendBottom->setSpringConstant(ks);
-                bendBottom->setDampingCoeff(kd);
-                system.addForce(bendBottom);
-                springsBend.push_back(bendBottom);
-                springs.push_back(bendBottom);
-            }
-        }
+    // springs: on a pure grid they follow from the layout, the network lists them
+    springs.clearSprings();
+    gridLayout = widget->getSpringLayout() == 1;
+    if (gridLayout) {
+        gridSprings.setGrid(0, numParticlesX, numParticlesY, edgeX, edgeY);
+        system.addForce(&gridSprings);
+    }
+    else {
+        createSpringNetwork(edgeX, edgeY, ks, kd);
     }
     // Code for PROVOT layout
     updateSprings();
@@ -314,55 +237,96 @@ void SceneCloth::reset()
 }
 
 
+void SceneCloth::createSpringNetwork(double edgeX, double edgeY, double ks, double kd)
+{
+    // springs of the same type are added together, each type is a slice of the network
+    springs.reserveSprings(6*numParticles);
+    system.addForce(&springs);
+
+    //streching springs
+    springsStretch = springs.beginCategory();
+    for(int i = 0; i<numParticlesX-1; i++){
+        for(int j = 0; j<numParticlesY-1; j++){
+            int idx = i*numParticlesY + j;
+            springs.addSpring(idx, idx+1, edgeY, ks, kd);               // right
+            springs.addSpring(idx, idx+numParticlesY, edgeX, ks, kd);   // bottom
+        }
+    }
+
+    //shear springs
+    springsShear = springs.beginCategory();
+    double diagonal = std::sqrt(edgeX*edgeX + edgeY*edgeY);
+    for(int i = 0; i<numParticlesX-1; i++){
+        for(int j = 0; j<numParticlesY-1; j++){
+            int idx = i*numParticlesY + j;
+            if(idx-numParticlesY > 0){ //check if not on first row
+                springs.addSpring(idx-numParticlesY+1, idx, diagonal, ks, kd);     // top right
+            }
+            if(idx+numParticlesY < numParticlesX*numParticlesY){ //check if not on bottom row
+                springs.addSpring(idx+numParticlesY+1, idx, diagonal, ks, kd);     // bottom right
+            }
+        }
+    }
+
+    //bend springs
+    springsBend = springs.beginCategory();
+    for(int i = 0; i<numParticlesX-1; i++){
+        for(int j = 0; j<numParticlesY-1; j++){
+            int idx = i*numParticlesY + j;
+            if(j < numParticlesY-2){ //check if not on second to last column
+                springs.addSpring(idx, idx+2, 2*edgeY, ks, kd);                 // right
+            }
+            if(i < numParticlesX-2){
+                springs.addSpring(idx, idx+2*numParticlesY, 2*edgeX, ks, kd);   // bottom
+            }
+        }
+    }
+}
+
 void SceneCloth::updateSprings()
 {
     double ks = widget->getStiffness();
     double kd = widget->getDamping();
 
-    // here I update all ks and kd parameters.
+    // here I update all ks and kd parameters, a whole spring type at once.
     // idea: if you want to enable/disable a spring type, you can set ks to 0 for these
-    for (ForceSpring* f : springsStretch) {
-        f->setDampingCoeff(kd);
-        f->setSpringConstant(ks);
-    }
-    for (ForceSpring* f : springsShear) {
-        f->setDampingCoeff(kd);
-        f->setSpringConstant(ks);
-    }
-    for (ForceSpring* f : springsBend) {
-        f->setDampingCoeff(kd);
-        f->setSpringConstant(ks);
-    }
+    gridSprings.setCoefficients(ForceClothGrid::Stretch, ks, kd);
+    gridSprings.setCoefficients(ForceClothGrid::Shear, ks, kd);
+    gridSprings.setCoefficients(ForceClothGrid::Bend, ks, kd);
+    if (springs.getNumCategories() == 0) return;    // no network
+    springs.setCategoryCoefficients(springsStretch, ks, kd);
+    springs.setCategoryCoefficients(springsShear, ks, kd);
+    springs.setCategoryCoefficients(springsBend, ks, kd);
 }
 
 void SceneCloth::relaxation(int n){
+    // pulls the ends of a stretched spring back to its rest length
+    auto relax = [this](unsigned int i1, unsigned int i2, Real expected_dist) {
+        Particle* p1 = system.getParticle(i1);
+        Particle* p2 = system.getParticle(i2);
+        Vec3r d = p2->pos - p1->pos;
+        Real dist = d.norm();
+
+        if(dist <= expected_dist){
+            return;
+        }
+        // split the correction by inverse mass, pinned particles take none of it
+        Real w = p1->invMass + p2->invMass;
+        if(w == 0){
+            return;
+        }
+        Real correction = (dist - expected_dist)/w;
+        p1->pos += correction * p1->invMass * d.normalized();
+        p2->pos -= correction * p2->invMass * d.normalized();
+    };
+
     for(int i = 0; i<n; i++){
-        for(ForceSpring* spring : springs){
-            Particle* p1 = spring->getParticle1();
-            Particle* p2 = spring->getParticle2();
-            Vec3 d = p2->pos - p1->pos;
-            double dist = d.norm();
-            double expected_dist = spring->getRestLength();
-
-            if(dist <= expected_dist){
-                continue;
-            }
-            else{
-                double correction = dist - expected_dist;
-                if(fixedParticle[p1->id] && fixedParticle[p2->id]){
-                    continue;
-                }
-                else if(fixedParticle[p2->id]){
-                    p1->pos += correction * d.normalized();
-                }
-                else if(fixedParticle[p1->id]){
-                    p2->pos -= correction * d.normalized();
-                }
-                else{
-                    p1->pos += correction/2 * d.normalized();
-                    p2->pos -= correction/2 * d.normalized();
-                }
-            }
+        if (gridLayout) {
+            gridSprings.forEachSpring(relax);
+            continue;
+        }
+        for(unsigned int s = 0; s < springs.getNumSprings(); s++){
+            relax(springs.getEnd1(s), springs.getEnd2(s), springs.getRestLength(s));
         }
     }
 }
@@ -370,7 +334,7 @@ void SceneCloth::relaxation(int n){
 void SceneCloth::updateSimParams()
 {
     double g = widget->getGravity();
-    fGravity->setAcceleration(Vec3(0, -g, 0));
+    fGravity->setAcceleration(Vec3r(0, -g, 0));
 
     updateSprings();
 
@@ -379,11 +343,16 @@ void SceneCloth::updateSimParams()
     }
 
     showParticles = widget->showParticles();
+
+    if (widget->getIntegrator() == 1) integrator = &integratorRK45;
+    else                              integrator = &integratorImplicit;
 }
 
 void SceneCloth::freeAnchors()
 {
-    fixedParticle = std::vector<bool>(numParticles, false);
+    for (Particle* p : system.getParticles()) {
+        p->unpin();
+    }
 }
 
 void SceneCloth::paint(const Camera& camera)
@@ -420,9 +389,9 @@ void SceneCloth::paint(const Camera& camera)
         shaderPhong->setUniformValue("matshin", 100.f);
         for (int i = 0; i < numParticles; i++) {
             const Particle* particle = system.getParticle(i);
-            Vec3   p = particle->pos;
+            Vec3r  p = particle->pos;
             Vec3   c = particle->color;
-            if (fixedParticle[i])      c = Vec3(63/255.0, 72/255.0, 204/255.0);
+            if (particle->isPinned())  c = Vec3(63/255.0, 72/255.0, 204/255.0);
             if (i == selectedParticle) c = Vec3(1.0,0.9,0);
 
             modelMat = QMatrix4x4();
@@ -450,20 +419,14 @@ void SceneCloth::paint(const Camera& camera)
     shaderPhong->release();
 
 
-    // update cloth mesh VBO coords
+    // update cloth mesh VBO coords, copied straight from the system positions
+    // into the mapped buffer (a no-op cast in single precision)
     vboMesh->bind();
-    float* pos = new float[3*numParticles];
-    for (int i = 0; i < numParticles; i++) {
-        pos[3*i  ] = system.getParticle(i)->pos.x();
-        pos[3*i+1] = system.getParticle(i)->pos.y();
-        pos[3*i+2] = system.getParticle(i)->pos.z();
-    }
     void* bufptr = vboMesh->mapRange(0, 3*numParticles*sizeof(float),
                        QOpenGLBuffer::RangeInvalidateBuffer | QOpenGLBuffer::RangeWrite);
-    memcpy(bufptr, (void*)(pos), 3*numParticles*sizeof(float));
+    Eigen::Map<Eigen::Matrix3Xf>(static_cast<float*>(bufptr), 3, numParticles) = system.getPositionsView().cast<float>();
     vboMesh->unmap();
     vboMesh->release();
-    delete[] pos;
 
     // draw mesh
     shaderCloth->bind();
@@ -490,35 +453,16 @@ void SceneCloth::paint(const Camera& camera)
 
 void SceneCloth::update(double dt)
 {
-    // fixed particles: no velocity, no force acting
-    for (int i = 0; i < numParticles; i++) {
-        if (fixedParticle[i]) {
-            Particle* p = system.getParticle(i);
-            p->vel = Vec3(0,0,0);
-            p->force = Vec3(0,0,0);
-            p->pos = p->prevPos;
-        }
-    }
-
-    // integration step
-    Vecd ppos = system.getPositions();
-    integrator.step(system, dt);
+    // integration step, pinned particles have zero inverse mass and don't move
+    Vecr ppos = system.getPositions();
+    integrator->step(system, dt);
     system.setPreviousPositions(ppos);
 
-    for (int i = 0; i < numParticles; i++) {
-        if (fixedParticle[i]) {
-            Particle* p = system.getParticle(i);
-            p->vel = Vec3(0,0,0);
-            p->force = Vec3(0,0,0);
-            p->pos = p->prevPos;
-        }
-    }
-
     // user interaction
     if (selectedParticle >= 0) {
         Particle* p = system.getParticle(selectedParticle);
-        p->pos = cursorWorldPos;
-        p->vel = Vec3(0,0,0);
+        p->pos = cursorWorldPos.cast<Real>();
+        p->vel = Vec3r(0,0,0);
 
         // TODO: test and resolve for collisions during user movement
     }
@@ -533,8 +477,9 @@ void SceneCloth::update(double dt)
         }
     }
 
-    // needed after we have done collisions and relaxation, since spring forces depend on p and v
-    system.updateForces();
+    // collisions and relaxation moved particles through their handles, and spring forces
+    // depend on p and v: the next step recomputes them (only once, the integrator doesn't)
+    system.markStateChanged();
 }
 
 
@@ -551,7 +496,7 @@ void SceneCloth::mousePressed(const QMouseEvent* e, const Camera& cam)
         selectedParticle = -1;
         double min_dist = std::numeric_limits<double>::max();
         for (int i = 0; i < numParticles; i++) {
-            Vec3 A = origin - system.getParticle(i)->pos;
+            Vec3 A = origin - system.getParticle(i)->pos.cast<double>();
             double dist = (A.cross(rayDir)).norm()/rayDir.norm();
             if(dist < min_dist){
                 min_dist = dist;
@@ -560,7 +505,7 @@ void SceneCloth::mousePressed(const QMouseEvent* e, const Camera& cam)
         }
 
         if (selectedParticle >= 0) {
-            cursorWorldPos = system.getParticle(selectedParticle)->pos;
+            cursorWorldPos = system.getParticle(selectedParticle)->pos.cast<double>();
         }
     }
 }
@@ -579,7 +524,7 @@ void SceneCloth::mouseMoved(const QMouseEvent* e, const Camera& cam)
     }
     else {
         if (selectedParticle >= 0) {
-            double d = -(system.getParticle(selectedParticle)->pos - cam.getPos()).dot(cam.zAxis());
+            double d = -(system.getParticle(selectedParticle)->pos.cast<double>() - cam.getPos()).dot(cam.zAxis());
             Vec3 disp = cam.worldSpaceDisplacement(dx, -dy, d);
             cursorWorldPos += disp;
         }
@@ -594,10 +539,8 @@ void SceneCloth::mouseReleased(const QMouseEvent*, const Camera&)
 void SceneCloth::keyPressed(const QKeyEvent* e, const Camera&)
 {
     if (selectedParticle >= 0 && e->key() == Qt::Key_F) {
-        fixedParticle[selectedParticle] = true;
         Particle* p = system.getParticle(selectedParticle);
         p->prevPos = p->pos;
-        p->vel = Vec3(0,0,0);
-        p->force = Vec3(0,0,0);
+        p->pin();
     }
 }
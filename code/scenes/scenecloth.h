@@ -34,11 +34,20 @@ public:
         bmax = Vec3( 100,  100,  100);
     }
     virtual unsigned int getNumParticles() { return system.getNumParticles(); }
+    virtual bool getSubstepStats(unsigned int& accepted, unsigned int& rejected) {
+        if (integrator != &integratorRK45) return false;
+        accepted = integratorRK45.getAcceptedSubsteps();
+        rejected = integratorRK45.getRejectedSubsteps();
+        return true;
+    }
 
     virtual QWidget* sceneUI() { return widget; }
 
     void relaxation(int n);
 
+protected:
+    void createSpringNetwork(double edgeX, double edgeY, double ks, double kd);
+
 public slots:
     void updateSprings();
     void updateSimParams();
@@ -61,18 +70,24 @@ protected:
     unsigned int numMeshIndices = 0;
     bool showParticles = true;
 
-    // physics
-    IntegratorRK4 integrator; // TODO: pick a better one
-    ParticleSystem system;
-    ForceConstAcceleration* fGravity = nullptr;
-    std::vector<ForceSpring*> springs;
-    std::vector<ForceSpring*> springsStretch;
-    std::vector<ForceSpring*> springsShear;
-    std::vector<ForceSpring*> springsBend;
-    ColliderSphere colliderSphere;
+    // physics, in the Real precision (see defines.h)
+    typedef ParticleT<3, Real> Particle;
+    typedef ForceSpringNetworkT<3, Real> ForceSpringNetwork;
+    IntegratorIMEXT<3, Real> integratorImplicit;   // implicit springs, large steps even when stiff
+    IntegratorRK45T<3, Real> integratorRK45;    // substeps only as small as the springs need
+    IntegratorT<3, Real>* integrator = &integratorImplicit;
+    ParticleSystemT<3, Real> system;
+    ForceConstAccelerationT<3, Real>* fGravity = nullptr;
+    typedef ForceClothGridT<3, Real> ForceClothGrid;
+    ForceSpringNetwork springs;             // all the cloth springs, one force
+    unsigned int springsStretch = 0;        // their categories in the network
+    unsigned int springsShear = 0;
+    unsigned int springsBend = 0;
+    ForceClothGrid gridSprings;             // same springs from the grid layout, no lists
+    bool gridLayout = false;
+    ColliderSphereT<Real> colliderSphere;
 
     // cloth properties
-    std::vector<bool> fixedParticle;
     double clothWidth, clothHeight;
     int numParticles, numParticlesX, numParticlesY;
     int selectedParticle = -1;
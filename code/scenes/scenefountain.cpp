@@ -50,6 +50,7 @@ void SceneFountain::initialize() {
     // create forces
     fGravity = new ForceConstAcceleration();
     system.addForce(fGravity);
+    lifeAttr = system.addAttribute("life");
 
     // scene description
     fountainPos = Vec3(0, 80, 0);
@@ -72,9 +73,8 @@ void SceneFountain::reset()
     Random::seed(1337);
 
     // erase all particles
-    fGravity->clearInfluencedParticles();
+    fGravity->setInfluenceAll();
     system.deleteParticles();
-    deadParticles.clear();
 }
 
 void SceneFountain::updateSimParams()
@@ -183,37 +183,24 @@ void SceneFountain::paint(const Camera& camera) {
 
 void SceneFountain::update(double dt) {
 
-    // emit new particles, reuse dead ones if possible
+    // emit new particles in one batch, the pool reuses the slots of dead ones
     int emitParticles = std::max(1, int(std::round(emitRate * dt)));
-    for (int i = 0; i < emitParticles; i++) {
-        Particle* p;
-        if (!deadParticles.empty()) {
-            // reuse one dead particle
-            p = deadParticles.front();
-            deadParticles.pop_front();
-        }
-        else {
-            // create new particle
-            p = new Particle();
-            system.addParticle(p);
-
-            // don't forget to add particle to forces that affect it
-            fGravity->addInfluencedParticle(p);
-        }
-
+    unsigned int first = system.createParticles(emitParticles);
+    ParticleSystem::ScalarView life = system.getAttributeView(lifeAttr);
+    for (unsigned int i = first; i < system.getNumParticles(); i++) {
+        Particle* p = system.getParticle(i);
         p->color = Vec3(153/255.0, 217/255.0, 234/255.0);
         p->radius = 1.0;
-        p->life = maxParticleLife;
+        life[i] = maxParticleLife;
 
         double x = Random::get(-20.0, 20.0);
         double y = 0;
         double z = Random::get(-20.0, 20.0);
         p->pos = Vec3(x, y, z) + fountainPos;
         p->vel = Vec3(0,0,0);
-
-        hash->setSpacing(1.2*(p->radius));
-        hash->create((int) system.getNumParticles());
     }
+    hash->setSpacing(1.2);
+    hash->create((int) system.getNumParticles());
 
     // integration step
     Vecd ppos = system.getPositions();
@@ -242,10 +229,10 @@ void SceneFountain::update(double dt) {
             p_collision = false;
         }
         p->color = Vec3(153/255.0, 217/255.0, 234/255.0);
-        if (p->life > 0) {
-            p->life -= dt;
-            if (p->life < 0) {
-                deadParticles.push_back(p);
+        if (life[k] > 0) {
+            life[k] -= dt;
+            if (life[k] < 0) {
+                system.killParticle(k);
             }
         }
         //clamp to avoid clipping below the horizontal plane
@@ -295,6 +282,9 @@ void SceneFountain::update(double dt) {
             }
         }
     }
+
+    // drop the dead particles so the next steps only go through live ones
+    system.compactParticles();
 }
 
 void SceneFountain::mousePressed(const QMouseEvent* e, const Camera&)
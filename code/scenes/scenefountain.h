@@ -3,7 +3,6 @@
 
 #include <QOpenGLShaderProgram>
 #include <QOpenGLVertexArrayObject>
-#include <list>
 #include "scene.h"
 #include "widgetfountain.h"
 #include "particlesystem.h"
@@ -50,7 +49,6 @@ protected:
 
     IntegratorRK4 integrator;
     ParticleSystem system;
-    std::list<Particle*> deadParticles;
     ForceConstAcceleration* fGravity;
 
     ColliderPlane colliderFloor, colliderRamp;
@@ -60,6 +58,7 @@ protected:
     double kBounce, kFriction;
     double emitRate;
     double maxParticleLife;
+    int lifeAttr = -1;
 
     Hash* hash;
 
@@ -3,6 +3,7 @@
 #include "model.h"
 #include <QMatrix4x4>
 #include <iostream>
+#include <thread>
 
 
 SceneNBody::SceneNBody() {
@@ -73,6 +74,11 @@ void SceneNBody::reset() {
         case 3: integrator = new IntegratorRK2(); break;
         case 4: integrator = new IntegratorRK4(); break;
         case 5: integrator = new IntegratorVerlet(); break;
+        case 6: integrator = new IntegratorVelocityVerlet(); break;
+        case 7: integrator = new IntegratorYoshida4(); break;
+        case 8: integrator = new IntegratorYoshida6(); break;
+        case 9: integrator = new IntegratorPEFRL(); break;
+        case 10: integrator = new IntegratorBlockStep(); break;
         default: integrator = nullptr; break;
     }
 
@@ -105,25 +111,42 @@ void SceneNBody::reset() {
             break;
         }
 
-        Particle* p = new Particle();
+        Particle* p = system.createParticle();
         p->pos = sceneR * radial;
         p->vel = 0.2*sceneR * tangent;
         p->mass = massScale * (1 + (massRatio - 1)*(double(i)/(numBodies-1)));
         p->radius = 5*std::sqrt(p->mass/massScale);
         p->color = getParticleColor(double(i)/numBodies);
-        system.addParticle(p);
     }
 
-    // create a gravitational field force for each particle
     const double G = 6.6743e-11;
-    for (int i = 0; i < numBodies; i++) {
-        ForceGravitation* force = new ForceGravitation(system.getParticle(i), G);
+    if (widget->getGravityType() == 1) {
+        // a single force for all the bodies, O(N log N)
+        ForceBarnesHut* force = new ForceBarnesHut(G);
         force->setSmoothingFactors(widget->getSmoothingA(), widget->getSmoothingB());
-        for (int j = 0; j < numBodies; j++) {
-            if (i != j) {
-                force->addInfluencedParticle(system.getParticle(j));
-            }
-        }
+        force->setOpeningAngle(widget->getOpeningAngle());
+        force->setThreads(std::thread::hardware_concurrency());
+        force->setInfluenceAll();
+        system.addForce(force);
+    }
+    else if (widget->getGravityType() == 2) {
+        // expansions between cells, O(N): a higher order or a smaller opening angle
+        // are more accurate and slower
+        ForceFMM* force = new ForceFMM(G);
+        force->setSmoothingFactors(widget->getSmoothingA(), widget->getSmoothingB());
+        force->setOrder(widget->getExpansionOrder());
+        force->setOpeningAngle(widget->getOpeningAngle());
+        force->setLeafSize(widget->getLeafSize());
+        force->setThreads(std::thread::hardware_concurrency());
+        force->setInfluenceAll();
+        system.addForce(force);
+    }
+    else {
+        // all the pairs, each evaluated once
+        ForceNBodyDirect* force = new ForceNBodyDirect(G);
+        force->setSmoothingFactors(widget->getSmoothingA(), widget->getSmoothingB());
+        force->setThreads(std::thread::hardware_concurrency());
+        force->setInfluenceAll();
         system.addForce(force);
     }
 
@@ -149,7 +172,8 @@ void SceneNBody::update(double dt) {
     integrator->step(system, dt);
     system.setPreviousPositions(pos);
 
-    // record trajectories
+    // record trajectories, only while shown: they take MAX_TRAJ_POINTS per body
+    if (!widget->drawTrajectories()) return;
     for (unsigned int i = 0; i < system.getNumParticles(); i++) {
         trajectories[i].push_back(system.getParticle(i)->pos);
         if (trajectories[i].size() > MAX_TRAJ_POINTS) {
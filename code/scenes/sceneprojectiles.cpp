@@ -81,43 +81,43 @@ void SceneProjectiles::initialize() {
      */
 
     // create the different systems, with one particle each
-    systemAnalytic.addParticle(new Particle(Vec3( 0, 0, 0), Vec3(0,0,0), 1));
+    systemAnalytic.addParticle(new Particle2D(Vec2(0, 0), Vec2(0, 0), 1));
     systemAnalytic.getParticle(0)->color = Vec3(0, 0.5, 0);
     systemAnalytic.getParticle(0)->radius = 2;
-    systemNumerical1.addParticle(new Particle(Vec3( 0, 0, 15), Vec3(0,0,0), 1));
+    systemNumerical1.addParticle(new Particle2D(Vec2(0, 0), Vec2(0, 0), 1));
     systemNumerical1.getParticle(0)->color = Vec3(0.5, 0, 0);
     systemNumerical1.getParticle(0)->radius = 2;
-    systemNumerical2.addParticle(new Particle(Vec3( 0, 0, -15), Vec3(0,0,0), 1));
+    systemNumerical2.addParticle(new Particle2D(Vec2(0, 0), Vec2(0, 0), 1));
     systemNumerical2.getParticle(0)->color = Vec3(0, 0, 0.5);
     systemNumerical2.getParticle(0)->radius = 2;
 
     // only one force: gravity, but we need to create one per system to assign its particle
-    fGravity1 = new ForceConstAcceleration(Vec3(0, -gravityAccel, 0));
+    fGravity1 = new ForceConstAccelerationT<2, double>(Vec2(0, -gravityAccel));
     fGravity1->addInfluencedParticle(systemNumerical1.getParticle(0));
     systemNumerical1.addForce(fGravity1);
 
-    fGravity2 = new ForceConstAcceleration(Vec3(0, -gravityAccel, 0));
+    fGravity2 = new ForceConstAccelerationT<2, double>(Vec2(0, -gravityAccel));
     fGravity2->addInfluencedParticle(systemNumerical2.getParticle(0));
     systemNumerical2.addForce(fGravity2);
 
-    fDrag1 = new ForceDrag(widget->getLinear1(),widget->getQuadratic1());
+    fDrag1 = new ForceDragT<2, double>(widget->getLinear1(),widget->getQuadratic1());
     fDrag1->addInfluencedParticle(systemNumerical1.getParticle(0));
     systemNumerical1.addForce(fDrag1);
 
-    fDrag2 = new ForceDrag(widget->getLinear2(),widget->getQuadratic2());
+    fDrag2 = new ForceDragT<2, double>(widget->getLinear2(),widget->getQuadratic2());
     fDrag2->addInfluencedParticle(systemNumerical2.getParticle(0));
     systemNumerical2.addForce(fDrag2);
 }
 
 
-Integrator* createIntegrator(int type) {
+IntegratorT<2, double>* createIntegrator(int type) {
     switch(type) {
-        case 0: return new IntegratorEuler();
-        case 1: return new IntegratorSymplecticEuler();
-        case 2: return new IntegratorMidpoint();
-        case 3: return new IntegratorRK2();
-        case 4: return new IntegratorRK4();
-        case 5: return new IntegratorVerlet();
+        case 0: return new IntegratorEulerT<2, double>();
+        case 1: return new IntegratorSymplecticEulerT<2, double>();
+        case 2: return new IntegratorMidpointT<2, double>();
+        case 3: return new IntegratorRK2T<2, double>();
+        case 4: return new IntegratorRK4T<2, double>();
+        case 5: return new IntegratorVerletT<2, double>();
         default: return nullptr;
     }
 }
@@ -141,29 +141,28 @@ void SceneProjectiles::reset() {
     fDrag2->setDragCoefficients(widget->getLinear2(),widget->getQuadratic2());
 
     // update initial particle positions
-    const double zdist = 15;
-    systemAnalytic.getParticle(0)->pos = Vec3(0, shotHeight, 0);
-    systemAnalytic.getParticle(0)->vel = shotSpeed*Vec3(std::cos(shotAngle), std::sin(shotAngle), 0);
-    systemNumerical1.getParticle(0)->pos = Vec3(0, shotHeight, zdist);
-    systemNumerical1.getParticle(0)->vel = shotSpeed*Vec3(std::cos(shotAngle), std::sin(shotAngle), 0);
-    systemNumerical2.getParticle(0)->pos = Vec3(0, shotHeight, -zdist);
-    systemNumerical2.getParticle(0)->vel = shotSpeed*Vec3(std::cos(shotAngle), std::sin(shotAngle), 0);
+    systemAnalytic.getParticle(0)->pos = Vec2(0, shotHeight);
+    systemAnalytic.getParticle(0)->vel = shotSpeed*Vec2(std::cos(shotAngle), std::sin(shotAngle));
+    systemNumerical1.getParticle(0)->pos = Vec2(0, shotHeight);
+    systemNumerical1.getParticle(0)->vel = shotSpeed*Vec2(std::cos(shotAngle), std::sin(shotAngle));
+    systemNumerical2.getParticle(0)->pos = Vec2(0, shotHeight);
+    systemNumerical2.getParticle(0)->vel = shotSpeed*Vec2(std::cos(shotAngle), std::sin(shotAngle));
 
     // update gravity accelerations
-    fGravity1->setAcceleration(Vec3(0, -gravityAccel, 0));
-    fGravity2->setAcceleration(Vec3(0, -gravityAccel, 0));
+    fGravity1->setAcceleration(Vec2(0, -gravityAccel));
+    fGravity2->setAcceleration(Vec2(0, -gravityAccel));
 
-    // update system forces
-    systemNumerical1.updateForces();
-    systemNumerical2.updateForces();
+    // particles were moved through their handles, forces get recomputed on the first step
+    systemNumerical1.markStateChanged();
+    systemNumerical2.markStateChanged();
 
     // trajectories
     trajectoryAnalytic.clear();
-    trajectoryAnalytic.push_back(systemAnalytic.getParticle(0)->pos);
+    trajectoryAnalytic.push_back(Vec3(0, shotHeight, zAnalytic));
     trajectoryNumerical1.clear();
-    trajectoryNumerical1.push_back(systemNumerical1.getParticle(0)->pos);
+    trajectoryNumerical1.push_back(Vec3(0, shotHeight, zNumerical1));
     trajectoryNumerical2.clear();
-    trajectoryNumerical2.push_back(systemNumerical2.getParticle(0)->pos);
+    trajectoryNumerical2.push_back(Vec3(0, shotHeight, zNumerical2));
 
     // put particles to run
     system1active = true;
@@ -182,17 +181,17 @@ void SceneProjectiles::update(double dt) {
     time += dt;
 
     // ANALYTIC: projectile motion equations until we reach the ground
-    Particle* p = systemAnalytic.getParticle(0);
+    Particle2D* p = systemAnalytic.getParticle(0);
     double vy0 = shotSpeed*std::sin(shotAngle);
     double tGround = (vy0 + std::sqrt(vy0*vy0 + 2*gravityAccel*shotHeight))/gravityAccel;
     if (time - dt <= tGround) {
         double t = std::min(time, tGround);
         p->pos[0] = t * shotSpeed * std::cos(shotAngle);
         p->pos[1] = shotHeight + t*vy0 - 0.5*gravityAccel*t*t;
-        p->vel    = Vec3(shotSpeed*std::cos(shotAngle),
-                         shotSpeed*std::sin(shotAngle) - gravityAccel*t, 0);
+        p->vel    = Vec2(shotSpeed*std::cos(shotAngle),
+                         shotSpeed*std::sin(shotAngle) - gravityAccel*t);
 
-        trajectoryAnalytic.push_back(p->pos);
+        trajectoryAnalytic.push_back(Vec3(p->pos[0], p->pos[1], zAnalytic));
         if (trajectoryAnalytic.size() > MAX_TRAJ_POINTS) trajectoryAnalytic.pop_front();
     }
 
@@ -204,7 +203,7 @@ void SceneProjectiles::update(double dt) {
         integrator1->step(systemNumerical1, dt);
 
         // collision test
-        Particle* p = systemNumerical1.getParticle(0);
+        Particle2D* p = systemNumerical1.getParticle(0);
         if (p->pos.y() < 0) {
             // resolve
             // TODO
@@ -214,7 +213,7 @@ void SceneProjectiles::update(double dt) {
         }
 
         // record trajectory
-        trajectoryNumerical1.push_back(p->pos);
+        trajectoryNumerical1.push_back(Vec3(p->pos[0], p->pos[1], zNumerical1));
         if (trajectoryNumerical1.size() > MAX_TRAJ_POINTS) {
             trajectoryNumerical1.pop_front();
         }
@@ -225,7 +224,7 @@ void SceneProjectiles::update(double dt) {
         integrator2->step(systemNumerical2, dt);
 
         // collision test
-        Particle* p = systemNumerical2.getParticle(0);
+        Particle2D* p = systemNumerical2.getParticle(0);
         if (p->pos.y() < 0) {
             // resolve
             // TODO
@@ -235,7 +234,7 @@ void SceneProjectiles::update(double dt) {
         }
 
         // record trajectory
-        trajectoryNumerical2.push_back(p->pos);
+        trajectoryNumerical2.push_back(Vec3(p->pos[0], p->pos[1], zNumerical2));
         if (trajectoryNumerical2.size() > MAX_TRAJ_POINTS) {
             trajectoryNumerical2.pop_front();
         }
@@ -298,16 +297,18 @@ void SceneProjectiles::paint(const Camera& camera) {
 
     // draw the different spheres
     vaoSphere->bind();
-    const Particle* particles[3] = { systemAnalytic.getParticle(0),
-                                     systemNumerical1.getParticle(0),
-                                     systemNumerical2.getParticle(0) };
-    for (const Particle* particle : particles) {
-        Vec3   p = particle->pos;
+    const Particle2D* particles[3] = { systemAnalytic.getParticle(0),
+                                       systemNumerical1.getParticle(0),
+                                       systemNumerical2.getParticle(0) };
+    const double zPlanes[3] = { zAnalytic, zNumerical1, zNumerical2 };
+    for (int i = 0; i < 3; i++) {
+        const Particle2D* particle = particles[i];
+        Vec2   p = particle->pos;
         Vec3   c = particle->color;
         double r = particle->radius;
 
         modelMat = QMatrix4x4();
-        modelMat.translate(p[0], p[1], widget->renderSameZ() ? 0 : p[2]);
+        modelMat.translate(p[0], p[1], widget->renderSameZ() ? 0 : zPlanes[i]);
         modelMat.scale(r);
         shaderPhong->setUniformValue("ModelMatrix", modelMat);
 
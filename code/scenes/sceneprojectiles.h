@@ -46,15 +46,20 @@ protected:
     unsigned int numSphereFaces = 0;
     const unsigned int MAX_TRAJ_POINTS = 1000;
 
-    Integrator* integrator1 = nullptr;
-    Integrator* integrator2 = nullptr;
-    ParticleSystem systemAnalytic;
-    ParticleSystem systemNumerical1;
-    ParticleSystem systemNumerical2;
-    ForceConstAcceleration *fGravity1 = nullptr;
-    ForceConstAcceleration *fGravity2 = nullptr;
-    ForceDrag *fDrag1 = nullptr;
-    ForceDrag *fDrag2 = nullptr;
+    // shots are planar, so the systems are 2D and each one is drawn on its own z plane
+    typedef ParticleSystemT<2, double> ParticleSystem2D;
+    typedef ParticleT<2, double> Particle2D;
+    const double zAnalytic = 0, zNumerical1 = 15, zNumerical2 = -15;
+
+    IntegratorT<2, double>* integrator1 = nullptr;
+    IntegratorT<2, double>* integrator2 = nullptr;
+    ParticleSystem2D systemAnalytic;
+    ParticleSystem2D systemNumerical1;
+    ParticleSystem2D systemNumerical2;
+    ForceConstAccelerationT<2, double> *fGravity1 = nullptr;
+    ForceConstAccelerationT<2, double> *fGravity2 = nullptr;
+    ForceDragT<2, double> *fDrag1 = nullptr;
+    ForceDragT<2, double> *fDrag2 = nullptr;
     bool system1active, system2active;
 
     std::list<Vec3> trajectoryAnalytic;
@@ -75,7 +75,7 @@ void SceneRope::reset()
     particles.clear();
 
     // reset forces
-    fGravity->clearInfluencedParticles();
+    fGravity->setInfluenceAll();    // the anchor is not in the system
     for (ForceSpring* f : springs) delete f;
     springs.clear();
     system.clearForces();
@@ -129,7 +129,6 @@ void SceneRope::reset()
         }
         else {
             system.addParticle(p);
-            fGravity->addInfluencedParticle(p);
         }
     }
 
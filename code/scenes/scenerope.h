@@ -52,7 +52,7 @@ protected:
     unsigned int numFacesSphereS = 0, numFacesSphereL = 0;
     bool showParticles;
 
-    IntegratorRK4 integrator; //change integrator to not explode lmao
+    IntegratorIMEX integrator;      // implicit springs, stiff ones don't explode
     ParticleSystem system;
     ForceConstAcceleration* fGravity = nullptr;
     std::vector<Particle*> particles;
@@ -37,7 +37,7 @@ void SceneSPH::initialize() {
     glutils::checkGLError();
 
     // create forces
-    fGravity = new ForceConstAcceleration();
+    fGravity = new ForceConstAccelerationT<3, Real>();
     system.addForce(fGravity);
 
     // scene description
@@ -47,8 +47,8 @@ void SceneSPH::initialize() {
     colliderWallEast.setPlane(Vec3(0,0,1),0);
     colliderWallWest.setPlane(Vec3(0,0,-1),0);
 
-    hash = new Hash(2, widget->getWidth() * widget->getHeight() * widget->getDepth(), &system);
-    sph = new SPH(system, width, height, depth);
+    hash = new HashT<Real>(2, widget->getWidth() * widget->getHeight() * widget->getDepth(), &system);
+    sph = new SPH(&system, width, height, depth);
 }
 
 void SceneSPH::reset()
@@ -62,14 +62,15 @@ void SceneSPH::reset()
     std::uniform_real_distribution<> distr(-0.5,0.5);
 
     // erase all particles
-    fGravity->clearInfluencedParticles();
+    fGravity->setInfluenceAll();
     system.deleteParticles();
     //deadParticles.clear();
     double tx;
     double ty;
     double tz;
-    Vec3 pos;
+    Vec3r pos;
     Particle* p;
+    system.reserveParticles(width*height*depth);
     for(int i = 0; i<width; i++){
         for(int j = 0; j<height; j++){
             for(int k = 0; k<depth; k++){
@@ -79,19 +80,16 @@ void SceneSPH::reset()
                 ty = j*widget->getSizeY();
                 tz = k*widget->getSizeZ() - depth;
 
-                pos = Vec3(tx + distr(gen), ty+5, tz + distr(gen));
+                pos = Vec3r(tx + distr(gen), ty+5, tz + distr(gen));
 
-                p = new Particle();
+                p = system.createParticle();
                 p->id = idx;
                 p->pos = pos;
                 p->prevPos = pos;
-                p->vel = Vec3(0,0,0);
+                p->vel = Vec3r(0,0,0);
                 p->mass = 1;
                 p->radius = 1.0;
                 p->color = Vec3(25/255.0, 151/255.0, 136/255.0);
-
-                system.addParticle(p);
-                fGravity->addInfluencedParticle(p);
             }
         }
     }
@@ -100,16 +98,14 @@ void SceneSPH::reset()
     hash->create((int) system.getNumParticles());
 
     system.addForce(sph);
-    for(Particle* p: system.getParticles()){
-        sph->addInfluencedParticle(p);
-    }
+    sph->setInfluenceAll();
 }
 
 void SceneSPH::updateSimParams()
 {
     // get gravity from UI and update force
     double g = widget->getGravity();
-    fGravity->setAcceleration(Vec3(0, -g, 0));
+    fGravity->setAcceleration(Vec3r(0, -g, 0));
 
     // get other relevant UI values and update simulation params
     kBounce = 0.5;
@@ -209,7 +205,7 @@ void SceneSPH::paint(const Camera& camera) {
     // draw the particles
     vaoSphereL->bind();
     for (const Particle* particle : system.getParticles()) {
-        Vec3   p = particle->pos;
+        Vec3r  p = particle->pos;
         Vec3   c = particle->color;
         double r = particle->radius;
 
@@ -228,7 +224,7 @@ void SceneSPH::paint(const Camera& camera) {
 
 void SceneSPH::update(double dt) {
     // integration step
-    Vecd ppos = system.getPositions();
+    Vecr ppos = system.getPositions();
     integrator.step(system, dt);
     system.setPreviousPositions(ppos);
 
@@ -251,6 +247,10 @@ void SceneSPH::update(double dt) {
             colliderWallEast.resolveCollision(p, colInfo, kBounce, kFriction);
         }
     }
+
+    // the colliders moved particles through their handles: the next step recomputes
+    // the densities and forces instead of reusing the ones of the last stage
+    system.markStateChanged();
 }
 
 void SceneSPH::mousePressed(const QMouseEvent* e, const Camera&)
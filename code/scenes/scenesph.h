@@ -47,18 +47,20 @@ protected:
     QOpenGLVertexArrayObject* vaoFloor   = nullptr;
     unsigned int numFacesSphereL = 0, numFacesSphereH = 0;
 
-    IntegratorSymplecticEuler integrator;
-    ParticleSystem system;
-    ForceConstAcceleration* fGravity;
+    // simulated in the Real precision, see defines.h
+    typedef ParticleT<3, Real> Particle;
+    IntegratorVelocityVerletT<3, Real> integrator;
+    ParticleSystemT<3, Real> system;
+    ForceConstAccelerationT<3, Real>* fGravity;
 
-    ColliderPlane colliderFloor, colliderWallNorth, colliderWallWest, colliderWallSouth, colliderWallEast;
+    ColliderPlaneT<Real> colliderFloor, colliderWallNorth, colliderWallWest, colliderWallSouth, colliderWallEast;
 
     double kBounce, kFriction;
     double width, height, depth;
     //double emitRate;
     //double maxParticleLife;
 
-    Hash* hash;
+    HashT<Real>* hash;
     SPH* sph;
     int mouseX, mouseY;
 };
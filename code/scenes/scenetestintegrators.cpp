@@ -4,9 +4,10 @@
 #include "forces.h"
 #include <QOpenGLFunctions_3_3_Core>
 #include <QOpenGLBuffer>
+#include <thread>
 
 
-class ForceDampedHarmonicOscillator1D : public Force
+class ForceDampedHarmonicOscillator1D : public ForceT<1, double>
 {
 public:
     ForceDampedHarmonicOscillator1D() {};
@@ -29,7 +30,7 @@ public:
     virtual void apply() {
         double t = *timePtr;
         for (Particle* p : particles) {
-            p->force[dim] += evaluate(t, p->pos[dim], p->vel[dim]);
+            p->force[0] += evaluate(t, p->pos[0], p->vel[0]);
         }
     }
 
@@ -38,7 +39,6 @@ public:
     }
 
 protected:
-    int dim = 0;
     const double* timePtr = nullptr;
     double ks;  // spring constant
     double kd;  // damping constant
@@ -98,7 +98,7 @@ void SceneTestIntegrators::initialize() {
     vaoTrajectory->release();
 
     // physical system
-    particle = new Particle();
+    particle = new Particle1D();
     force = new ForceDampedHarmonicOscillator1D();
     force->addInfluencedParticle(particle);
     force->setTimePointer(particleSystem.getTimePointer());
@@ -126,19 +126,45 @@ void SceneTestIntegrators::reset()
 
     if (integrator) delete integrator;
     switch (widget->getIntegratorType()) {
-        case 0: integrator = new IntegratorEuler(); break;
-        case 1: integrator = new IntegratorSymplecticEuler(); break;
-        case 2: integrator = new IntegratorMidpoint(); break;
-        case 3: integrator = new IntegratorRK2(); break;
-        case 4: integrator = new IntegratorRK4(); break;
-        case 5: integrator = new IntegratorVerlet(); break;
+        case 0: integrator = new IntegratorEulerT<1, double>(); break;
+        case 1: integrator = new IntegratorSymplecticEulerT<1, double>(); break;
+        case 2: integrator = new IntegratorMidpointT<1, double>(); break;
+        case 3: integrator = new IntegratorRK2T<1, double>(); break;
+        case 4: integrator = new IntegratorRK4T<1, double>(); break;
+        case 5: integrator = new IntegratorVerletT<1, double>(); break;
+        case 6: integrator = new IntegratorRK45T<1, double>(); break;
+        case 7: integrator = new IntegratorVelocityVerletT<1, double>(); break;
+        case 8: integrator = new IntegratorBulirschStoerT<1, double>(); break;
+        case 9: {
+            // each frame split in slices, symplectic Euler across a slice against RK4
+            // substeps, each slice on its own copy of the oscillator
+            IntegratorPararealT<1, double>* parareal = new IntegratorPararealT<1, double>(
+                []() { return new IntegratorSymplecticEulerT<1, double>(); },
+                []() { return new IntegratorRK4T<1, double>(); },
+                [this]() {
+                    ParticleSystem1D* system = new ParticleSystem1D();
+                    Particle1D* p = system->createParticle();
+                    p->mass = particle->mass;
+                    ForceDampedHarmonicOscillator1D* f = new ForceDampedHarmonicOscillator1D();
+                    f->setSpringConstant(force->getSpringConstant());
+                    f->setDampingCoeff(force->getDampingCoeff());
+                    f->setDrivingForceMagnitude(force->getDrivingForceMagnitude());
+                    f->setDrivingForceFrequency(force->getDrivingForceFrequency());
+                    f->setTimePointer(system->getTimePointer());
+                    f->addInfluencedParticle(p);
+                    system->addForce(f);
+                    return system;
+                });
+            parareal->setSlices(std::max(2u, std::thread::hardware_concurrency()));
+            parareal->setSubsteps(1, 50);
+            integrator = parareal;
+            break;
+        }
         default: integrator = nullptr; break;
     }
 
     firstIteration = true;
     particleSystem.setTime(0);
-    particle->pos = Vec3(0,0,0);
-    particle->vel = Vec3(0,0,0);
     particle->pos[0] = widget->getInitialPos();
     particle->vel[0] = widget->getInitialVel();
     particleSystem.updateForces();
@@ -494,6 +520,23 @@ void SceneTestIntegrators::update(double dt)
     widget->setInfo(info);
 }
 
+bool SceneTestIntegrators::getSubstepStats(unsigned int& accepted, unsigned int& rejected)
+{
+    const IntegratorRK45T<1, double>* rk45 = dynamic_cast<const IntegratorRK45T<1, double>*>(integrator);
+    if (rk45) {
+        accepted = rk45->getAcceptedSubsteps();
+        rejected = rk45->getRejectedSubsteps();
+        return true;
+    }
+    const IntegratorBulirschStoerT<1, double>* bs = dynamic_cast<const IntegratorBulirschStoerT<1, double>*>(integrator);
+    if (bs) {
+        accepted = bs->getAcceptedSubsteps();
+        rejected = bs->getRejectedSubsteps();
+        return true;
+    }
+    return false;
+}
+
 void SceneTestIntegrators::mousePressed(const QMouseEvent*, const Camera&)
 {
 }
@@ -38,6 +38,7 @@ public:
         bmax = Vec3( 10,  10,  10);
     }
     virtual unsigned int getNumParticles() { return 1; }
+    virtual bool getSubstepStats(unsigned int& accepted, unsigned int& rejected);
 
     virtual QWidget* sceneUI() { return widget; }
 
@@ -59,11 +60,13 @@ protected:
     const unsigned int MAX_TRAJ_POINTS = 1000;
 
 
-    // physic simulation
-    ParticleSystem particleSystem;
-    Integrator* integrator = nullptr;
+    // physic simulation, the oscillator only moves along x
+    typedef ParticleSystemT<1, double> ParticleSystem1D;
+    typedef ParticleT<1, double> Particle1D;
+    ParticleSystem1D particleSystem;
+    IntegratorT<1, double>* integrator = nullptr;
     ForceDampedHarmonicOscillator1D* force = nullptr;
-    Particle* particle = nullptr;
+    Particle1D* particle = nullptr;
     bool firstIteration = true;
 
     // analytic solution
@@ -1,29 +1,36 @@
 #include "sph.h"
 
-SPH::SPH(ParticleSystem system, double width, double height, double depth):system(system),width(width),depth(depth){
-
+SPH::SPH(ParticleSystem* system, double width, double height, double depth):width(width),depth(depth){
+    setSystem(system);
+    densityAttr  = system->addAttribute("density");
+    pressureAttr = system->addAttribute("pressure");
 }
 
 void SPH::computeDensityPressure(){
-    for(Particle* p : system.getParticles()){ //iterate over every particle
-        p->pressure = 0;
-        for(Particle* p2 : system.getParticles()){ //get all other particles (including current one)
-            double dist = (p->pos - p2->pos).norm();
+    ParticleSystem::ScalarView density  = system->getAttributeView(densityAttr);
+    ParticleSystem::ScalarView pressure = system->getAttributeView(pressureAttr);
+    for(unsigned int i = 0; i<system->getNumParticles(); i++){ //iterate over every particle
+        Particle* p = system->getParticle(i);
+        pressure[i] = 0;
+        Accumulator rho = density[i];   // summed in double even for float storage
+        for(Particle* p2 : system->getParticles()){ //get all other particles (including current one)
+            Real dist = (p->pos - p2->pos).norm();
             if(dist < h*h){
-                p->density += p->mass * poly6 * std::pow((h*h - dist),3);
+                rho += p->mass * poly6 * std::pow((h*h - dist),3);
             }
         }
-        p->pressure = gasConstant * (p->density * restDensity);
+        density[i] = rho;
+        pressure[i] = gasConstant * (density[i] * restDensity);
     }
 }
 
-Vec3 SPH::spiky(Vec3 r, double h){
+Vec3r SPH::spiky(Vec3r r, Real h){
     float r_norm = r.norm();
     if(r_norm > h) return {0.f, 0.f, 0.f};
-    return -r * 45.f / (M_PI * std::pow(h, 6) * r_norm) * std::pow(h-r_norm, 2.f);
+    return -r * Real(45.f / (M_PI * std::pow(h, 6) * r_norm) * std::pow(h-r_norm, 2.f));
 }
 
-double SPH::visco(Vec3 r, double h){
+Real SPH::visco(Vec3r r, Real h){
     float r_norm = r.norm();
     if(r_norm > h) return 0;
     return 45.f / (M_PI * std::pow(h, 5)) * (1 - r_norm/h);
@@ -31,29 +38,31 @@ double SPH::visco(Vec3 r, double h){
 
 void SPH::apply(){
     computeDensityPressure();
-    for(int i = 0; i<system.getNumParticles(); i++){
-        Particle* pi = system.getParticle(i);
-        Vec3 a_p(0.f, 0.f, 0.f);
-        Vec3 a_v(0.f, 0.f, 0.f);
+    ParticleSystem::ScalarView density  = system->getAttributeView(densityAttr);
+    ParticleSystem::ScalarView pressure = system->getAttributeView(pressureAttr);
+    for(int i = 0; i<system->getNumParticles(); i++){
+        Particle* pi = system->getParticle(i);
+        Vec3r a_p(0.f, 0.f, 0.f);
+        Vec3r a_v(0.f, 0.f, 0.f);
 
-        float rho_i = pi->density;
-        float press_i = pi->pressure;
+        float rho_i = density[i];
+        float press_i = pressure[i];
         float frac_i = press_i / (rho_i*rho_i);
         hash->query(i, h);
         for(int nr = 0; nr<hash->getQuerySize(); nr++) {
-            Particle* pj = system.getParticle(nr);
+            Particle* pj = system->getParticle(nr);
             if(pi == pj) continue;
-            Vec3 r = (pj->pos - pi->pos);
+            Vec3r r = (pj->pos - pi->pos);
             if(r.norm() > h) continue;
 
-            float rho_j = pi->density;
-            float press_j = pi->pressure;
+            float rho_j = density[i];
+            float press_j = pressure[i];
             float frac_j = press_j / (rho_j*rho_j);
             float Pij = pj->mass * (frac_i + frac_j);
 
             a_p += Pij * spiky(r, h);
 
-            Vec3 Vij = viscosity * pj->mass * (pj->vel - pi->vel) / (rho_i * rho_j);
+            Vec3r Vij = viscosity * pj->mass * (pj->vel - pi->vel) / (rho_i * rho_j);
             a_v += Vij * this->visco(r, h);
         }
         // apply force
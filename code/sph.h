@@ -6,26 +6,28 @@
 #include "hash.h"
 #include <math.h>
 
-class SPH : public Force
+// Works in the Real precision, Particle and ParticleSystem are the ForceT<3, Real> ones
+class SPH : public ForceT<3, Real>
 {
 public:
-    SPH(ParticleSystem system, double width, double height, double depth);
-    ParticleSystem getSystem(){return system;}
-    void setSystem(ParticleSystem system){this->system = system;}
+    typedef ParticleSystem::Accumulator Accumulator;
+
+    // works on the particles of system, the force still has to be added to it
+    SPH(ParticleSystem* system, double width, double height, double depth);
     void computeDensityPressure();
     virtual void apply();
-    Vec3 spiky(Vec3 r, double h);
-    double visco(Vec3 r, double h);
+    Vec3r spiky(Vec3r r, Real h);
+    Real visco(Vec3r r, Real h);
 protected:
-    ParticleSystem system;
-    Hash* hash;
-    IntegratorSymplecticEuler integrator;
+    HashT<Real>* hash;
+    IntegratorSymplecticEulerT<3, Real> integrator;
     double width, height, depth;
-    double h = 15;
-    double poly6 = 315/(64 * M_PI * std::pow(h,9)); //muller's poly6 kernel
-    double gasConstant = 1;
-    double restDensity = 1000;
-    double viscosity = 0.001;
+    Real h = 15;
+    Real poly6 = 315/(64 * M_PI * std::pow(h,9)); //muller's poly6 kernel
+    Real gasConstant = 1;
+    Real restDensity = 1000;
+    Real viscosity = Real(0.001);
+    int densityAttr, pressureAttr;  // system attributes
 };
 
 #endif // SPH_H
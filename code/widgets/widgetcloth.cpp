@@ -51,3 +51,11 @@ bool WidgetCloth::showParticles() const {
 int WidgetCloth::getFixed() const {
     return ui->comboBox->currentIndex();
 }
+
+int WidgetCloth::getIntegrator() const {
+    return ui->integrator->currentIndex();
+}
+
+int WidgetCloth::getSpringLayout() const {
+    return ui->springLayout->currentIndex();
+}
@@ -27,6 +27,8 @@ public:
     bool showParticles()       const;
 
     int getFixed()     const;
+    int getIntegrator() const;    // 0 IMEX Euler, 1 RK45
+    int getSpringLayout() const;  // 0 spring network, 1 grid stencil
 
 signals:
     void updatedParameters();
@@ -40,6 +40,22 @@ double WidgetNBody::getSmoothingB() const {
     return ui->smoothB->value();
 }
 
+int WidgetNBody::getGravityType() const {
+    return ui->gravity->currentIndex();
+}
+
+double WidgetNBody::getOpeningAngle() const {
+    return ui->openingAngle->value();
+}
+
+int WidgetNBody::getExpansionOrder() const {
+    return ui->expansionOrder->value();
+}
+
+int WidgetNBody::getLeafSize() const {
+    return ui->leafSize->value();
+}
+
 bool WidgetNBody::drawTrajectories() const {
     return ui->trajectory->isChecked();
 }
@@ -21,6 +21,10 @@ public:
     double getMassRange()      const;
     double getSmoothingA()     const;
     double getSmoothingB()     const;
+    int    getGravityType()    const;   // 0 pairwise, 1 Barnes-Hut, 2 fast multipole
+    double getOpeningAngle()   const;
+    int    getExpansionOrder() const;
+    int    getLeafSize()       const;
     bool   drawTrajectories()  const;
 
 signals:
@@ -0,0 +1,10 @@
+#include "tests.h"
+
+int main() {
+    int failures = 0;
+    failures += testParticleSystem();
+    failures += testIntegrators();
+    failures += testStateVersion();
+    std::cout << failures << " failed" << std::endl;
+    return failures;
+}
@@ -0,0 +1,178 @@
+#include "tests.h"
+#include "particlesystem.h"
+#include "integrators.h"
+#include <chrono>
+
+namespace {
+    // eccentric orbit of a light body around a pinned unit mass, position at time 10
+    Vec3 orbit(Integrator& integrator, double dt) {
+        ParticleSystem system;
+        system.createParticles(2);
+        system.getParticle(0)->mass = 1;
+        system.getParticle(0)->pin();
+        system.getParticle(1)->mass = 1e-3;
+        system.getParticle(1)->pos = Vec3(1, 0, 0);
+        system.getParticle(1)->vel = Vec3(0, 1.2, 0);
+        ForceNBodyDirect* force = new ForceNBodyDirect(1);
+        force->setSmoothingFactors(100, 1);     // no smoothing past r = 0.3
+        force->setInfluenceAll();
+        system.addForce(force);
+        const int steps = int(10/dt + 0.5);
+        for (int i = 0; i < steps; i++) integrator.step(system, dt);
+        const Vec3 pos = system.getParticle(1)->pos;
+        system.deleteForces();
+        return pos;
+    }
+
+    // PEFRL is 4th order like Yoshida4, but with a much smaller error constant
+    int splittingErrorConstants() {
+        IntegratorYoshida6 yoshida6;
+        const Vec3 reference = orbit(yoshida6, 1e-4);
+        IntegratorYoshida4 yoshida4;
+        IntegratorPEFRL pefrl, pefrlHalf;
+        const double errorY4 = (orbit(yoshida4, 0.02) - reference).norm();
+        const double errorP = (orbit(pefrl, 0.02) - reference).norm();
+        const double errorPHalf = (orbit(pefrlHalf, 0.01) - reference).norm();
+        int failures = 0;
+        failures += check("PEFRL, error ratio against Yoshida4", errorP < errorY4/20, errorY4/errorP);
+        failures += check("PEFRL, error ratio halving dt", errorP/errorPHalf > 12 && errorP/errorPHalf < 20, errorP/errorPHalf);
+        return failures;
+    }
+
+    // a body on a stiff spring to a pinned anchor, both owned by the system
+    ParticleSystem* makeOscillator() {
+        ParticleSystem* system = new ParticleSystem();
+        system->createParticles(2);
+        system->getParticle(0)->pin();
+        system->getParticle(1)->pos = Vec3(1.5, 0, 0);
+        system->getParticle(1)->vel = Vec3(0, 1, 0);
+        system->addForce(new ForceSpring(system->getParticle(0), system->getParticle(1), 1, 20, 0.1));
+        return system;
+    }
+
+    double seconds(const std::chrono::steady_clock::time_point& start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // After K iterations the K slices are all exact: Parareal gives the fine serial solution.
+    // Stopping at a tolerance it needs fewer, which is where the speedup comes from. That
+    // needs a core per slice, so it is only reported.
+    int pararealAgainstFine() {
+        const unsigned int slices = 4, fineSteps = 20000;
+        const double dt = 2.0;
+        auto coarse = []() { return new IntegratorRK4(); };
+        auto fine = []() { return new IntegratorRK4(); };
+
+        ParticleSystem* serial = makeOscillator();
+        IntegratorRK4 rk4;
+        auto start = std::chrono::steady_clock::now();
+        serial->updateForces();
+        for (unsigned int i = 0; i < slices*fineSteps; i++) rk4.step(*serial, dt/(slices*fineSteps));
+        const double serialTime = seconds(start);
+
+        int failures = 0;
+        {
+            IntegratorPararealT<3, double> parareal(coarse, fine, makeOscillator);
+            parareal.setSlices(slices);
+            parareal.setSubsteps(100, fineSteps);
+            parareal.setTolerance(0);
+            ParticleSystem* system = makeOscillator();
+            parareal.step(*system, dt);
+            const double error = (system->getState() - serial->getState()).cwiseAbs().maxCoeff();
+            failures += check("Parareal, K iterations against fine serial, max error", error < 1e-12, error);
+            failures += check("Parareal, K iterations", parareal.getIterations() == slices, parareal.getIterations());
+            system->deleteForces();
+            system->deleteParticles();
+            delete system;
+        }
+        {
+            IntegratorPararealT<3, double> parareal(coarse, fine, makeOscillator);
+            parareal.setSlices(slices);
+            parareal.setSubsteps(100, fineSteps);
+            parareal.setTolerance(1e-8);
+            ParticleSystem* system = makeOscillator();
+            parareal.step(*system, dt);     // starts the threads
+            system->deleteForces();
+            system->deleteParticles();
+            delete system;
+
+            system = makeOscillator();
+            start = std::chrono::steady_clock::now();
+            parareal.step(*system, dt);
+            const double pararealTime = seconds(start);
+            const double error = (system->getState() - serial->getState()).cwiseAbs().maxCoeff();
+            failures += check("Parareal, tolerance 1e-8 against fine serial, max error", error < 1e-6, error);
+            failures += check("Parareal, iterations for tolerance 1e-8", parareal.getIterations() < slices, parareal.getIterations());
+            std::cout << "     Parareal, speedup over fine serial: " << serialTime/pararealTime << std::endl;
+            system->deleteForces();
+            system->deleteParticles();
+            delete system;
+        }
+        serial->deleteForces();
+        serial->deleteParticles();
+        delete serial;
+        return failures;
+    }
+
+    // weak pull towards the origin that counts its evaluations
+    class ForceCountedPull : public ForceT<3, double> {
+    public:
+        virtual void apply() {
+            evaluations++;
+            forEachInfluenced([](Particle* p) { p->force -= 0.05*p->pos; });
+        }
+        unsigned int evaluations = 0;
+    };
+
+    // a body on a stiff spring (fast) and a weak pull (slow), position after 50 steps
+    Vec3 multiRate(Integrator& integrator, double dt, double slowInterval, unsigned int& slowEvaluations) {
+        ParticleSystem system;
+        system.createParticles(2);
+        system.getParticle(0)->pos = Vec3(2, 0, 0);
+        system.getParticle(0)->pin();
+        system.getParticle(1)->pos = Vec3(3, 0, 0);
+        system.getParticle(1)->vel = Vec3(0, 1, 0);
+        system.addForce(new ForceSpring(system.getParticle(0), system.getParticle(1), 1, 400, 0));
+        ForceCountedPull* slow = new ForceCountedPull();
+        slow->addInfluencedParticle(system.getParticle(1));
+        slow->setUpdateInterval(slowInterval);
+        system.addForce(slow);
+        const int steps = int(5/dt + 0.5);
+        for (int i = 0; i < steps; i++) integrator.step(system, dt);
+        slowEvaluations = slow->evaluations;
+        const Vec3 pos = system.getParticle(1)->pos;
+        system.deleteForces();
+        return pos;
+    }
+
+    // the slow force once per step, the rest every substep: close to evaluating everything
+    // every substep, well below freezing the slow force, the hold error shrinking with the step
+    int multiRateSubsteps() {
+        const double dt = 0.1;
+        const unsigned int substeps = 20;
+        unsigned int slowEvaluations, referenceEvaluations, unused;
+        IntegratorMultiRate integrator(new IntegratorVelocityVerlet(), substeps);
+        IntegratorMultiRate half(new IntegratorVelocityVerlet(), substeps/2);
+        IntegratorMultiRate reference(new IntegratorVelocityVerlet(), substeps);
+        const Vec3 pos = multiRate(integrator, dt, dt, slowEvaluations);
+        const Vec3 exact = multiRate(reference, dt, 0, referenceEvaluations);
+        const Vec3 frozen = multiRate(reference, dt, 1e9, unused);
+        const double error = (pos - exact).norm();
+        const double errorHalf = (multiRate(half, dt/2, dt/2, unused) - exact).norm();
+        const double effect = (frozen - exact).norm();
+        int failures = 0;
+        failures += check("multi-rate, slow force evaluations for 50 steps", slowEvaluations == 51, slowEvaluations);
+        failures += check("multi-rate, reference evaluations for 50 steps", referenceEvaluations == 50*substeps + 1, referenceEvaluations);
+        failures += check("multi-rate, distance to every force every substep", error < 0.2*effect, error);
+        failures += check("multi-rate, error ratio halving the step", errorHalf > 0 && error/errorHalf > 1.5, error/errorHalf);
+        return failures;
+    }
+}
+
+int testIntegrators() {
+    int failures = 0;
+    failures += splittingErrorConstants();
+    failures += pararealAgainstFine();
+    failures += multiRateSubsteps();
+    return failures;
+}
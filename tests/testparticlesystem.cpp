@@ -0,0 +1,57 @@
+#include "tests.h"
+#include "particlesystem.h"
+#include "forces.h"
+
+namespace {
+    // a fountain emits a small batch every frame, the storage has to grow geometrically
+    int batchGrowth() {
+        ParticleSystem system;
+        unsigned int reallocations = 0, capacity = system.getParticleCapacity();
+        for (int frame = 0; frame < 1000; frame++) {
+            system.createParticles(10);
+            if (system.getParticleCapacity() != capacity) reallocations++;
+            capacity = system.getParticleCapacity();
+        }
+        int failures = 0;
+        failures += check("batch growth, capacity for 10000 particles", capacity >= 10000 && capacity <= 20000, capacity);
+        failures += check("batch growth, reallocations", reallocations <= 12, reallocations);
+        return failures;
+    }
+
+    // the implicit integrators may take Jacobians of a fresh cloth grid before any force
+    // evaluation, they have to match the ones taken after it
+    int clothGridJacobianFirst() {
+        ParticleSystem system;
+        const unsigned int rows = 7, cols = 9, n = rows*cols;
+        system.createParticles(n);
+        for (unsigned int k = 0; k < n; k++) {
+            system.getParticle(k)->pos = Vec3(0.11*(k % cols) + 0.01*(k % 3), 0.1*(k / cols), 0.02*(k % 5));
+        }
+        ForceClothGrid* cloth = new ForceClothGrid();
+        cloth->setGrid(0, rows, cols, 0.1, 0.1);
+        cloth->setCoefficients(ForceClothGrid::Stretch, 100, 1);
+        cloth->setCoefficients(ForceClothGrid::Shear, 50, 1);
+        cloth->setCoefficients(ForceClothGrid::Bend, 10, 1);
+        system.addForce(cloth);
+        Vecr y(3*n), before = Vecr::Zero(3*n), after = Vecr::Zero(3*n);
+        for (unsigned int i = 0; i < 3*n; i++) y[i] = std::sin(0.7*i);
+        cloth->addJacobianProduct(0.01, 0.1, y.data(), before.data());
+        Vecr diagBefore = Vecr::Zero(3*n), diagAfter = Vecr::Zero(3*n);
+        cloth->addJacobianDiagonal(0.01, 0.1, diagBefore.data());
+        system.updateForces();
+        cloth->addJacobianProduct(0.01, 0.1, y.data(), after.data());
+        cloth->addJacobianDiagonal(0.01, 0.1, diagAfter.data());
+        system.deleteForces();
+        const double error = (before - after).norm() + (diagBefore - diagAfter).norm();
+        int failures = 0;
+        failures += check("cloth grid, Jacobians before and after apply", after.norm() > 0 && error < 1e-12, error);
+        return failures;
+    }
+}
+
+int testParticleSystem() {
+    int failures = 0;
+    failures += batchGrowth();
+    failures += clothGridJacobianFirst();
+    return failures;
+}
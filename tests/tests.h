@@ -0,0 +1,17 @@
+#ifndef TESTS_H
+#define TESTS_H
+
+#include <iostream>
+#include <string>
+
+// Each test file runs its checks and returns the number that failed.
+int testParticleSystem();
+int testIntegrators();
+int testStateVersion();
+
+inline int check(const std::string& name, bool ok, double value) {
+    std::cout << (ok ? "ok   " : "FAIL ") << name << ": " << value << std::endl;
+    return ok ? 0 : 1;
+}
+
+#endif // TESTS_H
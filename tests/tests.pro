@@ -0,0 +1,22 @@
+# Console checks of the simulation core, no Qt needed:
+#   qmake tests.pro && make && ./tests
+TEMPLATE = app
+TARGET = tests
+CONFIG += console c++11 thread
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += ../code
+INCLUDEPATH += ../extlibs
+
+HEADERS += \
+    tests.h
+
+SOURCES += \
+    main.cpp \
+    testintegrators.cpp \
+    testparticlesystem.cpp \
+    teststateversion.cpp \
+    ../code/forces.cpp \
+    ../code/integrators.cpp \
+    ../code/particlepool.cpp \
+    ../code/particlesystem.cpp
@@ -0,0 +1,110 @@
+#include "tests.h"
+#include "particlesystem.h"
+#include "integrators.h"
+#include <random>
+
+// The tree forces cache their tree on the state version, and the multi-stage
+// integrators write their stages through views taken once. With theta 0 the tree
+// forces are exact, so stepping with them has to match the all-pairs force. With an
+// opening angle the far field goes through the expansions and has to stay close to it.
+
+namespace {
+    void makeBodies(ParticleSystem& system, unsigned int n = 40) {
+        std::mt19937 gen(7);
+        std::uniform_real_distribution<> pos(-10, 10), vel(-1, 1), mass(1, 5);
+        system.createParticles(n);
+        for (unsigned int i = 0; i < system.getNumParticles(); i++) {
+            Particle* p = system.getParticle(i);
+            p->pos = Vec3(pos(gen), pos(gen), pos(gen));
+            p->vel = Vec3(vel(gen), vel(gen), vel(gen));
+            p->mass = mass(gen);
+        }
+    }
+
+    // largest position difference after 20 steps with force against the all-pairs force
+    double compare(Integrator& integrator, Integrator& reference, Force* force) {
+        ParticleSystem cached, exact;
+        makeBodies(cached);
+        makeBodies(exact);
+        force->setInfluenceAll();
+        cached.addForce(force);
+        ForceNBodyDirect* direct = new ForceNBodyDirect(1);
+        direct->setInfluenceAll();
+        exact.addForce(direct);
+        for (int i = 0; i < 20; i++) {
+            integrator.step(cached, 0.05);
+            reference.step(exact, 0.05);
+        }
+        const double error = (cached.getPositions() - exact.getPositions()).cwiseAbs().maxCoeff();
+        cached.deleteForces();
+        exact.deleteForces();
+        return error;
+    }
+
+    // rms of the force difference to the all-pairs force, relative to its rms
+    double relativeError(Force* force) {
+        ParticleSystem approx, exact;
+        makeBodies(approx, 2000);
+        makeBodies(exact, 2000);
+        force->setInfluenceAll();
+        approx.addForce(force);
+        ForceNBodyDirect* direct = new ForceNBodyDirect(1);
+        direct->setInfluenceAll();
+        exact.addForce(direct);
+        approx.updateForces();
+        exact.updateForces();
+        const double error = (approx.getForcesView() - exact.getForcesView()).norm()/exact.getForcesView().norm();
+        approx.deleteForces();
+        exact.deleteForces();
+        return error;
+    }
+
+    int checkApproximation() {
+        int failures = 0;
+        {
+            ForceBarnesHut* force = new ForceBarnesHut(1);
+            force->setOpeningAngle(0.5);
+            const double error = relativeError(force);
+            failures += check("Barnes-Hut, theta 0.5, relative rms error", error < 1e-2, error);
+        }
+        {
+            ForceFMM* force = new ForceFMM(1);
+            force->setOpeningAngle(0.5);
+            force->setOrder(4);
+            force->setLeafSize(16);
+            const double error = relativeError(force);
+            failures += check("fast multipole, theta 0.5, order 4, relative rms error", error < 1e-3, error);
+        }
+        return failures;
+    }
+
+    template <class IntegratorType>
+    int checkIntegrator(const std::string& name) {
+        int failures = 0;
+        {
+            IntegratorType integrator, reference;
+            ForceBarnesHut* force = new ForceBarnesHut(1);
+            force->setOpeningAngle(0);
+            const double error = compare(integrator, reference, force);
+            failures += check(name + ", Barnes-Hut, max error", error < 1e-8, error);
+        }
+        {
+            IntegratorType integrator, reference;
+            ForceFMM* force = new ForceFMM(1);
+            force->setOpeningAngle(0);
+            const double error = compare(integrator, reference, force);
+            failures += check(name + ", fast multipole, max error", error < 1e-8, error);
+        }
+        return failures;
+    }
+}
+
+int testStateVersion() {
+    int failures = 0;
+    failures += checkIntegrator<IntegratorVelocityVerlet>("velocity Verlet");
+    failures += checkIntegrator<IntegratorRK4>("RK4");
+    failures += checkIntegrator<IntegratorRK45>("RK45");
+    failures += checkIntegrator<IntegratorBulirschStoer>("Bulirsch-Stoer");
+    failures += checkApproximation();
+    return failures;
+}